@@ -0,0 +1,124 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#include "tarfs.h"
+
+/*
+ * Init an arena with a chunk size.
+ */
+void tar_arena_init_chunk(struct tar_arena *arena, size_t chunk_size)
+{
+  arena->chunks = NULL;
+  arena->cur = NULL;
+  arena->left = 0;
+  arena->size = 0;
+  arena->chunk_size = chunk_size;
+}
+
+/*
+ * Init an arena.
+ */
+void tar_arena_init(struct tar_arena *arena)
+{
+  tar_arena_init_chunk(arena, TARFS_ARENA_CHUNK_SIZE);
+}
+
+/*
+ * Add a chunk to an arena.
+ */
+static struct tar_arena_chunk *tar_arena_add_chunk(struct tar_arena *arena, size_t size)
+{
+  struct tar_arena_chunk *chunk;
+
+  chunk = (struct tar_arena_chunk *) kvmalloc(sizeof(struct tar_arena_chunk) + size, GFP_KERNEL);
+  if (!chunk)
+    return NULL;
+
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->size += size;
+
+  return chunk;
+}
+
+/*
+ * Allocate memory from an arena (memory is released with the whole arena).
+ */
+void *tar_arena_alloc(struct tar_arena *arena, size_t size)
+{
+  struct tar_arena_chunk *chunk;
+  void *ret;
+
+  size = ALIGN(size, sizeof(long));
+
+  /* big allocation : use a dedicated chunk (keep current chunk) */
+  if (size > arena->chunk_size / 4) {
+    chunk = tar_arena_add_chunk(arena, size);
+    return chunk ? chunk->data : NULL;
+  }
+
+  /* current chunk is full : allocate a new one */
+  if (size > arena->left) {
+    chunk = tar_arena_add_chunk(arena, arena->chunk_size);
+    if (!chunk)
+      return NULL;
+
+    arena->cur = chunk->data;
+    arena->left = arena->chunk_size;
+  }
+
+  /* bump allocation */
+  ret = arena->cur;
+  arena->cur += size;
+  arena->left -= size;
+
+  return ret;
+}
+
+/*
+ * Duplicate a string in an arena.
+ */
+char *tar_arena_strndup(struct tar_arena *arena, const char *s, size_t len)
+{
+  char *ret;
+
+  ret = (char *) tar_arena_alloc(arena, len + 1);
+  if (!ret)
+    return NULL;
+
+  memcpy(ret, s, len);
+  ret[len] = 0;
+
+  return ret;
+}
+
+/*
+ * Move all chunks of an arena to another one (memory allocated from src is released with dst).
+ */
+void tar_arena_merge(struct tar_arena *dst, struct tar_arena *src)
+{
+  struct tar_arena_chunk **tail;
+
+  for (tail = &src->chunks; *tail; tail = &(*tail)->next);
+  *tail = dst->chunks;
+  dst->chunks = src->chunks;
+  dst->size += src->size;
+
+  tar_arena_init_chunk(src, src->chunk_size);
+}
+
+/*
+ * Release an arena.
+ */
+void tar_arena_free(struct tar_arena *arena)
+{
+  struct tar_arena_chunk *chunk, *next;
+
+  for (chunk = arena->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    kvfree(chunk);
+  }
+
+  tar_arena_init_chunk(arena, arena->chunk_size);
+}
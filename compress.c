@@ -0,0 +1,513 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/zstd.h>
+#include <linux/zlib.h>
+#include <linux/seq_file.h>
+#include <asm/unaligned.h>
+
+#include "tarfs.h"
+
+#define ZSTD_MAGIC                          0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC                0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC                 0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER_SIZE           9
+#define ZSTD_SEEKABLE_CHECKSUM_FLAG         (1 << 7)
+
+#define GZIP_ID1                            0x1f
+#define GZIP_ID2                            0x8b
+#define GZIP_FEXTRA                         (1 << 2)
+#define GZIP_HEADER_SIZE                    12
+#define GZIP_TRAILER_SIZE                   8
+
+/*
+ * Read compressed data.
+ */
+static int tar_compress_read_raw(struct tar_compress *c, void *buf, size_t len, loff_t off)
+{
+  ssize_t ret;
+
+  ret = kernel_read(c->file, buf, len, &off);
+  if (ret < 0)
+    return ret;
+
+  return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Add a frame.
+ */
+static int tar_compress_add_frame(struct tar_compress *c, u64 coff, u32 clen, u32 dlen, u32 *max_frames)
+{
+  struct tar_frame *frames;
+
+  /* frames are fully decompressed in memory : bound their size */
+  if (!clen || dlen > TARFS_FRAME_MAX_SIZE || clen > TARFS_FRAME_MAX_SIZE)
+    return -EINVAL;
+
+  /* skip empty frames */
+  if (!dlen)
+    return 0;
+
+  /* grow frames */
+  if (c->nr_frames >= *max_frames) {
+    *max_frames = *max_frames ? *max_frames * 2 : 1024;
+    frames = kvmalloc_array(*max_frames, sizeof(struct tar_frame), GFP_KERNEL);
+    if (!frames)
+      return -ENOMEM;
+
+    if (c->frames) {
+      memcpy(frames, c->frames, sizeof(struct tar_frame) * c->nr_frames);
+      kvfree(c->frames);
+    }
+    c->frames = frames;
+  }
+
+  /* add frame */
+  c->frames[c->nr_frames].coff = coff;
+  c->frames[c->nr_frames].doff = c->size;
+  c->frames[c->nr_frames].clen = clen;
+  c->frames[c->nr_frames].dlen = dlen;
+  c->nr_frames++;
+  c->size += dlen;
+  c->max_clen = max(c->max_clen, clen);
+
+  return 0;
+}
+
+/*
+ * Load frames of a zstd seekable archive (seek table is stored in a skippable frame at the end of file).
+ */
+static int tar_compress_load_zstd(struct tar_compress *c, loff_t file_size)
+{
+  u8 footer[ZSTD_SEEKABLE_FOOTER_SIZE], *table;
+  u32 nr_frames, entry_size, max_frames = 0, i;
+  size_t table_size;
+  u64 coff;
+  int err;
+
+  /* read footer */
+  if (file_size < ZSTD_SEEKABLE_FOOTER_SIZE + 8)
+    return -EINVAL;
+  err = tar_compress_read_raw(c, footer, sizeof(footer), file_size - sizeof(footer));
+  if (err)
+    return err;
+  if (get_unaligned_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+    return -EINVAL;
+
+  /* compute seek table size */
+  nr_frames = get_unaligned_le32(footer);
+  entry_size = footer[4] & ZSTD_SEEKABLE_CHECKSUM_FLAG ? 12 : 8;
+  table_size = 8 + (size_t) nr_frames * entry_size + ZSTD_SEEKABLE_FOOTER_SIZE;
+  if (table_size > file_size)
+    return -EINVAL;
+
+  /* read seek table */
+  table = kvmalloc(table_size, GFP_KERNEL);
+  if (!table)
+    return -ENOMEM;
+  err = tar_compress_read_raw(c, table, table_size, file_size - table_size);
+  if (err)
+    goto out;
+
+  err = -EINVAL;
+  if (get_unaligned_le32(table) != ZSTD_SKIPPABLE_MAGIC || get_unaligned_le32(table + 4) != table_size - 8)
+    goto out;
+
+  /* add frames */
+  for (i = 0, coff = 0; i < nr_frames; i++) {
+    err = tar_compress_add_frame(c, coff, get_unaligned_le32(table + 8 + i * entry_size),
+                                 get_unaligned_le32(table + 8 + i * entry_size + 4), &max_frames);
+    if (err)
+      goto out;
+
+    coff += get_unaligned_le32(table + 8 + i * entry_size);
+  }
+
+  /* frames must cover the whole file */
+  err = coff + table_size == file_size ? 0 : -EINVAL;
+out:
+  kvfree(table);
+  return err;
+}
+
+/*
+ * Load frames of a BGZF archive (gzip members with a "BC" extra field holding the member size).
+ */
+static int tar_compress_load_gzip(struct tar_compress *c, loff_t file_size)
+{
+  u8 hdr[GZIP_HEADER_SIZE + 64], trailer[GZIP_TRAILER_SIZE];
+  u32 max_frames = 0, xlen, slen, clen, i;
+  loff_t off;
+  int err;
+
+  for (off = 0; off < file_size; off += clen) {
+    /* read member header */
+    if (file_size - off < sizeof(hdr))
+      memset(hdr, 0, sizeof(hdr));
+    err = tar_compress_read_raw(c, hdr, min_t(loff_t, sizeof(hdr), file_size - off), off);
+    if (err)
+      return err;
+
+    /* check member header (only an extra field is allowed) */
+    xlen = get_unaligned_le16(hdr + 10);
+    if (hdr[0] != GZIP_ID1 || hdr[1] != GZIP_ID2 || hdr[2] != Z_DEFLATED || hdr[3] != GZIP_FEXTRA
+        || GZIP_HEADER_SIZE + xlen > sizeof(hdr))
+      return -EINVAL;
+
+    /* find member size in extra field */
+    for (i = 0, clen = 0; i + 4 <= xlen; i += 4 + slen) {
+      slen = get_unaligned_le16(hdr + GZIP_HEADER_SIZE + i + 2);
+      if (hdr[GZIP_HEADER_SIZE + i] == 'B' && hdr[GZIP_HEADER_SIZE + i + 1] == 'C' && slen == 2)
+        clen = get_unaligned_le16(hdr + GZIP_HEADER_SIZE + i + 4) + 1;
+    }
+    if (clen < GZIP_HEADER_SIZE + xlen + GZIP_TRAILER_SIZE || clen > file_size - off)
+      return -EINVAL;
+
+    /* read decompressed size in member trailer */
+    err = tar_compress_read_raw(c, trailer, sizeof(trailer), off + clen - GZIP_TRAILER_SIZE);
+    if (err)
+      return err;
+
+    err = tar_compress_add_frame(c, off, clen, get_unaligned_le32(trailer + 4), &max_frames);
+    if (err)
+      return err;
+  }
+
+  return 0;
+}
+
+/*
+ * Decompress a frame.
+ */
+static int tar_compress_inflate(struct tar_compress *c, struct tar_frame *frame, char *dst)
+{
+  u32 xlen;
+  size_t ret;
+
+  /* zstd frame */
+  if (c->type == TARFS_COMPRESS_ZSTD) {
+    ret = zstd_decompress_dctx(c->dctx, dst, frame->dlen, c->cbuf, frame->clen);
+    return zstd_is_error(ret) || ret != frame->dlen ? -EIO : 0;
+  }
+
+  /* gzip member : inflate raw deflate data */
+  xlen = get_unaligned_le16(c->cbuf + 10);
+  c->zstrm.next_in = c->cbuf + GZIP_HEADER_SIZE + xlen;
+  c->zstrm.avail_in = frame->clen - GZIP_HEADER_SIZE - xlen - GZIP_TRAILER_SIZE;
+  c->zstrm.next_out = dst;
+  c->zstrm.avail_out = frame->dlen;
+  if (zlib_inflateReset(&c->zstrm) != Z_OK || zlib_inflate(&c->zstrm, Z_FINISH) != Z_STREAM_END
+      || c->zstrm.total_out != frame->dlen)
+    return -EIO;
+
+  return 0;
+}
+
+/*
+ * Release cached frames (least recently used first) until cache size is below a limit.
+ */
+static unsigned long tar_compress_evict(struct tar_compress *c, size_t limit, unsigned long max)
+{
+  struct tar_frame_buf *fb;
+  unsigned long freed = 0;
+
+  while (c->cache_size > limit && freed < max && !list_empty(&c->lru)) {
+    fb = list_last_entry(&c->lru, struct tar_frame_buf, lru);
+    list_del(&fb->lru);
+    c->cache[fb->index] = NULL;
+    c->cache_size -= c->frames[fb->index].dlen;
+    c->nr_cached--;
+    kvfree(fb->data);
+    kfree(fb);
+    freed++;
+  }
+
+  return freed;
+}
+
+/*
+ * Get a decompressed frame (from cache or decompress it). Must be called with lock held.
+ */
+static const char *tar_compress_get_frame(struct tar_compress *c, u32 index)
+{
+  struct tar_frame *frame = &c->frames[index];
+  struct tar_frame_buf *fb;
+  int err;
+
+  /* frame is cached */
+  fb = c->cache[index];
+  if (fb) {
+    c->hits++;
+    list_move(&fb->lru, &c->lru);
+    return fb->data;
+  }
+
+  /* allocate frame */
+  c->misses++;
+  fb = kmalloc(sizeof(struct tar_frame_buf), GFP_KERNEL);
+  if (!fb)
+    return ERR_PTR(-ENOMEM);
+  fb->index = index;
+  fb->data = kvmalloc(frame->dlen, GFP_KERNEL);
+  if (!fb->data) {
+    kfree(fb);
+    return ERR_PTR(-ENOMEM);
+  }
+
+  /* read and decompress frame */
+  err = tar_compress_read_raw(c, c->cbuf, frame->clen, frame->coff);
+  if (!err)
+    err = tar_compress_inflate(c, frame, fb->data);
+  if (err) {
+    kvfree(fb->data);
+    kfree(fb);
+    return ERR_PTR(err);
+  }
+
+  /* make room and cache frame */
+  tar_compress_evict(c, c->cache_max > frame->dlen ? c->cache_max - frame->dlen : 0, ULONG_MAX);
+  list_add(&fb->lru, &c->lru);
+  c->cache[index] = fb;
+  c->cache_size += frame->dlen;
+  c->nr_cached++;
+
+  return fb->data;
+}
+
+/*
+ * Read decompressed archive data (only frames covering the range are decompressed).
+ */
+int tar_compress_read(struct super_block *sb, void *buf, size_t len, loff_t off)
+{
+  struct tar_compress *c = tarfs_sb(sb)->s_compress;
+  struct tar_frame *frame;
+  const char *data;
+  u32 lo, hi, mid;
+  size_t count;
+  int err = 0;
+
+  if (off < 0 || off + len > c->size)
+    return -EIO;
+
+  mutex_lock(&c->lock);
+
+  /* find first frame */
+  for (lo = 0, hi = c->nr_frames; hi - lo > 1;) {
+    mid = lo + (hi - lo) / 2;
+    if (c->frames[mid].doff <= off)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  /* copy data from each frame */
+  for (; len; lo++) {
+    frame = &c->frames[lo];
+    data = tar_compress_get_frame(c, lo);
+    if (IS_ERR(data)) {
+      err = PTR_ERR(data);
+      break;
+    }
+
+    count = min_t(u64, len, frame->doff + frame->dlen - off);
+    memcpy(buf, data + (off - frame->doff), count);
+    buf += count;
+    off += count;
+    len -= count;
+  }
+
+  mutex_unlock(&c->lock);
+  return err;
+}
+
+/*
+ * Count cached frames (shrinker).
+ */
+static unsigned long tar_compress_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+  struct tar_compress *c = container_of(shrinker, struct tar_compress, shrinker);
+
+  return READ_ONCE(c->nr_cached) ?: SHRINK_EMPTY;
+}
+
+/*
+ * Release cached frames (shrinker).
+ */
+static unsigned long tar_compress_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+  struct tar_compress *c = container_of(shrinker, struct tar_compress, shrinker);
+  unsigned long freed;
+
+  if (!mutex_trylock(&c->lock))
+    return SHRINK_STOP;
+
+  freed = tar_compress_evict(c, 0, sc->nr_to_scan);
+  mutex_unlock(&c->lock);
+
+  return freed;
+}
+
+/*
+ * Release a compressed archive.
+ */
+static void tar_compress_free(struct tar_compress *c)
+{
+  if (c->cache) {
+    tar_compress_evict(c, 0, ULONG_MAX);
+    kvfree(c->cache);
+  }
+
+  if (c->type == TARFS_COMPRESS_GZIP && c->workspace)
+    zlib_inflateEnd(&c->zstrm);
+
+  kvfree(c->workspace);
+  kvfree(c->cbuf);
+  kvfree(c->frames);
+  kfree(c);
+}
+
+/*
+ * Init decompression contexts.
+ */
+static int tar_compress_init_ctx(struct tar_compress *c)
+{
+  size_t size;
+
+  /* allocate compressed frame buffer */
+  c->cbuf = kvmalloc(c->max_clen, GFP_KERNEL);
+  if (!c->cbuf)
+    return -ENOMEM;
+
+  /* zstd context */
+  if (c->type == TARFS_COMPRESS_ZSTD) {
+    size = zstd_dctx_workspace_bound();
+    c->workspace = kvmalloc(size, GFP_KERNEL);
+    if (!c->workspace)
+      return -ENOMEM;
+
+    c->dctx = zstd_init_dctx(c->workspace, size);
+    return c->dctx ? 0 : -EINVAL;
+  }
+
+  /* zlib context (raw deflate) */
+  c->workspace = kvmalloc(zlib_inflate_workspacesize(), GFP_KERNEL);
+  if (!c->workspace)
+    return -ENOMEM;
+
+  c->zstrm.workspace = c->workspace;
+  if (zlib_inflateInit2(&c->zstrm, -MAX_WBITS) != Z_OK) {
+    kvfree(c->workspace);
+    c->workspace = NULL;
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+/*
+ * Detect and load a compressed archive (plain archives are left untouched).
+ */
+int tar_compress_init(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct file *file = sbi->s_backing_file;
+  struct tar_compress *c;
+  loff_t file_size;
+  u8 magic[4];
+  int err;
+
+  sbi->s_compress = NULL;
+
+  /* compressed archives are only supported on file backed mounts */
+  if (!file)
+    return 0;
+
+  /* allocate compressed archive */
+  c = kzalloc(sizeof(struct tar_compress), GFP_KERNEL);
+  if (!c)
+    return -ENOMEM;
+  c->file = file;
+  mutex_init(&c->lock);
+  INIT_LIST_HEAD(&c->lru);
+  c->cache_max = TARFS_FRAME_CACHE_SIZE;
+
+  /* detect format */
+  file_size = i_size_read(file_inode(file));
+  err = file_size >= sizeof(magic) ? tar_compress_read_raw(c, magic, sizeof(magic), 0) : -EINVAL;
+  if (err)
+    goto err;
+
+  if (get_unaligned_le32(magic) == ZSTD_MAGIC) {
+    c->type = TARFS_COMPRESS_ZSTD;
+    err = tar_compress_load_zstd(c, file_size);
+  } else if (magic[0] == GZIP_ID1 && magic[1] == GZIP_ID2) {
+    c->type = TARFS_COMPRESS_GZIP;
+    err = tar_compress_load_gzip(c, file_size);
+  } else {
+    /* plain archive */
+    goto err;
+  }
+
+  if (err || !c->nr_frames) {
+    printk("TARFS : unsupported compressed archive (not seekable zstd or BGZF)\n");
+    err = -EINVAL;
+    goto err;
+  }
+
+  /* allocate frames cache and decompression context */
+  err = -ENOMEM;
+  c->cache = kvcalloc(c->nr_frames, sizeof(struct tar_frame_buf *), GFP_KERNEL);
+  if (!c->cache)
+    goto err;
+  err = tar_compress_init_ctx(c);
+  if (err)
+    goto err;
+
+  /* register shrinker (cached frames can be released under memory pressure) */
+  c->shrinker.count_objects = tar_compress_count;
+  c->shrinker.scan_objects = tar_compress_scan;
+  c->shrinker.seeks = DEFAULT_SEEKS;
+  err = register_shrinker(&c->shrinker);
+  if (err)
+    goto err;
+
+  printk("TARFS : %s compressed archive, %u frames, %llu bytes\n",
+         c->type == TARFS_COMPRESS_ZSTD ? "zstd" : "gzip", c->nr_frames, c->size);
+  sbi->s_compress = c;
+  return 0;
+err:
+  tar_compress_free(c);
+  return err;
+}
+
+/*
+ * Release a compressed archive.
+ */
+void tar_compress_exit(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+
+  if (!sbi->s_compress)
+    return;
+
+  unregister_shrinker(&sbi->s_compress->shrinker);
+  tar_compress_free(sbi->s_compress);
+  sbi->s_compress = NULL;
+}
+
+/*
+ * Show compressed archive statistics.
+ */
+void tar_compress_show_stats(struct seq_file *seq, struct super_block *sb)
+{
+  struct tar_compress *c = tarfs_sb(sb)->s_compress;
+
+  if (!c)
+    return;
+
+  seq_printf(seq, "\n\tcompress: frames %u cached %lu cache_bytes %zu hits %lu misses %lu",
+             c->nr_frames, READ_ONCE(c->nr_cached), READ_ONCE(c->cache_size), READ_ONCE(c->hits),
+             READ_ONCE(c->misses));
+}
@@ -0,0 +1,433 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/xxhash.h>
+#include <linux/log2.h>
+#include <linux/pagemap.h>
+#include <linux/cred.h>
+
+#include "tarfs.h"
+
+/*
+ * Content slot (members are grouped by size and content hash).
+ */
+struct tar_dedup_slot {
+  u64                   hash;                 /* content hash */
+  u64                   size;                 /* content size */
+  u32                   ino;                  /* canonical inode number (0 = free slot) */
+};
+
+/*
+ * Check if a member can share its page cache.
+ */
+static bool tar_dedup_candidate(struct tar_entry *entry)
+{
+  return S_ISREG(entry->mode) && entry->data_len
+    && !(entry->flags & (TAR_ENTRY_HIDDEN | TAR_ENTRY_SPARSE | TAR_ENTRY_LNKTYPE | TAR_ENTRY_HARDLINK));
+}
+
+/*
+ * Member content reader. Block device archives are read by an archive scanner (bios to private pages, the page cache
+ * is not used), archive files through a private file without readahead (pages that were not cached are dropped once
+ * read), compressed archives through the frame cache.
+ */
+struct tar_dedup_reader {
+  struct tar_scan       scan;                 /* block device scanner */
+  bool                  scanning;             /* scanner is initialized */
+  struct file           *file;                /* private archive file (NULL = not opened) */
+  u8                    layer;                /* layer of private archive file */
+  void                  *buf;                 /* read buffer (NULL = not allocated) */
+};
+
+/*
+ * Init a member content reader.
+ */
+static void tar_dedup_reader_init(struct tar_dedup_reader *reader)
+{
+  reader->scanning = false;
+  reader->file = NULL;
+  reader->layer = 0;
+  reader->buf = NULL;
+}
+
+/*
+ * Release a member content reader.
+ */
+static void tar_dedup_reader_exit(struct tar_dedup_reader *reader)
+{
+  if (reader->scanning)
+    tar_scan_exit(&reader->scan);
+  if (reader->file)
+    fput(reader->file);
+  kvfree(reader->buf);
+}
+
+/*
+ * Read an archive file range (pages that were not cached before are dropped : hashing must not fill the page cache,
+ * nor evict pages cached by users, prefetch or replay).
+ */
+static int tar_dedup_read_file(struct file *file, void *buf, size_t len, loff_t off)
+{
+  struct address_space *mapping = file->f_mapping;
+  pgoff_t first = off >> PAGE_SHIFT, nr = ((off + len - 1) >> PAGE_SHIFT) - first + 1, i, j;
+  DECLARE_BITMAP(cached, TARFS_DEDUP_CHUNK_SIZE / PAGE_SIZE + 1);
+  struct page *page;
+  ssize_t ret;
+
+  /* find cached pages */
+  bitmap_zero(cached, nr);
+  for (i = 0; i < nr; i++) {
+    page = find_get_page(mapping, first + i);
+    if (page) {
+      __set_bit(i, cached);
+      put_page(page);
+    }
+  }
+
+  ret = kernel_read(file, buf, len, &off);
+
+  /* drop pages read (runs of pages not cached before) */
+  for (i = find_first_zero_bit(cached, nr); i < nr; i = find_next_zero_bit(cached, nr, j)) {
+    j = find_next_bit(cached, nr, i);
+    invalidate_mapping_pages(mapping, first + i, first + j - 1);
+  }
+
+  if (ret < 0)
+    return ret;
+
+  return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Read member data at a position (up to len bytes) : len is reduced to the data returned.
+ * The returned pointer is valid until the next read on the same reader.
+ */
+static const void *tar_dedup_read(struct super_block *sb, struct tar_dedup_reader *reader, struct tar_entry *entry,
+                                  u64 pos, u64 *len)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  size_t count = min_t(u64, *len, TARFS_DEDUP_CHUNK_SIZE);
+  loff_t off = entry->data_off + pos;
+  const char *data;
+  struct file *src;
+  int err;
+
+  /* block device archive : read by scanner */
+  if (!entry->layer && !sbi->s_backing_file && !sbi->s_compress) {
+    if (!reader->scanning) {
+      err = tar_scan_init_window(&reader->scan, sb, 0, TARFS_DEDUP_CHUNK_SIZE);
+      if (err)
+        return ERR_PTR(err);
+      reader->scanning = true;
+    }
+
+    data = tar_scan_read_range(&reader->scan, off, &count);
+    if (!IS_ERR(data))
+      *len = count;
+    return data;
+  }
+
+  /* allocate read buffer */
+  if (!reader->buf) {
+    reader->buf = kvmalloc(TARFS_DEDUP_CHUNK_SIZE, GFP_KERNEL);
+    if (!reader->buf)
+      return ERR_PTR(-ENOMEM);
+  }
+
+  /* compressed archive : read decompressed frames */
+  *len = count;
+  if (!entry->layer && sbi->s_compress) {
+    err = tar_layer_read(sb, 0, reader->buf, count, off);
+    return err ? ERR_PTR(err) : reader->buf;
+  }
+
+  /* archive file : open a private file without readahead (on first read of the layer) */
+  if (!reader->file || reader->layer != entry->layer) {
+    if (reader->file)
+      fput(reader->file);
+
+    src = entry->layer ? sbi->s_layers[entry->layer] : sbi->s_backing_file;
+    reader->file = dentry_open(&src->f_path, O_RDONLY | O_LARGEFILE, current_cred());
+    if (IS_ERR(reader->file)) {
+      err = PTR_ERR(reader->file);
+      reader->file = NULL;
+      return ERR_PTR(err);
+    }
+
+    reader->file->f_mode |= FMODE_RANDOM;
+    reader->layer = entry->layer;
+  }
+
+  err = tar_dedup_read_file(reader->file, reader->buf, count, off);
+  return err ? ERR_PTR(err) : reader->buf;
+}
+
+/*
+ * Hash a member content.
+ */
+static int tar_dedup_hash(struct super_block *sb, struct tar_entry *entry, struct tar_dedup_reader *reader, u64 *hash)
+{
+  struct xxh64_state state;
+  const void *data;
+  u64 pos, len;
+
+  xxh64_reset(&state, 0);
+  for (pos = 0; pos < entry->data_len; pos += len) {
+    len = entry->data_len - pos;
+    data = tar_dedup_read(sb, reader, entry, pos, &len);
+    if (IS_ERR(data))
+      return PTR_ERR(data);
+
+    xxh64_update(&state, data, len);
+    cond_resched();
+  }
+
+  *hash = xxh64_digest(&state);
+  return 0;
+}
+
+/*
+ * Compare two members contents (same size and hash).
+ */
+static bool tar_dedup_same(struct super_block *sb, struct tar_entry *entry1, struct tar_entry *entry2,
+                           struct tar_dedup_reader *reader1, struct tar_dedup_reader *reader2)
+{
+  const void *data1, *data2;
+  u64 pos, len;
+
+  for (pos = 0; pos < entry1->data_len; pos += len) {
+    len = entry1->data_len - pos;
+    data1 = tar_dedup_read(sb, reader1, entry1, pos, &len);
+    if (IS_ERR(data1))
+      return false;
+
+    /* second read may shorten len (first data stays valid) */
+    data2 = tar_dedup_read(sb, reader2, entry2, pos, &len);
+    if (IS_ERR(data2) || memcmp(data1, data2, len))
+      return false;
+  }
+
+  return true;
+}
+
+/*
+ * Deduplication thread : hash members in archive order, then link duplicates to the first identical member.
+ */
+static int tar_dedup_thread(void *data)
+{
+  struct super_block *sb = data;
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_dedup *dedup = &sbi->s_dedup;
+  struct tar_dedup_reader reader, canon_reader;
+  struct tar_dedup_slot *slots = NULL, *slot;
+  struct tar_entry *entry, *canon;
+  u32 ino, nr_slots, nr = 0, i;
+  u64 start = ktime_get_ns(), hash;
+
+  /* init readers (member being hashed and its canonical member) */
+  tar_dedup_reader_init(&reader);
+  tar_dedup_reader_init(&canon_reader);
+
+  /* allocate content slots (at least two slots per candidate) */
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes; ino++)
+    if (tar_dedup_candidate(tar_get_entry(sb, ino)))
+      nr++;
+  nr_slots = roundup_pow_of_two(max_t(u32, nr, 1) * 2);
+  slots = kvcalloc(nr_slots, sizeof(struct tar_dedup_slot), GFP_KERNEL);
+  if (!slots) {
+    printk("TARFS : can't allocate deduplication tables\n");
+    goto out;
+  }
+
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes && !kthread_should_stop(); ino++) {
+    entry = tar_get_entry(sb, ino);
+    if (!tar_dedup_candidate(entry))
+      continue;
+
+    /* hash member */
+    if (tar_dedup_hash(sb, entry, &reader, &hash))
+      continue;
+    dedup->nr_members++;
+    dedup->bytes_hashed += entry->data_len;
+
+    /* find members with same size and hash */
+    for (i = hash & (nr_slots - 1); slots[i].ino; i = (i + 1) & (nr_slots - 1))
+      if (slots[i].hash == hash && slots[i].size == entry->data_len)
+        break;
+    slot = &slots[i];
+
+    /* first member with this content */
+    if (!slot->ino) {
+      slot->hash = hash;
+      slot->size = entry->data_len;
+      slot->ino = ino;
+      continue;
+    }
+
+    /* duplicate member (contents are compared : hashes may collide) */
+    canon = tar_get_entry(sb, slot->ino);
+    if (!tar_dedup_same(sb, entry, canon, &reader, &canon_reader))
+      continue;
+
+    smp_store_release(&dedup->canon[ino], slot->ino);
+    dedup->nr_dups++;
+    dedup->bytes_saved += entry->data_len;
+  }
+
+  dedup->time = ktime_get_ns() - start;
+  printk("TARFS : %llu duplicate members (%llu bytes) found in %llu members in %llu ms\n", dedup->nr_dups,
+         dedup->bytes_saved, dedup->nr_members, div_u64(dedup->time, NSEC_PER_MSEC));
+
+out:
+  kvfree(slots);
+  tar_dedup_reader_exit(&reader);
+  tar_dedup_reader_exit(&canon_reader);
+  smp_store_release(&dedup->done, true);
+
+  /* wait to be stopped */
+  set_current_state(TASK_INTERRUPTIBLE);
+  while (!kthread_should_stop()) {
+    schedule();
+    set_current_state(TASK_INTERRUPTIBLE);
+  }
+  __set_current_state(TASK_RUNNING);
+
+  return 0;
+}
+
+/*
+ * Init content deduplication.
+ */
+void tar_dedup_init(struct tar_dedup *dedup)
+{
+  dedup->enabled = false;
+  dedup->done = false;
+  dedup->canon = NULL;
+  dedup->task = NULL;
+  dedup->nr_members = 0;
+  dedup->nr_dups = 0;
+  dedup->bytes_hashed = 0;
+  dedup->bytes_saved = 0;
+  dedup->time = 0;
+  atomic64_set(&dedup->nr_shared, 0);
+}
+
+/*
+ * Start content deduplication, once all entries are known (errors don't fail the mount).
+ */
+void tar_dedup_start(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_dedup *dedup = &sbi->s_dedup;
+  struct task_struct *task;
+  u32 *canon;
+
+  if (!dedup->enabled)
+    return;
+
+  /* allocate canonical inodes table */
+  canon = kvcalloc(sbi->s_ninodes, sizeof(u32), GFP_KERNEL);
+  if (!canon) {
+    printk("TARFS : can't allocate deduplication table\n");
+    return;
+  }
+  smp_store_release(&dedup->canon, canon);
+
+  /* start deduplication thread */
+  task = kthread_run(tar_dedup_thread, sb, "tarfs-dedup");
+  if (IS_ERR(task)) {
+    printk("TARFS : can't start deduplication thread (err = %ld)\n", PTR_ERR(task));
+    return;
+  }
+
+  dedup->task = task;
+}
+
+/*
+ * Stop content deduplication.
+ */
+void tar_dedup_stop(struct super_block *sb)
+{
+  struct tar_dedup *dedup = &tarfs_sb(sb)->s_dedup;
+
+  if (dedup->task) {
+    kthread_stop(dedup->task);
+    dedup->task = NULL;
+  }
+}
+
+/*
+ * Release content deduplication table.
+ */
+void tar_dedup_release(struct super_block *sb)
+{
+  struct tar_dedup *dedup = &tarfs_sb(sb)->s_dedup;
+
+  kvfree(dedup->canon);
+  dedup->canon = NULL;
+}
+
+/*
+ * Share the page cache of the first identical member (inode is being created).
+ */
+void tar_dedup_inode(struct inode *inode)
+{
+  struct tar_dedup *dedup = &tarfs_sb(inode->i_sb)->s_dedup;
+  struct inode *canon_inode;
+  u32 *canon, ino;
+
+  if (!S_ISREG(inode->i_mode))
+    return;
+
+  /* get canonical inode (published by deduplication thread) */
+  canon = smp_load_acquire(&dedup->canon);
+  if (!canon)
+    return;
+  ino = smp_load_acquire(&canon[inode->i_ino]);
+  if (!ino)
+    return;
+
+  canon_inode = tarfs_iget(inode->i_sb, ino);
+  if (IS_ERR(canon_inode))
+    return;
+
+  /* read canonical member data in canonical page cache */
+  inode->i_mapping = canon_inode->i_mapping;
+  tarfs_i(inode)->entry = tarfs_i(canon_inode)->entry;
+  tarfs_i(inode)->dedup = canon_inode;
+  atomic64_inc(&dedup->nr_shared);
+}
+
+/*
+ * Release the shared page cache of an inode (inode is being evicted).
+ */
+void tar_dedup_evict(struct inode *inode)
+{
+  struct tar_dedup *dedup = &tarfs_sb(inode->i_sb)->s_dedup;
+
+  if (!tarfs_i(inode)->dedup)
+    return;
+
+  iput(tarfs_i(inode)->dedup);
+  tarfs_i(inode)->dedup = NULL;
+  atomic64_dec(&dedup->nr_shared);
+}
+
+/*
+ * Show content deduplication statistics.
+ */
+void tar_dedup_show_stats(struct seq_file *seq, struct super_block *sb)
+{
+  struct tar_dedup *dedup = &tarfs_sb(sb)->s_dedup;
+
+  if (!dedup->enabled)
+    return;
+
+  seq_printf(seq, "\n\tdedup: done %d members %llu dups %llu ratio %llu%% hashed %llu saved %llu shared %lld time_ms %llu",
+             smp_load_acquire(&dedup->done), dedup->nr_members, dedup->nr_dups,
+             dedup->bytes_hashed ? div64_u64(dedup->bytes_saved * 100, dedup->bytes_hashed) : 0,
+             dedup->bytes_hashed, dedup->bytes_saved, atomic64_read(&dedup->nr_shared),
+             div_u64(dedup->time, NSEC_PER_MSEC));
+}
@@ -5,34 +5,41 @@
  */
 static int tarfs_readdir(struct file *file, struct dir_context *ctx)
 {
-  struct tar_entry *entry, *child;
-  struct list_head *pos;
-  loff_t i = 2;
+  struct tar_entry *entry, *child, *target;
+  struct tar_dir *dir;
+  int err, idx;
   
   /* get tar entry */
   entry = tarfs_i(file->f_inode)->entry;
   if (!entry)
     return -ENOENT;
   
+  /* wait for directory to be complete (lazy indexing) */
+  err = tar_lazy_wait(file->f_inode->i_sb, entry);
+  if (err)
+    return err;
+  
   /* emit '.' and '..' */
   if (!dir_emit_dots(file, ctx))
     return 0;
   
-  /* emit all children */
-  list_for_each(pos, &entry->children) {
-    /* skip first entries */
-    if (i++ < ctx->pos)
-      continue;
-    
-    child = list_entry(pos, struct tar_entry, list);
-    if (!dir_emit(ctx, child->name, strlen(child->name), child->ino, DT_UNKNOWN))
+  /* emit children (position is an index in children array, so resuming is O(1)) */
+  idx = tar_meta_read_lock(file->f_inode->i_sb);
+  dir = smp_load_acquire(&entry->dir);
+  for (; dir && ctx->pos - 2 < dir->nr_children; ctx->pos++) {
+    child = tar_get_entry(file->f_inode->i_sb, dir->children[ctx->pos - 2].ino);
+    if (!child) {
+      err = -EIO;
+      break;
+    }
+
+    target = tar_link_target(file->f_inode->i_sb, child);
+    if (!dir_emit(ctx, child->name, child->name_len, target->ino, fs_umode_to_dtype(target->mode)))
       break;
-    
-    /* update position */
-    ctx->pos++;
   }
+  tar_meta_read_unlock(file->f_inode->i_sb, idx);
   
-  return 0;
+  return err;
 }
 
 /*
@@ -42,4 +49,6 @@ struct file_operations tarfs_dir_fops = {
   .llseek                 = generic_file_llseek,
   .read                   = generic_read_dir,
   .iterate_shared         = tarfs_readdir,
+  .unlocked_ioctl         = tarfs_dir_ioctl,
+  .compat_ioctl           = compat_ptr_ioctl,
 };
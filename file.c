@@ -1,32 +1,142 @@
-#include <linux/buffer_head.h>
+#include <linux/iomap.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
 
 #include "tarfs.h"
 
 /*
- * Get a TarFS block.
+ * Map a file range : a TAR member is a single contiguous extent of the archive.
  */
-static int tarfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_res, int create)
+static int tarfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned int flags,
+                             struct iomap *iomap, struct iomap *srcmap)
 {
-  struct tarfs_inode_info *tarfs_inode = tarfs_i(inode);
-  unsigned long phys;
+  struct tar_entry *entry = tarfs_i(inode)->entry;
+  loff_t size = round_up(i_size_read(inode), i_blocksize(inode));
 
-  /* check block number */
-  if (block * inode->i_sb->s_blocksize > inode->i_size)
+  iomap->bdev = inode->i_sb->s_bdev;
+  iomap->flags = 0;
+
+  /* beyond end of member : hole */
+  if (pos >= size) {
+    iomap->type = IOMAP_HOLE;
+    iomap->addr = IOMAP_NULL_ADDR;
+    iomap->offset = pos;
+    iomap->length = length;
     return 0;
+  }
 
-  /* map result buffer */
-  phys = (tarfs_inode->entry->data_off / inode->i_sb->s_blocksize) + block;
-  map_bh(bh_res, inode->i_sb, phys);
+  /* map whole member */
+  iomap->type = IOMAP_MAPPED;
+  iomap->addr = entry->data_off;
+  iomap->offset = 0;
+  iomap->length = size;
 
   return 0;
 }
 
+/*
+ * TarFS iomap operations.
+ */
+const struct iomap_ops tarfs_iomap_ops = {
+  .iomap_begin    = tarfs_iomap_begin,
+};
+
 /*
  * Read full page of a file.
  */
 static int tarfs_readpage(struct file *file, struct page *page)
 {
-  return block_read_full_page(page, tarfs_get_block);
+  return iomap_readpage(page, &tarfs_iomap_ops);
+}
+
+/*
+ * Read ahead pages of a file.
+ */
+static void tarfs_readahead(struct readahead_control *rac)
+{
+  iomap_readahead(rac, &tarfs_iomap_ops);
+}
+
+/*
+ * Read file pages to an iterator (file backed archive or upper layer : copy data from backing file or decompressed
+ * frames, sparse member : zero holes and copy data runs). End of last page is zeroed.
+ */
+static int tarfs_backing_read(struct inode *inode, struct iov_iter *iter, loff_t pos)
+{
+  struct tar_entry *entry = tarfs_i(inode)->entry;
+  loff_t size = i_size_read(inode);
+  size_t len;
+  int err = 0;
+
+  if (pos < size) {
+    len = min_t(loff_t, iov_iter_count(iter), size - pos);
+    if (entry->flags & TAR_ENTRY_SPARSE)
+      err = tar_sparse_read(inode, iter, len, pos);
+    else
+      err = tar_layer_read_iter(inode->i_sb, entry->layer, iter, len, entry->data_off + pos);
+  }
+  if (!err)
+    iov_iter_zero(iov_iter_count(iter), iter);
+
+  return err;
+}
+
+/*
+ * Read full page of a file (file backed archive, upper layer or sparse member).
+ */
+static int tarfs_backing_readpage(struct file *file, struct page *page)
+{
+  struct bio_vec bvec = { .bv_page = page, .bv_len = PAGE_SIZE, .bv_offset = 0 };
+  struct iov_iter iter;
+  int err;
+
+  iov_iter_bvec(&iter, READ, &bvec, 1, PAGE_SIZE);
+  err = tarfs_backing_read(page->mapping->host, &iter, page_offset(page));
+  if (err)
+    SetPageError(page);
+  else
+    SetPageUptodate(page);
+
+  unlock_page(page);
+  return err;
+}
+
+/*
+ * Read ahead pages of a file (file backed archive, upper layer or sparse member) : consecutive pages are filled by a
+ * single read of the backing file or block device page cache.
+ */
+static void tarfs_backing_readahead(struct readahead_control *rac)
+{
+  struct bio_vec bvecs[TARFS_BACKING_RA_PAGES];
+  struct iov_iter iter;
+  struct page *page;
+  unsigned int nr, i;
+  int err;
+
+  for (;;) {
+    /* get next pages (locked) */
+    for (nr = 0; nr < TARFS_BACKING_RA_PAGES && (page = readahead_page(rac)); nr++) {
+      bvecs[nr].bv_page = page;
+      bvecs[nr].bv_len = PAGE_SIZE;
+      bvecs[nr].bv_offset = 0;
+    }
+    if (!nr)
+      break;
+
+    /* read them */
+    iov_iter_bvec(&iter, READ, bvecs, nr, nr * PAGE_SIZE);
+    err = tarfs_backing_read(rac->mapping->host, &iter, page_offset(bvecs[0].bv_page));
+    for (i = 0; i < nr; i++) {
+      if (err)
+        SetPageError(bvecs[i].bv_page);
+      else
+        SetPageUptodate(bvecs[i].bv_page);
+      unlock_page(bvecs[i].bv_page);
+      put_page(bvecs[i].bv_page);
+    }
+  }
 }
 
 /*
@@ -34,7 +144,203 @@ static int tarfs_readpage(struct file *file, struct page *page)
  */
 static sector_t tarfs_bmap(struct address_space *mapping, sector_t block)
 {
-  return generic_block_bmap(mapping, block, tarfs_get_block);
+  return iomap_bmap(mapping, block, &tarfs_iomap_ops);
+}
+
+/*
+ * Record a user read (reads are recorded in access order when they are issued, page cache hits included : pages
+ * read by prefetch or readahead are recorded when they are used).
+ */
+static void tarfs_record_read(struct kiocb *iocb, size_t count)
+{
+  struct inode *inode = file_inode(iocb->ki_filp);
+  loff_t end = min_t(loff_t, iocb->ki_pos + count, i_size_read(inode));
+
+  if (iocb->ki_pos < end)
+    tar_record_range(inode, iocb->ki_pos >> PAGE_SHIFT,
+                     DIV_ROUND_UP(end, PAGE_SIZE) - (iocb->ki_pos >> PAGE_SHIFT));
+}
+
+/*
+ * Handle a page fault on a mapped file (faulting page is recorded).
+ */
+static vm_fault_t tarfs_filemap_fault(struct vm_fault *vmf)
+{
+  tar_record_range(file_inode(vmf->vma->vm_file), vmf->pgoff, 1);
+  return filemap_fault(vmf);
+}
+
+/*
+ * Map cached pages around a faulting page (mapped pages won't fault : they are recorded, up to end of file).
+ */
+static vm_fault_t tarfs_filemap_map_pages(struct vm_fault *vmf, pgoff_t start_pgoff, pgoff_t end_pgoff)
+{
+  struct inode *inode = file_inode(vmf->vma->vm_file);
+  pgoff_t last = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+
+  if (start_pgoff < last)
+    tar_record_range(inode, start_pgoff, min_t(pgoff_t, end_pgoff + 1, last) - start_pgoff);
+
+  return filemap_map_pages(vmf, start_pgoff, end_pgoff);
+}
+
+/*
+ * TarFS file vm operations (private page cache mappings).
+ */
+static const struct vm_operations_struct tarfs_file_vm_ops = {
+  .fault          = tarfs_filemap_fault,
+  .map_pages      = tarfs_filemap_map_pages,
+};
+
+/*
+ * Open a file.
+ */
+static int tarfs_file_open(struct inode *inode, struct file *file)
+{
+  /* record time to first open */
+  tar_lazy_open(inode->i_sb);
+
+  /* prefetch next members in archive order */
+  tar_prefetch_neighbors(inode);
+
+  return generic_file_open(inode, file);
+}
+
+/*
+ * Read a file from shared page cache (archive file or block device page cache).
+ */
+static ssize_t tarfs_shared_read_iter(struct kiocb *iocb, struct iov_iter *to, struct file *shared)
+{
+  struct inode *inode = file_inode(iocb->ki_filp);
+  loff_t size = i_size_read(inode), off;
+  size_t count, shorted;
+  ssize_t ret;
+
+  if (iocb->ki_pos >= size)
+    return 0;
+
+  /* stop at end of member */
+  count = iov_iter_count(to);
+  iov_iter_truncate(to, size - iocb->ki_pos);
+  shorted = count - iov_iter_count(to);
+
+  /* wait for replayed ranges */
+  tar_replay_wait(inode, iocb->ki_pos, iov_iter_count(to));
+
+  /* read from shared file */
+  off = tarfs_i(inode)->entry->data_off + iocb->ki_pos;
+  ret = vfs_iter_read(shared, to, &off, 0);
+  if (ret > 0) {
+    iocb->ki_pos += ret;
+    atomic64_add(ret, &tarfs_sb(inode->i_sb)->s_shared_bytes);
+  }
+
+  iov_iter_reexpand(to, iov_iter_count(to) + shorted);
+  file_accessed(iocb->ki_filp);
+  return ret;
+}
+
+/*
+ * Check if a direct read can be issued to the device (offsets, length and user buffer must be aligned
+ * on the device logical block size). A read reaching the member tail also needs the mapped extent (member rounded
+ * to tar blocks) to end on a logical block : on 4Kn devices, tails fall back to page cache.
+ */
+static bool tarfs_dio_aligned(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct inode *inode = file_inode(iocb->ki_filp);
+  unsigned int mask = bdev_logical_block_size(inode->i_sb->s_bdev) - 1;
+  loff_t size = i_size_read(inode);
+
+  if (iocb->ki_pos + iov_iter_count(to) > size && (round_up(size, i_blocksize(inode)) & mask))
+    return false;
+
+  return !((iocb->ki_pos | iov_iter_count(to) | iov_iter_alignment(to) | tarfs_i(inode)->entry->data_off) & mask);
+}
+
+/*
+ * Read a file.
+ */
+static ssize_t tarfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct inode *inode = file_inode(iocb->ki_filp);
+  struct file *shared = tar_shared_file(inode);
+  ssize_t ret;
+
+  if (!iov_iter_count(to))
+    return 0;
+
+  /* record user reads */
+  tarfs_record_read(iocb, iov_iter_count(to));
+
+  /* file backed archive or upper layer (direct reads go through archive file page cache) */
+  if (shared && shared != tarfs_sb(inode->i_sb)->s_bdev_file)
+    return tarfs_shared_read_iter(iocb, to, shared);
+
+  /* direct read (unaligned direct reads, compressed archives and sparse members fall back to page cache) */
+  if (iocb->ki_flags & IOCB_DIRECT) {
+    if (!tarfs_sb(inode->i_sb)->s_backing_file && !(tarfs_i(inode)->entry->flags & TAR_ENTRY_SPARSE)
+        && tarfs_dio_aligned(iocb, to)) {
+      ret = iomap_dio_rw(iocb, to, &tarfs_iomap_ops, NULL, 0, 0);
+      file_accessed(iocb->ki_filp);
+      return ret;
+    }
+
+    iocb->ki_flags &= ~IOCB_DIRECT;
+  }
+
+  /* page aligned member : read from block device page cache */
+  if (shared)
+    return tarfs_shared_read_iter(iocb, to, shared);
+
+  /* wait for replayed ranges (don't read them twice) */
+  tar_replay_wait(inode, iocb->ki_pos, iov_iter_count(to));
+
+  return generic_file_read_iter(iocb, to);
+}
+
+/*
+ * Map a file in memory. Full pages of page aligned members are mapped from the shared page cache
+ * (a mapping including the last partial page would expose next archive data, so it uses a private copy).
+ */
+static int tarfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct inode *inode = file_inode(file);
+  struct file *shared = tar_shared_file(inode);
+  u64 data_off = tarfs_i(inode)->entry->data_off;
+  int err;
+
+  /* read only file system : shared mappings can't be written (archive page cache must never be dirtied) */
+  if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE))
+    return -EINVAL;
+
+  /* private page cache mapping (faults are recorded) */
+  if (!shared || !tar_data_aligned(inode)
+      || vma->vm_pgoff + vma_pages(vma) > (i_size_read(inode) >> PAGE_SHIFT)) {
+    err = generic_file_readonly_mmap(file, vma);
+    if (!err)
+      vma->vm_ops = &tarfs_file_vm_ops;
+    return err;
+  }
+
+  /* record mapped range (faults on shared file pages are not seen), then map shared file pages */
+  tar_record_range(inode, vma->vm_pgoff, vma_pages(vma));
+  vma->vm_pgoff += data_off >> PAGE_SHIFT;
+  vma_set_file(vma, shared);
+  atomic64_add(vma->vm_end - vma->vm_start, &tarfs_sb(inode->i_sb)->s_shared_bytes);
+  file_accessed(file);
+
+  return call_mmap(vma->vm_file, vma);
+}
+
+/*
+ * Seek in a file (data and holes of sparse members).
+ */
+static loff_t tarfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+  if ((tarfs_i(file_inode(file))->entry->flags & TAR_ENTRY_SPARSE) && (whence == SEEK_DATA || whence == SEEK_HOLE))
+    return tar_sparse_llseek(file, offset, whence);
+
+  return generic_file_llseek(file, offset, whence);
 }
 
 /*
@@ -48,9 +354,10 @@ struct inode_operations tarfs_file_iops = {
  * TarFS file operations.
  */
 struct file_operations tarfs_file_fops = {
-  .llseek         = generic_file_llseek,
-  .read_iter      = generic_file_read_iter,
-  .mmap           = generic_file_mmap,
+  .open           = tarfs_file_open,
+  .llseek         = tarfs_file_llseek,
+  .read_iter      = tarfs_file_read_iter,
+  .mmap           = tarfs_file_mmap,
   .splice_read    = generic_file_splice_read,
 };
 
@@ -58,6 +365,20 @@ struct file_operations tarfs_file_fops = {
  * TarFS address space operations.
  */
 struct address_space_operations tarfs_aops = {
-  .readpage       = tarfs_readpage,
-  .bmap           = tarfs_bmap,
+  .readpage               = tarfs_readpage,
+  .readahead              = tarfs_readahead,
+  .bmap                   = tarfs_bmap,
+  .direct_IO              = noop_direct_IO,
+  .releasepage            = iomap_releasepage,
+  .invalidate_folio       = iomap_invalidate_folio,
+  .is_partially_uptodate  = iomap_is_partially_uptodate,
+};
+
+/*
+ * TarFS address space operations (file backed archive).
+ */
+struct address_space_operations tarfs_backing_aops = {
+  .readpage               = tarfs_backing_readpage,
+  .readahead              = tarfs_backing_readahead,
+  .direct_IO              = noop_direct_IO,
 };
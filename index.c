@@ -0,0 +1,230 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#include "tarfs.h"
+#include "tarfs_index.h"
+
+#define TARFS_INDEX_CHECK_SAMPLES           64
+
+/*
+ * Hash an archive block.
+ */
+static int tar_index_hash_block(struct super_block *sb, off_t offset, u64 *hash)
+{
+  char block[TARFS_BLOCK_SIZE];
+  int err;
+
+  err = tar_archive_read(sb, block, TARFS_BLOCK_SIZE, offset);
+  if (err)
+    return err;
+
+  *hash = tarfs_index_hash(block, TARFS_BLOCK_SIZE);
+  return 0;
+}
+
+/*
+ * Check that an indexed member header is still in place (valid header, same data length).
+ */
+static bool tar_index_check_member(struct super_block *sb, struct tarfs_index_entry *ie)
+{
+  char block[TARFS_BLOCK_SIZE] __aligned(8);
+  u64 data_off = le64_to_cpu(ie->data_off), data_len;
+
+  /* entries without header (root, implicit directories) */
+  if (data_off < TARFS_BLOCK_SIZE)
+    return true;
+
+  if (tar_archive_read(sb, block, TARFS_BLOCK_SIZE, data_off - TARFS_BLOCK_SIZE) || tar_check_header(block))
+    return false;
+
+  return !tar_parse_octal(((struct tar_header *) block)->size, sizeof_field(struct tar_header, size), &data_len)
+         && data_len == le64_to_cpu(ie->data_len);
+}
+
+/*
+ * Check that an index still describes the mounted archive : first block, last header, end of archive block (members
+ * appended to the archive overwrite it), archive file size, and member headers sampled across the archive.
+ */
+static int tar_index_check_archive(struct super_block *sb, struct tarfs_index_super *isb,
+                                   struct tarfs_index_entry *ientries)
+{
+  loff_t archive_size = le64_to_cpu(isb->archive_size);
+  u32 nr_entries = le32_to_cpu(isb->nr_entries), nr_samples, i;
+  char block[TARFS_BLOCK_SIZE];
+  u64 hash;
+
+  /* archive file must not have changed size (block devices may be larger than archive) */
+  if (tarfs_sb(sb)->s_backing_file || tarfs_sb(sb)->s_compress) {
+    if (tar_archive_size(sb) != le64_to_cpu(isb->file_size))
+      return -ESTALE;
+  } else if (archive_size + TARFS_BLOCK_SIZE > tar_archive_size(sb)) {
+    return -ESTALE;
+  }
+
+  /* check end of archive block */
+  if (tar_archive_read(sb, block, TARFS_BLOCK_SIZE, archive_size) || memchr_inv(block, 0, TARFS_BLOCK_SIZE))
+    return -ESTALE;
+
+  /* check first block */
+  if (tar_index_hash_block(sb, 0, &hash) || hash != le64_to_cpu(isb->first_hdr_hash))
+    return -ESTALE;
+
+  /* check last header */
+  if (tar_index_hash_block(sb, le64_to_cpu(isb->last_hdr_off), &hash) || hash != le64_to_cpu(isb->last_hdr_hash))
+    return -ESTALE;
+
+  /* check sampled member headers (catches edits in the middle of the archive) */
+  nr_samples = min_t(u32, nr_entries, TARFS_INDEX_CHECK_SAMPLES);
+  for (i = 0; i < nr_samples; i++)
+    if (!tar_index_check_member(sb, &ientries[(u64) i * nr_entries / nr_samples]))
+      return -ESTALE;
+
+  return 0;
+}
+
+/*
+ * Get a string from the index string table.
+ */
+static const char *tar_index_string(const char *strtab, u32 strtab_size, u32 off)
+{
+  if (off >= strtab_size || !memchr(strtab + off, 0, strtab_size - off))
+    return NULL;
+
+  return strtab + off;
+}
+
+/*
+ * Build tar entries from an index.
+ */
+static int tar_index_build(struct super_block *sb, struct tarfs_index_super *isb, struct tarfs_index_entry *ientries,
+                           const char *strtab)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  u32 nr_entries = le32_to_cpu(isb->nr_entries);
+  u32 strtab_size = le32_to_cpu(isb->strtab_size);
+  struct tar_entry *entry, *parent;
+  const char *name, *linkname;
+  struct tarfs_index_entry *ie;
+  struct tar_name *iname;
+  u32 i, parent_idx;
+  int err;
+
+  /* set start inode */
+  sbi->s_ninodes = TARFS_ROOT_INO;
+
+  for (i = 0; i < nr_entries; i++) {
+    ie = &ientries[i];
+
+    /* check parent (parents are always indexed before their children, entry i gets inode i + 1) */
+    parent_idx = le32_to_cpu(ie->parent);
+    if ((i == 0 && parent_idx != 0) || (i > 0 && parent_idx >= i))
+      return -EINVAL;
+    parent = i ? tar_get_entry(sb, parent_idx + TARFS_ROOT_INO) : NULL;
+    if (parent && !S_ISDIR(parent->mode))
+      return -EINVAL;
+
+    /* get names */
+    name = i ? tar_index_string(strtab, strtab_size, le32_to_cpu(ie->name_off)) : "/";
+    linkname = tar_index_string(strtab, strtab_size, le32_to_cpu(ie->link_off));
+    if (!name || !linkname)
+      return -EINVAL;
+
+    /* create entry */
+    iname = tar_intern_name(sb, name, strlen(name));
+    entry = iname ? tar_alloc_entry(sb, iname, ie->typeflag, linkname) : NULL;
+    if (!entry)
+      return -ENOMEM;
+
+    /* set attributes */
+    entry->data_off = le64_to_cpu(ie->data_off);
+    entry->data_len = le64_to_cpu(ie->data_len);
+    entry->mode = (le32_to_cpu(ie->mode) & S_IALLUGO) | tar_type_to_posix(ie->typeflag);
+    entry->uid = le32_to_cpu(ie->uid);
+    entry->gid = le32_to_cpu(ie->gid);
+    entry->mtime = le64_to_cpu(ie->mtime);
+
+    /* add entry to the tree */
+    err = tar_add_entry(sb, parent, entry);
+    if (!err)
+      err = tar_set_xtime(sb, entry, le64_to_cpu(ie->atime), le64_to_cpu(ie->ctime));
+    if (err)
+      return err;
+  }
+
+  sbi->s_root_entry = tar_get_entry(sb, TARFS_ROOT_INO);
+  return 0;
+}
+
+/*
+ * Load tar entries from an index file.
+ */
+int tar_load_index(struct super_block *sb, const char *path)
+{
+  struct tarfs_index_entry *ientries;
+  struct tarfs_index_super *isb;
+  size_t entries_size;
+  struct file *filp;
+  loff_t size, pos;
+  ssize_t len;
+  char *buf;
+  int err;
+
+  /* open index file */
+  filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(filp))
+    return PTR_ERR(filp);
+
+  /* check index size */
+  err = -EINVAL;
+  size = i_size_read(file_inode(filp));
+  if (size < sizeof(struct tarfs_index_super) || size > INT_MAX)
+    goto out_close;
+
+  /* read whole index in one pass */
+  err = -ENOMEM;
+  buf = kvmalloc(size, GFP_KERNEL);
+  if (!buf)
+    goto out_close;
+
+  pos = 0;
+  len = kernel_read(filp, buf, size, &pos);
+  if (len != size) {
+    err = len < 0 ? len : -EIO;
+    goto out_free;
+  }
+
+  /* check index header */
+  err = -EINVAL;
+  isb = (struct tarfs_index_super *) buf;
+  if (le32_to_cpu(isb->magic) != TARFS_INDEX_MAGIC || le32_to_cpu(isb->version) != TARFS_INDEX_VERSION)
+    goto out_free;
+
+  /* check index size */
+  entries_size = (size_t) le32_to_cpu(isb->nr_entries) * sizeof(struct tarfs_index_entry);
+  if (!le32_to_cpu(isb->nr_entries) || !le32_to_cpu(isb->strtab_size)
+      || sizeof(struct tarfs_index_super) + entries_size + le32_to_cpu(isb->strtab_size) != size)
+    goto out_free;
+
+  /* check archive */
+  ientries = (struct tarfs_index_entry *) (buf + sizeof(struct tarfs_index_super));
+  err = tar_index_check_archive(sb, isb, ientries);
+  if (err)
+    goto out_free;
+
+  /* build entries */
+  err = tar_index_build(sb, isb, ientries, (char *) ientries + entries_size);
+
+  /* demand-paged metadata : keep index to rebuild evicted entries */
+  if (!err && tarfs_sb(sb)->s_meta.enabled) {
+    tarfs_sb(sb)->s_meta.index_file = filp;
+    tarfs_sb(sb)->s_meta.strtab_off = sizeof(struct tarfs_index_super) + entries_size;
+    filp = NULL;
+  }
+out_free:
+  kvfree(buf);
+out_close:
+  if (filp)
+    filp_close(filp, NULL);
+  return err;
+}
@@ -1,4 +1,5 @@
 #include <linux/vfs.h>
+#include <linux/pagemap.h>
 
 #include "tarfs.h"
 
@@ -7,6 +8,7 @@
  */
 struct inode *tarfs_iget(struct super_block *sb, ino_t ino)
 {
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
   struct tar_entry *entry;
   struct inode *inode;
   
@@ -20,13 +22,13 @@ struct inode *tarfs_iget(struct super_block *sb, ino_t ino)
     return inode;
   
   /* check inode number */
-  if (inode->i_ino < TARFS_ROOT_INO || inode->i_ino > tarfs_sb(inode->i_sb)->s_ninodes) {
+  if (inode->i_ino < TARFS_ROOT_INO || inode->i_ino >= tar_published_inodes(sb)) {
     iget_failed(inode);
     return ERR_PTR(-EINVAL);
   }
   
-  /* get tar entry */
-  entry = tarfs_sb(inode->i_sb)->s_tar_entries[ino];
+  /* get tar entry (demand-paged metadata : entry stays resident until inode is evicted) */
+  entry = tar_meta_pin(sb, ino);
   if (!entry) {
     iget_failed(inode);
     return ERR_PTR(-EIO);
@@ -34,29 +36,47 @@ struct inode *tarfs_iget(struct super_block *sb, ino_t ino)
   
   /* set inode */
   set_nlink(inode, 1);
+  if (!S_ISDIR(entry->mode) && !S_ISLNK(entry->mode) && READ_ONCE(entry->nlink))
+    set_nlink(inode, READ_ONCE(entry->nlink));
   inode->i_mode = entry->mode;
   i_uid_write(inode, entry->uid);
   i_gid_write(inode, entry->gid);
   inode->i_size = entry->data_len;
-  inode->i_atime = entry->atime;
-  inode->i_mtime = entry->mtime;
-  inode->i_ctime = entry->ctime;
+  inode->i_mtime.tv_sec = entry->mtime;
+  inode->i_mtime.tv_nsec = 0;
+  inode->i_atime = inode->i_mtime;
+  inode->i_ctime = inode->i_mtime;
+  
+  /* set extra times */
+  if (entry->flags & TAR_ENTRY_XTIME) {
+    inode->i_atime.tv_sec = READ_ONCE(sbi->s_xtimes)[ino].atime;
+    inode->i_ctime.tv_sec = READ_ONCE(sbi->s_xtimes)[ino].ctime;
+  }
   tarfs_i(inode)->entry = entry;
   
   /* set operations */
   if (S_ISDIR(inode->i_mode)) {
     inode->i_op = &tarfs_dir_iops;
     inode->i_fop = &tarfs_dir_fops;
-    inode->i_mapping->a_ops = &tarfs_aops;
   } else if (S_ISLNK(inode->i_mode)) {
     inode->i_op = &tarfs_symlink_iops;
-    inode->i_mapping->a_ops = &tarfs_aops;
   } else {
     inode->i_op = &tarfs_file_iops;
     inode->i_fop = &tarfs_file_fops;
+  }
+  
+  /* set address space operations (large folios are only read through iomap, on the block device) */
+  if (sbi->s_backing_file || entry->layer || (entry->flags & TAR_ENTRY_SPARSE)) {
+    inode->i_mapping->a_ops = &tarfs_backing_aops;
+  } else {
     inode->i_mapping->a_ops = &tarfs_aops;
+    if (S_ISREG(inode->i_mode))
+      mapping_set_large_folios(inode->i_mapping);
   }
   
+  /* share page cache of an identical member */
+  tar_dedup_inode(inode);
+  
   /* unlock inode */
   unlock_new_inode(inode);
   
@@ -74,6 +94,8 @@ int tarfs_getattr(struct user_namespace *mnt_userns, const struct path *path,
 
   generic_fillattr(&init_user_ns, inode, stat);
   stat->blocks = inode->i_size / sb->s_blocksize;
+  if (tarfs_i(inode)->entry && (tarfs_i(inode)->entry->flags & TAR_ENTRY_SPARSE))
+    stat->blocks = DIV_ROUND_UP(tar_sparse_data_len(inode), 512);
   stat->blksize = sb->s_blocksize;
 
   return 0;
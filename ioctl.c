@@ -0,0 +1,270 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
+
+#include "tarfs.h"
+#include "tarfs_ioctl.h"
+
+#define TARFS_WALK_BUF_SIZE             PAGE_SIZE
+
+/*
+ * Walk cookie : next child index in a directory.
+ */
+#define TARFS_WALK_COOKIE(dir, i)       (((u64) (dir) << 32) | (i))
+#define TARFS_WALK_COOKIE_DIR(cookie)   ((u32) ((cookie) >> 32))
+#define TARFS_WALK_COOKIE_INDEX(cookie) ((u32) (cookie))
+
+/*
+ * Walk context.
+ */
+struct tar_walk {
+  struct tarfs_walk     req;                  /* walk request */
+  char                  *buf;                 /* records buffer */
+  size_t                buf_len;              /* records buffer length */
+  size_t                copied;               /* bytes copied to user buffer */
+};
+
+/*
+ * Check if current task may list a directory (read and search permissions, checked on tar entry).
+ */
+static bool tar_walk_may_list(struct super_block *sb, struct tar_entry *dir)
+{
+  umode_t mode = dir->mode;
+
+  if (uid_eq(current_fsuid(), make_kuid(sb->s_user_ns, dir->uid)))
+    mode >>= 6;
+  else if (in_group_p(make_kgid(sb->s_user_ns, dir->gid)))
+    mode >>= 3;
+
+  return (mode & (S_IROTH | S_IXOTH)) == (S_IROTH | S_IXOTH) || capable(CAP_DAC_READ_SEARCH);
+}
+
+/*
+ * Get index of a child in its directory (hash bucket is searched on large directories).
+ */
+static int tar_walk_child_index(struct tar_entry *parent, struct tar_entry *child)
+{
+  struct tar_dir *dir = smp_load_acquire(&parent->dir);
+  unsigned int hash = tar_entry_name(child)->hash;
+  u32 i, end;
+
+  i = 0;
+  end = smp_load_acquire(&dir->nr_children);
+  if (dir->buckets) {
+    i = dir->buckets[hash_32(hash, dir->hash_bits)];
+    end = dir->buckets[hash_32(hash, dir->hash_bits) + 1];
+  }
+
+  for (; i < end; i++)
+    if (dir->children[i].ino == child->ino)
+      return i;
+
+  return -EINVAL;
+}
+
+/*
+ * Check a resume cookie (its directory must be in walked subtree, and the walk must have been allowed to descend into
+ * it : every directory from the cookie one up to the top must be listable).
+ */
+static struct tar_entry *tar_walk_check_cookie(struct super_block *sb, struct tar_entry *top, u64 cookie)
+{
+  u32 ino = TARFS_WALK_COOKIE_DIR(cookie);
+  struct tar_entry *dir, *entry;
+
+  if (ino < TARFS_ROOT_INO || ino >= tar_published_inodes(sb))
+    return ERR_PTR(-EINVAL);
+
+  dir = tar_get_entry(sb, ino);
+  if (!dir || !S_ISDIR(dir->mode))
+    return ERR_PTR(-EINVAL);
+
+  for (entry = dir; entry != top; entry = tar_get_entry(sb, entry->parent)) {
+    if (entry->ino == TARFS_ROOT_INO)
+      return ERR_PTR(-EINVAL);
+    if (!tar_walk_may_list(sb, entry))
+      return ERR_PTR(-EACCES);
+  }
+
+  return dir;
+}
+
+/*
+ * Flush records buffer to user buffer.
+ */
+static int tar_walk_flush(struct tar_walk *walk)
+{
+  if (copy_to_user(u64_to_user_ptr(walk->req.buf) + walk->copied, walk->buf, walk->buf_len))
+    return -EFAULT;
+
+  walk->copied += walk->buf_len;
+  walk->buf_len = 0;
+  cond_resched();
+  return 0;
+}
+
+/*
+ * Add a record (returns 1 if user buffer is full).
+ */
+static int tar_walk_emit(struct super_block *sb, struct tar_walk *walk, struct tar_entry *entry)
+{
+  struct tar_entry *target = tar_link_target(sb, entry);
+  struct tarfs_walk_record *rec;
+  size_t rec_len;
+  int err;
+
+  rec_len = ALIGN(sizeof(struct tarfs_walk_record) + entry->name_len + 1, 8);
+  if (walk->copied + walk->buf_len + rec_len > walk->req.buf_size)
+    return 1;
+
+  /* records buffer full : flush it */
+  if (walk->buf_len + rec_len > TARFS_WALK_BUF_SIZE) {
+    err = tar_walk_flush(walk);
+    if (err)
+      return err;
+  }
+
+  rec = (struct tarfs_walk_record *) (walk->buf + walk->buf_len);
+  rec->size = target->data_len;
+  rec->data_off = target->data_off;
+  rec->mtime = target->mtime;
+  rec->ino = target->ino;
+  rec->parent = entry->parent;
+  rec->mode = target->mode;
+  rec->uid = target->uid;
+  rec->gid = target->gid;
+  rec->layer = target->layer;
+  rec->rec_len = rec_len;
+  rec->name_len = entry->name_len;
+  memcpy(rec->name, entry->name, entry->name_len);
+  memset(rec->name + entry->name_len, 0, rec_len - sizeof(struct tarfs_walk_record) - entry->name_len);
+
+  walk->buf_len += rec_len;
+  walk->req.nr_records++;
+  return 0;
+}
+
+/*
+ * Walk a subtree in preorder, from a cookie (a directory and the index of its next child).
+ */
+static int tar_walk(struct super_block *sb, struct tar_walk *walk, struct tar_entry *top)
+{
+  struct tar_entry *dir, *child;
+  struct tar_dir *children;
+  u32 i;
+  int err;
+
+  /* start or resume walk */
+  dir = top;
+  i = 0;
+  if (walk->req.cookie) {
+    dir = tar_walk_check_cookie(sb, top, walk->req.cookie);
+    if (IS_ERR(dir))
+      return PTR_ERR(dir);
+    i = TARFS_WALK_COOKIE_INDEX(walk->req.cookie);
+  }
+
+  for (;;) {
+    /* wait for directory to be complete (lazy indexing) */
+    err = tar_lazy_wait(sb, dir);
+    if (err)
+      return err;
+
+    /* emit next child, and go down in directories */
+    children = smp_load_acquire(&dir->dir);
+    if (children && i < children->nr_children) {
+      child = tar_get_entry(sb, children->children[i].ino);
+      err = child ? tar_walk_emit(sb, walk, child) : -EIO;
+      if (err)
+        break;
+
+      if (S_ISDIR(child->mode) && READ_ONCE(child->dir) && tar_walk_may_list(sb, child)) {
+        dir = child;
+        i = 0;
+      } else {
+        i++;
+      }
+
+      continue;
+    }
+
+    /* directory is done : go up */
+    if (dir == top) {
+      walk->req.flags |= TARFS_WALK_DONE;
+      return 0;
+    }
+
+    child = dir;
+    dir = tar_get_entry(sb, dir->parent);
+    err = tar_walk_child_index(dir, child);
+    if (err < 0)
+      return err;
+    i = err + 1;
+  }
+
+  if (err < 0)
+    return err;
+
+  /* user buffer is full : no record fits in an empty buffer */
+  if (!walk->req.nr_records)
+    return -EOVERFLOW;
+
+  walk->req.cookie = TARFS_WALK_COOKIE(dir->ino, i);
+  return 0;
+}
+
+/*
+ * Bulk subtree metadata ioctl.
+ */
+static long tarfs_ioctl_walk(struct file *file, struct tarfs_walk __user *arg)
+{
+  struct tar_entry *top = tarfs_i(file_inode(file))->entry;
+  struct super_block *sb = file_inode(file)->i_sb;
+  struct tar_walk walk;
+  int err, idx;
+
+  if (copy_from_user(&walk.req, arg, sizeof(struct tarfs_walk)))
+    return -EFAULT;
+
+  if (!top || !S_ISDIR(top->mode))
+    return -ENOTDIR;
+  if (!tar_walk_may_list(sb, top))
+    return -EACCES;
+
+  walk.buf = kmalloc(TARFS_WALK_BUF_SIZE, GFP_KERNEL);
+  if (!walk.buf)
+    return -ENOMEM;
+
+  walk.buf_len = 0;
+  walk.copied = 0;
+  walk.req.nr_records = 0;
+  walk.req.flags = 0;
+
+  /* walk subtree, then flush last records */
+  idx = tar_meta_read_lock(sb);
+  err = tar_walk(sb, &walk, top);
+  tar_meta_read_unlock(sb, idx);
+  if (!err)
+    err = tar_walk_flush(&walk);
+  if (!err && copy_to_user(arg, &walk.req, sizeof(struct tarfs_walk)))
+    err = -EFAULT;
+
+  kfree(walk.buf);
+  return err;
+}
+
+/*
+ * TarFS directory ioctls.
+ */
+long tarfs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  switch (cmd) {
+    case TARFS_IOC_WALK:
+      return tarfs_ioctl_walk(file, (struct tarfs_walk __user *) arg);
+    default:
+      return -ENOTTY;
+  }
+}
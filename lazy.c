@@ -0,0 +1,360 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/overflow.h>
+
+#include "tarfs.h"
+
+/*
+ * Init lazy indexing.
+ */
+void tar_lazy_init(struct tar_lazy *lazy)
+{
+  lazy->enabled = false;
+  lazy->done = true;
+  lazy->unordered = false;
+  lazy->published = 0;
+  lazy->task = NULL;
+  lazy->build = NULL;
+  lazy->retired = NULL;
+  lazy->start = ktime_get_ns();
+  lazy->ready_time = 0;
+  lazy->index_time = 0;
+  atomic64_set(&lazy->first_open, 0);
+  init_waitqueue_head(&lazy->wait);
+}
+
+/*
+ * Retire a table (released now, or at umount while indexing lazily).
+ */
+void tar_lazy_retire(struct super_block *sb, void *table)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+  struct tar_retired *retired;
+
+  if (!lazy->enabled) {
+    kvfree(table);
+    return;
+  }
+
+  /* readers may still use the table (on failure, leak it rather than free it under readers) */
+  retired = kmalloc(sizeof(struct tar_retired), GFP_KERNEL);
+  if (!retired)
+    return;
+
+  retired->table = table;
+  retired->next = lazy->retired;
+  lazy->retired = retired;
+}
+
+/*
+ * Release retired tables.
+ */
+void tar_lazy_release(struct super_block *sb)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+  struct tar_retired *retired;
+
+  while (lazy->retired) {
+    retired = lazy->retired;
+    lazy->retired = retired->next;
+    kvfree(retired->table);
+    kfree(retired);
+  }
+}
+
+/*
+ * Check if a directory is complete (all its children are published).
+ */
+static bool tar_lazy_dir_complete(struct tar_lazy *lazy, struct tar_entry *dir)
+{
+  if (smp_load_acquire(&lazy->done))
+    return true;
+
+  return (READ_ONCE(dir->flags) & TAR_ENTRY_COMPLETE) && !READ_ONCE(lazy->unordered);
+}
+
+/*
+ * Wait for a directory to be complete.
+ */
+int tar_lazy_wait(struct super_block *sb, struct tar_entry *dir)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+
+  if (tar_lazy_dir_complete(lazy, dir))
+    return 0;
+
+  return wait_event_killable(lazy->wait, tar_lazy_dir_complete(lazy, dir));
+}
+
+/*
+ * Check if negative dentries can be trusted (they are only created in complete directories).
+ */
+bool tar_lazy_negative_valid(struct super_block *sb)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+
+  return smp_load_acquire(&lazy->done) || !READ_ONCE(lazy->unordered);
+}
+
+/*
+ * Publish a new entry in its parent directory (children array is replaced when full).
+ */
+int tar_lazy_publish(struct super_block *sb, struct tar_entry *parent, struct tar_entry *entry)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+  struct tar_dir *dir = parent->dir, *new_dir;
+  u32 max_children;
+
+  /* entry added to a complete directory : archive is not in tree order */
+  if ((parent->flags & TAR_ENTRY_COMPLETE) && !lazy->unordered) {
+    printk("TARFS : archive is not in tree order, lookups wait for end of indexing\n");
+    WRITE_ONCE(lazy->unordered, true);
+  }
+
+  /* grow children array (old array stays in arena for current readers) */
+  if (!dir || dir->nr_children == dir->max_children) {
+    max_children = dir ? dir->max_children * 2 : 4;
+    new_dir = (struct tar_dir *) tar_arena_alloc(&tarfs_sb(sb)->s_arena, struct_size(new_dir, children, max_children));
+    if (!new_dir)
+      return -ENOMEM;
+
+    new_dir->nr_children = dir ? dir->nr_children : 0;
+    new_dir->max_children = max_children;
+    new_dir->hash_bits = 0;
+    new_dir->buckets = NULL;
+    if (dir)
+      memcpy(new_dir->children, dir->children, sizeof(struct tar_dirent) * dir->nr_children);
+
+    smp_store_release(&parent->dir, new_dir);
+    dir = new_dir;
+  }
+
+  /* add child, then publish it */
+  dir->children[dir->nr_children].hash = tar_entry_name(entry)->hash;
+  dir->children[dir->nr_children].ino = entry->ino;
+  smp_store_release(&dir->nr_children, dir->nr_children + 1);
+  smp_store_release(&lazy->published, entry->ino + 1);
+
+  return 0;
+}
+
+/*
+ * Complete a directory (large directories are hashed on a copy, then published).
+ */
+static int tar_lazy_complete(struct super_block *sb, struct tar_entry *entry)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+  struct tar_dir *dir = entry->dir, *new_dir;
+  int err;
+
+  if (dir && !dir->buckets && dir->nr_children >= TARFS_DIR_HASH_MIN) {
+    new_dir = (struct tar_dir *) tar_arena_alloc(&tarfs_sb(sb)->s_arena,
+                                                 struct_size(new_dir, children, dir->nr_children));
+    if (!new_dir)
+      return -ENOMEM;
+
+    new_dir->nr_children = dir->nr_children;
+    new_dir->max_children = dir->nr_children;
+    memcpy(new_dir->children, dir->children, sizeof(struct tar_dirent) * dir->nr_children);
+    err = tar_hash_dir(sb, new_dir);
+    if (err)
+      return err;
+
+    smp_store_release(&entry->dir, new_dir);
+  }
+
+  /* wake up waiting readers */
+  smp_store_release(&entry->flags, entry->flags | TAR_ENTRY_COMPLETE);
+  if (wq_has_sleeper(&lazy->wait))
+    wake_up_all(&lazy->wait);
+
+  return 0;
+}
+
+/*
+ * Track directories of the scanned member : directories left by the scan are complete.
+ */
+int tar_lazy_track(struct super_block *sb, struct tar_build *build, struct tar_entry *entry)
+{
+  struct tar_entry *root = tarfs_sb(sb)->s_root_entry, **dirs, *dir;
+  u32 depth, common, max, i;
+  int err;
+
+  /* get member directories (from deepest) */
+  depth = 0;
+  for (dir = S_ISDIR(entry->mode) ? entry : tar_get_entry(sb, entry->parent); dir != root;
+       dir = tar_get_entry(sb, dir->parent)) {
+    if (depth == build->max_open_dirs) {
+      max = build->max_open_dirs ? build->max_open_dirs * 2 : 16;
+      dirs = krealloc_array(build->path, max, sizeof(struct tar_entry *), GFP_KERNEL);
+      if (!dirs)
+        return -ENOMEM;
+      build->path = dirs;
+      dirs = krealloc_array(build->open_dirs, max, sizeof(struct tar_entry *), GFP_KERNEL);
+      if (!dirs)
+        return -ENOMEM;
+      build->open_dirs = dirs;
+      build->max_open_dirs = max;
+    }
+
+    build->path[depth++] = dir;
+  }
+
+  /* find common directories */
+  for (common = 0; common < build->nr_open_dirs && common < depth; common++)
+    if (build->open_dirs[common] != build->path[depth - 1 - common])
+      break;
+
+  /* complete left directories (deepest first) */
+  for (i = build->nr_open_dirs; i > common; i--) {
+    err = tar_lazy_complete(sb, build->open_dirs[i - 1]);
+    if (err)
+      return err;
+  }
+
+  /* save member directories (from root) */
+  for (i = 0; i < depth; i++)
+    build->open_dirs[i] = build->path[depth - 1 - i];
+  build->nr_open_dirs = depth;
+
+  return 0;
+}
+
+/*
+ * Lazy indexing thread : scan the archive, then complete all directories.
+ */
+static int tar_lazy_thread(void *data)
+{
+  struct super_block *sb = data;
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_lazy *lazy = &sbi->s_lazy;
+  struct tar_entry *entry;
+  u32 ino;
+  int err;
+
+  /* scan archive */
+  err = tar_build_layer(sb, lazy->build, 0);
+
+  /* complete remaining directories (and rehash directories grown after completion) */
+  for (ino = TARFS_ROOT_INO; ino < sbi->s_ninodes && !err; ino++) {
+    entry = tar_get_entry(sb, ino);
+    if (S_ISDIR(entry->mode) && (!(entry->flags & TAR_ENTRY_COMPLETE) || (entry->dir && !entry->dir->buckets)))
+      err = tar_lazy_complete(sb, entry);
+  }
+  if (err)
+    printk("TARFS : lazy indexing failed (err = %d), tree is incomplete\n", err);
+
+  /* release build context and names dictionary */
+  tar_build_free(lazy->build);
+  lazy->build = NULL;
+  tar_names_release(&sbi->s_names);
+
+  /* release waiting readers */
+  lazy->index_time = ktime_get_ns() - lazy->start;
+  smp_store_release(&lazy->done, true);
+  wake_up_all(&lazy->wait);
+  printk("TARFS : %u entries indexed in %llu ms (lazy)\n", sbi->s_ninodes - 1,
+         div_u64(lazy->index_time, NSEC_PER_MSEC));
+
+  /* start replay and deduplication once all entries are known */
+  if (!kthread_should_stop()) {
+    tar_replay_start(sb);
+    tar_dedup_start(sb);
+  }
+
+  /* wait to be stopped */
+  set_current_state(TASK_INTERRUPTIBLE);
+  while (!kthread_should_stop()) {
+    schedule();
+    set_current_state(TASK_INTERRUPTIBLE);
+  }
+  __set_current_state(TASK_RUNNING);
+
+  return 0;
+}
+
+/*
+ * Prepare lazy indexing (only root entry is created).
+ */
+int tar_lazy_prepare(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_lazy *lazy = &sbi->s_lazy;
+  struct tar_build *build;
+
+  build = tar_build_alloc(sb);
+  if (IS_ERR(build))
+    return PTR_ERR(build);
+
+  build->lazy = true;
+  lazy->build = build;
+  lazy->done = false;
+  lazy->published = sbi->s_ninodes;
+  return 0;
+}
+
+/*
+ * Start lazy indexing thread.
+ */
+int tar_lazy_start(struct super_block *sb)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+  struct task_struct *task;
+
+  task = kthread_run(tar_lazy_thread, sb, "tarfs-index");
+  if (IS_ERR(task))
+    return PTR_ERR(task);
+
+  lazy->task = task;
+  lazy->ready_time = ktime_get_ns() - lazy->start;
+  printk("TARFS : root ready in %llu ms, indexing in background\n", div_u64(lazy->ready_time, NSEC_PER_MSEC));
+  return 0;
+}
+
+/*
+ * Stop lazy indexing thread (release build context if the thread was never started).
+ */
+void tar_lazy_stop(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_lazy *lazy = &sbi->s_lazy;
+
+  if (lazy->task) {
+    kthread_stop(lazy->task);
+    lazy->task = NULL;
+  }
+
+  if (lazy->build) {
+    tar_build_free(lazy->build);
+    lazy->build = NULL;
+  }
+}
+
+/*
+ * A file is opened : record time to first open.
+ */
+void tar_lazy_open(struct super_block *sb)
+{
+  struct tar_lazy *lazy = &tarfs_sb(sb)->s_lazy;
+
+  if (!atomic64_read(&lazy->first_open))
+    atomic64_cmpxchg(&lazy->first_open, 0, max_t(u64, ktime_get_ns() - lazy->start, 1));
+}
+
+/*
+ * Show indexing statistics.
+ */
+void tar_lazy_show_stats(struct seq_file *seq, struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_lazy *lazy = &sbi->s_lazy;
+
+  seq_printf(seq, "\n\tindex: lazy %d done %d ready_ms %llu full_ms %llu first_open_ms %llu",
+             lazy->enabled, smp_load_acquire(&lazy->done),
+             div_u64(lazy->enabled ? lazy->ready_time : sbi->s_build_time, NSEC_PER_MSEC),
+             div_u64(lazy->enabled ? READ_ONCE(lazy->index_time) : sbi->s_build_time, NSEC_PER_MSEC),
+             div_u64(atomic64_read(&lazy->first_open), NSEC_PER_MSEC));
+}
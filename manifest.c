@@ -0,0 +1,414 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/kthread.h>
+#include <linux/seq_file.h>
+
+#include "tarfs.h"
+#include "tarfs_manifest.h"
+
+/*
+ * Init record mode.
+ */
+void tar_record_init(struct tar_record *record)
+{
+  mutex_init(&record->lock);
+  record->ranges = NULL;
+  record->nr = 0;
+  record->max = 0;
+}
+
+/*
+ * Record a range of pages read from a member (contiguous or overlapping ranges of a member are merged).
+ */
+void tar_record_range(struct inode *inode, pgoff_t index, unsigned long nr_pages)
+{
+  struct tar_record *record = &tarfs_sb(inode->i_sb)->s_record;
+  struct tar_range *range, *ranges;
+  u32 max;
+
+  /* record mode disabled */
+  if (!tarfs_sb(inode->i_sb)->s_record_path || !nr_pages)
+    return;
+
+  mutex_lock(&record->lock);
+
+  /* merge with last range (small reads and faults of a member hit the same pages again) */
+  range = record->nr ? &record->ranges[record->nr - 1] : NULL;
+  if (range && range->ino == inode->i_ino && index >= range->index && index <= range->index + range->nr_pages) {
+    range->nr_pages = max_t(u32, range->nr_pages, index + nr_pages - range->index);
+    goto out;
+  }
+
+  /* grow ranges */
+  if (record->nr >= record->max) {
+    if (record->max >= TARFS_RECORD_MAX)
+      goto out;
+
+    max = record->max ? record->max * 2 : 1024;
+    ranges = kvmalloc_array(max, sizeof(struct tar_range), GFP_KERNEL);
+    if (!ranges)
+      goto out;
+
+    if (record->ranges) {
+      memcpy(ranges, record->ranges, sizeof(struct tar_range) * record->nr);
+      kvfree(record->ranges);
+    }
+
+    record->ranges = ranges;
+    record->max = max;
+  }
+
+  /* add range */
+  range = &record->ranges[record->nr++];
+  range->off = tarfs_i(inode)->entry->data_off + ((u64) index << PAGE_SHIFT);
+  range->ino = inode->i_ino;
+  range->index = index;
+  range->nr_pages = nr_pages;
+out:
+  mutex_unlock(&record->lock);
+}
+
+/*
+ * Write recorded ranges to the manifest file.
+ */
+int tar_record_write(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_record *record = &sbi->s_record;
+  struct tarfs_manifest_record *mrec;
+  struct tarfs_manifest_header *hdr;
+  struct tar_entry *entry;
+  struct tar_range *range;
+  struct file *filp;
+  size_t size;
+  ssize_t len;
+  loff_t pos;
+  char *buf;
+  int err, idx;
+  u32 i;
+
+  if (!sbi->s_record_path)
+    return 0;
+
+  /* build manifest */
+  size = sizeof(struct tarfs_manifest_header) + sizeof(struct tarfs_manifest_record) * record->nr;
+  buf = kvzalloc(size, GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  hdr = (struct tarfs_manifest_header *) buf;
+  hdr->magic = cpu_to_le32(TARFS_MANIFEST_MAGIC);
+  hdr->version = cpu_to_le32(TARFS_MANIFEST_VERSION);
+  hdr->nr_records = cpu_to_le32(record->nr);
+
+  /* entries which can't be loaded get an invalid offset (their records are skipped on replay) */
+  mrec = (struct tarfs_manifest_record *) (buf + sizeof(struct tarfs_manifest_header));
+  idx = tar_meta_read_lock(sb);
+  for (i = 0; i < record->nr; i++) {
+    range = &record->ranges[i];
+    entry = tar_get_entry(sb, range->ino);
+    mrec[i].data_off = cpu_to_le64(entry ? entry->data_off : U64_MAX);
+    mrec[i].ino = cpu_to_le32(range->ino);
+    mrec[i].index = cpu_to_le32(range->index);
+    mrec[i].nr_pages = cpu_to_le32(range->nr_pages);
+  }
+  tar_meta_read_unlock(sb, idx);
+
+  /* write manifest file */
+  filp = filp_open(sbi->s_record_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+  if (IS_ERR(filp)) {
+    err = PTR_ERR(filp);
+    goto out;
+  }
+
+  pos = 0;
+  len = kernel_write(filp, buf, size, &pos);
+  err = len == size ? 0 : (len < 0 ? len : -EIO);
+  filp_close(filp, NULL);
+out:
+  kvfree(buf);
+  return err;
+}
+
+/*
+ * Release record mode.
+ */
+void tar_record_release(struct tar_record *record)
+{
+  kvfree(record->ranges);
+  record->ranges = NULL;
+  record->nr = 0;
+  record->max = 0;
+}
+
+/*
+ * Compare two ranges by archive offset.
+ */
+static int tar_range_cmp(const void *a, const void *b)
+{
+  const struct tar_range *ra = a, *rb = b;
+
+  if (ra->off < rb->off)
+    return -1;
+
+  return ra->off > rb->off;
+}
+
+/*
+ * Load a manifest : ranges are checked, sorted by archive offset and coalesced.
+ */
+static int tar_replay_load(struct super_block *sb, struct tar_replay *replay, const char *path)
+{
+  struct tarfs_manifest_record *mrec;
+  struct tarfs_manifest_header *hdr;
+  struct tar_range *range, *prev;
+  struct tar_entry *entry;
+  u32 nr_records, i, ino;
+  u64 end, nr_pages;
+  struct file *filp;
+  loff_t size, pos;
+  ssize_t len;
+  char *buf;
+  int err, idx;
+
+  /* open manifest file */
+  filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(filp))
+    return PTR_ERR(filp);
+
+  /* check manifest size */
+  err = -EINVAL;
+  size = i_size_read(file_inode(filp));
+  if (size < sizeof(struct tarfs_manifest_header) || size > INT_MAX)
+    goto out_close;
+
+  /* read whole manifest */
+  err = -ENOMEM;
+  buf = kvmalloc(size, GFP_KERNEL);
+  if (!buf)
+    goto out_close;
+
+  pos = 0;
+  len = kernel_read(filp, buf, size, &pos);
+  if (len != size) {
+    err = len < 0 ? len : -EIO;
+    goto out_free;
+  }
+
+  /* check header */
+  err = -EINVAL;
+  hdr = (struct tarfs_manifest_header *) buf;
+  nr_records = le32_to_cpu(hdr->nr_records);
+  if (le32_to_cpu(hdr->magic) != TARFS_MANIFEST_MAGIC || le32_to_cpu(hdr->version) != TARFS_MANIFEST_VERSION
+      || sizeof(struct tarfs_manifest_header) + (size_t) nr_records * sizeof(struct tarfs_manifest_record) != size)
+    goto out_free;
+
+  /* allocate ranges */
+  err = -ENOMEM;
+  replay->ranges = kvmalloc_array(max_t(u32, nr_records, 1), sizeof(struct tar_range), GFP_KERNEL);
+  if (!replay->ranges)
+    goto out_free;
+
+  /* check records (records of a stale manifest are skipped) */
+  mrec = (struct tarfs_manifest_record *) (buf + sizeof(struct tarfs_manifest_header));
+  idx = tar_meta_read_lock(sb);
+  for (i = 0, replay->nr = 0; i < nr_records; i++) {
+    ino = le32_to_cpu(mrec[i].ino);
+    if (ino <= TARFS_ROOT_INO || ino >= tarfs_sb(sb)->s_ninodes)
+      continue;
+
+    entry = tar_get_entry(sb, ino);
+    if (!entry || !S_ISREG(entry->mode) || (entry->flags & TAR_ENTRY_HIDDEN)
+        || entry->data_off != le64_to_cpu(mrec[i].data_off))
+      continue;
+
+    /* clamp range to member size */
+    nr_pages = DIV_ROUND_UP(entry->data_len, PAGE_SIZE);
+    end = min_t(u64, (u64) le32_to_cpu(mrec[i].index) + le32_to_cpu(mrec[i].nr_pages), nr_pages);
+    if (le32_to_cpu(mrec[i].index) >= end)
+      continue;
+
+    range = &replay->ranges[replay->nr++];
+    range->ino = ino;
+    range->index = le32_to_cpu(mrec[i].index);
+    range->nr_pages = end - range->index;
+    range->off = entry->data_off + ((u64) range->index << PAGE_SHIFT);
+  }
+  tar_meta_read_unlock(sb, idx);
+
+  /* sort ranges by archive offset */
+  sort(replay->ranges, replay->nr, sizeof(struct tar_range), tar_range_cmp, NULL);
+
+  /* coalesce overlapping and contiguous ranges of a member */
+  for (i = 0, prev = NULL; i < replay->nr; i++) {
+    range = &replay->ranges[i];
+    if (prev && prev->ino == range->ino && range->index <= prev->index + prev->nr_pages) {
+      prev->nr_pages = max(prev->nr_pages, range->index + range->nr_pages - prev->index);
+      continue;
+    }
+
+    prev = prev ? prev + 1 : replay->ranges;
+    *prev = *range;
+  }
+  replay->nr = prev ? prev - replay->ranges + 1 : 0;
+
+  err = 0;
+out_free:
+  kvfree(buf);
+out_close:
+  filp_close(filp, NULL);
+  return err;
+}
+
+/*
+ * Replay thread : stream manifest ranges in page cache, in archive order.
+ */
+static int tar_replay_thread(void *data)
+{
+  struct super_block *sb = data;
+  struct tar_replay *replay = &tarfs_sb(sb)->s_replay;
+  struct tar_range *range;
+  struct inode *inode;
+  u32 i;
+
+  for (i = 0; i < replay->nr && !kthread_should_stop(); i++) {
+    range = &replay->ranges[i];
+
+    /* pages are in page cache (locked until read) as soon as readahead returns */
+    inode = tarfs_iget(sb, range->ino);
+    if (!IS_ERR(inode)) {
+      tar_readahead_member(inode, range->index, range->nr_pages);
+      iput(inode);
+    }
+
+    /* wake up waiting readers */
+    atomic_set(&replay->done, i + 1);
+    wake_up_all(&replay->wait);
+  }
+
+  /* release waiting readers */
+  WRITE_ONCE(replay->stopped, true);
+  wake_up_all(&replay->wait);
+
+  /* wait to be stopped */
+  set_current_state(TASK_INTERRUPTIBLE);
+  while (!kthread_should_stop()) {
+    schedule();
+    set_current_state(TASK_INTERRUPTIBLE);
+  }
+  __set_current_state(TASK_RUNNING);
+
+  return 0;
+}
+
+/*
+ * Init replay mode.
+ */
+void tar_replay_init(struct tar_replay *replay)
+{
+  replay->ranges = NULL;
+  replay->nr = 0;
+  replay->task = NULL;
+  replay->stopped = true;
+  atomic_set(&replay->done, 0);
+  init_waitqueue_head(&replay->wait);
+}
+
+/*
+ * Start replay mode (replay errors don't fail the mount).
+ */
+void tar_replay_start(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_replay *replay = &sbi->s_replay;
+  int err;
+
+  if (!sbi->s_replay_path)
+    return;
+
+  /* load manifest (a bad manifest is ignored) */
+  err = tar_replay_load(sb, replay, sbi->s_replay_path);
+  if (err) {
+    printk("TARFS : can't load manifest %s (err = %d)\n", sbi->s_replay_path, err);
+    kvfree(replay->ranges);
+    replay->ranges = NULL;
+    replay->nr = 0;
+    return;
+  }
+
+  /* start replay thread */
+  replay->stopped = false;
+  replay->task = kthread_run(tar_replay_thread, sb, "tarfs-replay");
+  if (IS_ERR(replay->task)) {
+    printk("TARFS : can't start replay thread (err = %ld)\n", PTR_ERR(replay->task));
+    replay->task = NULL;
+    replay->stopped = true;
+  }
+}
+
+/*
+ * Stop replay mode.
+ */
+void tar_replay_stop(struct super_block *sb)
+{
+  struct tar_replay *replay = &tarfs_sb(sb)->s_replay;
+
+  if (replay->task) {
+    kthread_stop(replay->task);
+    replay->task = NULL;
+  }
+
+  kvfree(replay->ranges);
+  replay->ranges = NULL;
+  replay->nr = 0;
+}
+
+/*
+ * Wait until replay has loaded a member range (readers must not issue duplicate reads).
+ */
+void tar_replay_wait(struct inode *inode, loff_t pos, size_t count)
+{
+  struct tar_replay *replay = &tarfs_sb(inode->i_sb)->s_replay;
+  u64 start, end, data_off = tarfs_i(inode)->entry->data_off;
+  struct tar_range *range;
+  u32 lo, hi, mid, last;
+
+  if (READ_ONCE(replay->stopped) || !count || pos >= i_size_read(inode))
+    return;
+
+  /* find first range ending after start (ranges are sorted by archive offset and never overlap) */
+  start = data_off + pos;
+  end = data_off + min_t(loff_t, pos + count, i_size_read(inode));
+  for (lo = 0, hi = replay->nr; lo < hi;) {
+    mid = lo + (hi - lo) / 2;
+    range = &replay->ranges[mid];
+    if (range->off + ((u64) range->nr_pages << PAGE_SHIFT) <= start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  /* find last range of this member starting before end (previous member last page may overlap start) */
+  for (last = 0; lo < replay->nr && replay->ranges[lo].off < end; lo++)
+    if (replay->ranges[lo].ino == inode->i_ino)
+      last = lo + 1;
+
+  /* wait for ranges */
+  if (last)
+    wait_event_killable(replay->wait, atomic_read(&replay->done) >= last || READ_ONCE(replay->stopped));
+}
+
+/*
+ * Show record and replay statistics.
+ */
+void tar_manifest_show_stats(struct seq_file *seq, struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+
+  if (sbi->s_record_path)
+    seq_printf(seq, "\n\trecord: ranges %u", sbi->s_record.nr);
+  if (sbi->s_replay_path)
+    seq_printf(seq, "\n\treplay: ranges %u loaded %u", sbi->s_replay.nr, atomic_read(&sbi->s_replay.done));
+}
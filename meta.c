@@ -0,0 +1,688 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/overflow.h>
+
+#include "tarfs.h"
+#include "tarfs_index.h"
+
+#define TAR_META_NO_LINK                U32_MAX
+#define TAR_META_PINNED                 U32_MAX
+
+/*
+ * Group load context (entries are built in place, their names and link names are appended to a strings buffer).
+ */
+struct tar_meta_loader {
+  u32                   nr;                   /* number of built entries */
+  struct tar_entry      entries[TARFS_META_GROUP_SIZE];       /* built entries */
+  u32                   name_offs[TARFS_META_GROUP_SIZE];     /* names offsets in strings buffer */
+  u32                   link_offs[TARFS_META_GROUP_SIZE];     /* link names offsets in strings buffer */
+  char                  *strs;                /* strings buffer */
+  size_t                strs_len;             /* strings buffer length */
+  size_t                strs_size;            /* strings buffer size */
+  struct tar_scan       scan;                 /* archive scanner (archive headers) */
+  struct tar_raw        raw;                  /* raw member (archive headers) */
+  struct tar_member     member;               /* decoded member (archive headers) */
+  struct tarfs_index_entry ientries[TARFS_META_GROUP_SIZE];   /* index entries (index) */
+  char                  name_buf[PATH_MAX];   /* name (index) */
+  char                  link_buf[PATH_MAX];   /* link name (index) */
+};
+
+/*
+ * Check if an entry can be evicted (directories, hard links, hard links targets and sparse members stay resident).
+ */
+static bool tar_meta_evictable(struct super_block *sb, struct tar_entry *entry)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+
+  if (S_ISDIR(entry->mode)
+      || (entry->flags & (TAR_ENTRY_HIDDEN | TAR_ENTRY_LNKTYPE | TAR_ENTRY_HARDLINK | TAR_ENTRY_SPARSE)))
+    return false;
+
+  /* entry must be rebuilt from the index or from its archive headers */
+  return meta->index_file || entry->ino < meta->max_hdr_offs;
+}
+
+/*
+ * Copy a resident entry to an arena (with its name, link name, directory children and sparse map).
+ */
+static struct tar_entry *tar_meta_copy_entry(struct super_block *sb, struct tar_arena *arena, struct tar_entry *entry)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_name *name = tar_entry_name(entry), *new_name;
+  struct tar_sparse_map *map, *new_map;
+  struct tar_entry *new_entry;
+  struct tar_dir *dir;
+
+  /* copy entry and name */
+  new_entry = (struct tar_entry *) tar_arena_alloc(arena, sizeof(struct tar_entry));
+  new_name = (struct tar_name *) tar_arena_alloc(arena, sizeof(struct tar_name) + name->len + 1);
+  if (!new_entry || !new_name)
+    return NULL;
+
+  *new_entry = *entry;
+  memcpy(new_name, name, sizeof(struct tar_name) + name->len + 1);
+  new_name->next = NULL;
+  new_entry->name = new_name->name;
+
+  /* copy directory children (and hash buckets) */
+  if (S_ISDIR(entry->mode) && entry->dir) {
+    dir = (struct tar_dir *) tar_arena_alloc(arena, struct_size(dir, children, entry->dir->nr_children));
+    if (!dir)
+      return NULL;
+
+    memcpy(dir, entry->dir, struct_size(dir, children, entry->dir->nr_children));
+    dir->max_children = dir->nr_children;
+    if (dir->buckets) {
+      dir->buckets = (u32 *) tar_arena_alloc(arena, sizeof(u32) * ((1 << dir->hash_bits) + 1));
+      if (!dir->buckets)
+        return NULL;
+      memcpy(dir->buckets, entry->dir->buckets, sizeof(u32) * ((1 << dir->hash_bits) + 1));
+    }
+
+    new_entry->dir = dir;
+  }
+
+  /* copy link name (resolved hard links hold their target inode number) */
+  if (S_ISLNK(entry->mode) && !(entry->flags & TAR_ENTRY_HARDLINK) && entry->linkname) {
+    new_entry->linkname = tar_arena_strndup(arena, entry->linkname, strlen(entry->linkname));
+    if (!new_entry->linkname)
+      return NULL;
+  }
+
+  /* copy sparse map */
+  if (entry->flags & TAR_ENTRY_SPARSE) {
+    map = sbi->s_sparse[entry->ino];
+    new_map = (struct tar_sparse_map *) tar_arena_alloc(arena, struct_size(map, extents, map->nr_extents));
+    if (!new_map)
+      return NULL;
+
+    memcpy(new_map, map, struct_size(map, extents, map->nr_extents));
+    sbi->s_sparse[entry->ino] = new_map;
+  }
+
+  return new_entry;
+}
+
+/*
+ * Append a string to a loader strings buffer (names are stored as interned names, to keep their hash).
+ */
+static int tar_meta_add_string(struct tar_meta_loader *loader, const char *str, size_t len, bool is_name, u32 *off)
+{
+  size_t size = ALIGN((is_name ? sizeof(struct tar_name) : 0) + len + 1, sizeof(long)), new_size;
+  struct tar_name *name;
+  char *strs;
+
+  /* grow strings buffer */
+  if (loader->strs_len + size > loader->strs_size) {
+    new_size = max(loader->strs_size * 2, loader->strs_len + size + PAGE_SIZE);
+    strs = kvrealloc(loader->strs, loader->strs_size, new_size, GFP_KERNEL);
+    if (!strs)
+      return -ENOMEM;
+
+    loader->strs = strs;
+    loader->strs_size = new_size;
+  }
+
+  *off = loader->strs_len;
+  if (is_name) {
+    name = (struct tar_name *) (loader->strs + loader->strs_len);
+    name->next = NULL;
+    name->hash = tar_name_hash(str, len);
+    name->len = len;
+    memcpy(name->name, str, len);
+    name->name[len] = 0;
+  } else {
+    memcpy(loader->strs + loader->strs_len, str, len);
+    loader->strs[loader->strs_len + len] = 0;
+  }
+
+  loader->strs_len += size;
+  return 0;
+}
+
+/*
+ * Add an entry to a loader (entry attributes are set, its name and link name are added).
+ */
+static int tar_meta_add_entry(struct super_block *sb, struct tar_meta_loader *loader, u32 ino, const char *name,
+                              size_t name_len, const char *link, s64 atime, s64 ctime)
+{
+  struct tar_entry *entry = &loader->entries[loader->nr];
+  int err;
+
+  /* evicted entries are never directories */
+  if (S_ISDIR(entry->mode) || !name_len || name_len > U16_MAX)
+    return -EIO;
+
+  entry->linkname = NULL;
+  entry->ino = ino;
+  entry->parent = tarfs_sb(sb)->s_meta.parents[ino];
+  entry->name_len = name_len;
+  entry->flags = atime != entry->mtime || ctime != entry->mtime ? TAR_ENTRY_XTIME : 0;
+  entry->layer = 0;
+  entry->opaque = 0;
+
+  err = tar_meta_add_string(loader, name, name_len, true, &loader->name_offs[loader->nr]);
+  if (err)
+    return err;
+
+  loader->link_offs[loader->nr] = TAR_META_NO_LINK;
+  if (S_ISLNK(entry->mode) && link) {
+    err = tar_meta_add_string(loader, link, strlen(link), false, &loader->link_offs[loader->nr]);
+    if (err)
+      return err;
+  }
+
+  loader->nr++;
+  return 0;
+}
+
+/*
+ * Rebuild entries of a group from their archive headers (headers of a group are read in archive order).
+ */
+static int tar_meta_read_archive(struct super_block *sb, struct tar_meta_loader *loader, u32 start, u32 end)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  struct tar_member *member = &loader->member;
+  struct tar_entry *entry;
+  const char *name;
+  u32 ino;
+  int err;
+
+  err = tar_scan_init_window(&loader->scan, sb, 0, TARFS_META_WINDOW_SIZE);
+  if (err)
+    return err;
+
+  for (ino = start; ino < end; ino++) {
+    if (!meta->parents[ino])
+      continue;
+
+    /* read member headers */
+    err = tar_read_member(&loader->scan, meta->hdr_offs[ino], &loader->raw, member);
+    if (err)
+      break;
+
+    /* set entry (hard links and sparse members are never evicted) */
+    entry = &loader->entries[loader->nr];
+    entry->data_off = member->data_off;
+    entry->data_len = member->data_len;
+    entry->mode = member->mode;
+    entry->uid = member->uid;
+    entry->gid = member->gid;
+    entry->mtime = member->mtime;
+
+    name = strrchr(member->path, '/');
+    name = name ? name + 1 : member->path;
+    err = -EIO;
+    if (member->typeflag != TAR_LNKTYPE && !member->sparse)
+      err = tar_meta_add_entry(sb, loader, ino, name, member->path + member->path_len - name, member->link,
+                               member->atime, member->ctime);
+
+    tar_release_raw(&loader->raw);
+    if (err)
+      break;
+  }
+
+  tar_scan_exit(&loader->scan);
+  return err;
+}
+
+/*
+ * Read a string from the index string table.
+ */
+static int tar_meta_index_string(struct super_block *sb, u32 off, char *buf)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  loff_t pos = meta->strtab_off + off, size = i_size_read(file_inode(meta->index_file));
+  ssize_t len;
+
+  if (pos >= size)
+    return -EIO;
+
+  len = kernel_read(meta->index_file, buf, min_t(loff_t, PATH_MAX, size - pos), &pos);
+  if (len <= 0 || !memchr(buf, 0, len))
+    return -EIO;
+
+  return 0;
+}
+
+/*
+ * Rebuild entries of a group from the index (index entry i is inode i + 1).
+ */
+static int tar_meta_read_index(struct super_block *sb, struct tar_meta_loader *loader, u32 start, u32 end)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  struct tarfs_index_entry *ie;
+  struct tar_entry *entry;
+  ssize_t len;
+  loff_t pos;
+  u32 ino;
+  int err;
+
+  /* read index entries of the group in one pass */
+  for (; start < end && !meta->parents[start]; start++);
+  for (; end > start && !meta->parents[end - 1]; end--);
+  if (start == end)
+    return 0;
+
+  pos = sizeof(struct tarfs_index_super) + (loff_t) (start - TARFS_ROOT_INO) * sizeof(struct tarfs_index_entry);
+  len = kernel_read(meta->index_file, loader->ientries, (end - start) * sizeof(struct tarfs_index_entry), &pos);
+  if (len != (end - start) * sizeof(struct tarfs_index_entry))
+    return len < 0 ? len : -EIO;
+
+  for (ino = start; ino < end; ino++) {
+    if (!meta->parents[ino])
+      continue;
+
+    /* hard links are never evicted */
+    ie = &loader->ientries[ino - start];
+    if (ie->typeflag == TAR_LNKTYPE)
+      return -EIO;
+
+    /* get names */
+    err = tar_meta_index_string(sb, le32_to_cpu(ie->name_off), loader->name_buf);
+    if (!err && ie->typeflag == TAR_SYMTYPE)
+      err = tar_meta_index_string(sb, le32_to_cpu(ie->link_off), loader->link_buf);
+    if (err)
+      return err;
+
+    /* set entry */
+    entry = &loader->entries[loader->nr];
+    entry->data_off = le64_to_cpu(ie->data_off);
+    entry->data_len = le64_to_cpu(ie->data_len);
+    entry->mode = (le32_to_cpu(ie->mode) & S_IALLUGO) | tar_type_to_posix(ie->typeflag);
+    entry->uid = le32_to_cpu(ie->uid);
+    entry->gid = le32_to_cpu(ie->gid);
+    entry->mtime = le64_to_cpu(ie->mtime);
+
+    err = tar_meta_add_entry(sb, loader, ino, loader->name_buf, strlen(loader->name_buf), loader->link_buf,
+                             le64_to_cpu(ie->atime), le64_to_cpu(ie->ctime));
+    if (err)
+      return err;
+  }
+
+  return 0;
+}
+
+/*
+ * Publish entries of a loaded group.
+ */
+static int tar_meta_publish(struct super_block *sb, struct tar_meta_group *group, struct tar_meta_loader *loader)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_meta *meta = &sbi->s_meta;
+  struct tar_meta_block *block;
+  struct tar_entry *entry;
+  size_t size;
+  char *strs;
+  u32 i;
+
+  if (loader->nr != group->nr_leaves)
+    return -EIO;
+
+  /* allocate block (entries, then strings) */
+  size = struct_size(block, entries, loader->nr);
+  block = kvmalloc(size + loader->strs_len, GFP_KERNEL);
+  if (!block)
+    return -ENOMEM;
+
+  block->nr = loader->nr;
+  strs = (char *) block + size;
+  memcpy(strs, loader->strs, loader->strs_len);
+  for (i = 0; i < loader->nr; i++) {
+    entry = &block->entries[i];
+    *entry = loader->entries[i];
+    entry->name = ((struct tar_name *) (strs + loader->name_offs[i]))->name;
+    if (loader->link_offs[i] != TAR_META_NO_LINK)
+      entry->linkname = strs + loader->link_offs[i];
+  }
+
+  /* publish entries */
+  spin_lock(&meta->lru_lock);
+  for (i = 0; i < block->nr; i++)
+    smp_store_release(&sbi->s_tar_entries[block->entries[i].ino], &block->entries[i]);
+  group->block = block;
+  group->referenced = true;
+  list_add(&group->lru, &meta->lru);
+  meta->nr_resident += group->nr_leaves;
+  spin_unlock(&meta->lru_lock);
+
+  return 0;
+}
+
+/*
+ * Load a group.
+ */
+static int tar_meta_load_group(struct super_block *sb, u32 g)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_meta *meta = &sbi->s_meta;
+  u32 start = g << TARFS_META_GROUP_BITS, end = min_t(u32, start + TARFS_META_GROUP_SIZE, sbi->s_ninodes);
+  struct tar_meta_loader *loader;
+  int err;
+
+  loader = kvmalloc(sizeof(struct tar_meta_loader), GFP_KERNEL);
+  if (!loader)
+    return -ENOMEM;
+
+  loader->nr = 0;
+  loader->strs = NULL;
+  loader->strs_len = 0;
+  loader->strs_size = 0;
+
+  /* rebuild entries, then publish them */
+  if (meta->index_file)
+    err = tar_meta_read_index(sb, loader, start, end);
+  else
+    err = tar_meta_read_archive(sb, loader, start, end);
+  if (!err)
+    err = tar_meta_publish(sb, &meta->groups[g], loader);
+
+  kvfree(loader->strs);
+  kvfree(loader);
+  return err;
+}
+
+/*
+ * Load an evicted entry (and all evicted entries of its group). Returns NULL on error.
+ */
+struct tar_entry *tar_meta_load(struct super_block *sb, u32 ino)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_meta *meta = &sbi->s_meta;
+  struct tar_entry *entry;
+  u64 start;
+  int err;
+
+  /* resident entry */
+  if (!meta->parents || ino >= sbi->s_ninodes || !meta->parents[ino])
+    return NULL;
+
+  /* entry may have been loaded by another reader */
+  mutex_lock(&meta->lock);
+  entry = READ_ONCE(sbi->s_tar_entries[ino]);
+  if (!entry) {
+    start = ktime_get_ns();
+    err = tar_meta_load_group(sb, ino >> TARFS_META_GROUP_BITS);
+    if (err) {
+      printk_ratelimited("TARFS : can't load entries of inode %u (err = %d)\n", ino, err);
+    } else {
+      atomic_long_inc(&meta->loads);
+      atomic64_add(ktime_get_ns() - start, &meta->load_time);
+    }
+
+    entry = READ_ONCE(sbi->s_tar_entries[ino]);
+  }
+  mutex_unlock(&meta->lock);
+
+  return entry;
+}
+
+/*
+ * Get an entry for a new inode (its group stays resident until the inode is evicted). Returns NULL on error.
+ */
+struct tar_entry *tar_meta_pin(struct super_block *sb, u32 ino)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  struct tar_meta_group *group;
+  struct tar_entry *entry;
+
+  if (!meta->ready || !meta->parents[ino])
+    return tar_get_entry(sb, ino);
+
+  /* pin group (the shrinker checks pins and evicts under the same lock) */
+  group = &meta->groups[ino >> TARFS_META_GROUP_BITS];
+  spin_lock(&meta->lru_lock);
+  group->pins++;
+  group->referenced = true;
+  spin_unlock(&meta->lru_lock);
+
+  /* load entry */
+  entry = tar_get_entry(sb, ino);
+  if (!entry)
+    tar_meta_unpin(sb, ino);
+
+  return entry;
+}
+
+/*
+ * Release an entry of an evicted inode.
+ */
+void tar_meta_unpin(struct super_block *sb, u32 ino)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+
+  if (!meta->ready || !meta->parents[ino])
+    return;
+
+  spin_lock(&meta->lru_lock);
+  meta->groups[ino >> TARFS_META_GROUP_BITS].pins--;
+  spin_unlock(&meta->lru_lock);
+}
+
+/*
+ * Mark an entry group as used.
+ */
+void tar_meta_touch(struct super_block *sb, u32 ino)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  struct tar_meta_group *group;
+
+  if (!meta->ready || !meta->parents[ino])
+    return;
+
+  group = &meta->groups[ino >> TARFS_META_GROUP_BITS];
+  if (!READ_ONCE(group->referenced))
+    WRITE_ONCE(group->referenced, true);
+}
+
+/*
+ * Release an evicted block (once all readers are done).
+ */
+static void tar_meta_free_block(struct rcu_head *rcu)
+{
+  kvfree(container_of(rcu, struct tar_meta_block, rcu));
+}
+
+/*
+ * Count resident evictable entries (shrinker).
+ */
+static unsigned long tar_meta_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+  struct tar_meta *meta = container_of(shrinker, struct tar_meta, shrinker);
+
+  return READ_ONCE(meta->nr_resident) ?: SHRINK_EMPTY;
+}
+
+/*
+ * Evict least recently used groups (shrinker). Groups used since last pass get a second chance, groups of in core
+ * inodes are never evicted.
+ */
+static unsigned long tar_meta_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+  struct tar_meta *meta = container_of(shrinker, struct tar_meta, shrinker);
+  struct tarfs_sb_info *sbi = container_of(meta, struct tarfs_sb_info, s_meta);
+  struct tar_meta_group *group;
+  struct tar_meta_block *block;
+  unsigned long freed = 0;
+  u32 scanned, i;
+
+  spin_lock(&meta->lru_lock);
+  for (scanned = 0; freed < sc->nr_to_scan && !list_empty(&meta->lru) && scanned < meta->nr_groups; scanned++) {
+    group = list_last_entry(&meta->lru, struct tar_meta_group, lru);
+    if (group->pins || group->referenced) {
+      group->referenced = false;
+      list_move(&group->lru, &meta->lru);
+      continue;
+    }
+
+    /* unpublish entries (readers still using them hold the read lock) */
+    block = group->block;
+    for (i = 0; i < block->nr; i++)
+      WRITE_ONCE(sbi->s_tar_entries[block->entries[i].ino], NULL);
+
+    group->block = NULL;
+    list_del_init(&group->lru);
+    meta->nr_resident -= group->nr_leaves;
+    freed += group->nr_leaves;
+    atomic_long_inc(&meta->evictions);
+    call_srcu(&meta->srcu, &block->rcu, tar_meta_free_block);
+  }
+  spin_unlock(&meta->lru_lock);
+
+  return freed;
+}
+
+/*
+ * Init demand-paged metadata.
+ */
+void tar_meta_init(struct tar_meta *meta)
+{
+  meta->enabled = false;
+  meta->ready = false;
+  meta->groups = NULL;
+  meta->nr_groups = 0;
+  meta->parents = NULL;
+  meta->hdr_offs = NULL;
+  meta->max_hdr_offs = 0;
+  meta->index_file = NULL;
+  meta->strtab_off = 0;
+  mutex_init(&meta->lock);
+  spin_lock_init(&meta->lru_lock);
+  INIT_LIST_HEAD(&meta->lru);
+  meta->nr_evictable = 0;
+  meta->nr_resident = 0;
+  atomic_long_set(&meta->loads, 0);
+  atomic_long_set(&meta->evictions, 0);
+  atomic64_set(&meta->load_time, 0);
+}
+
+/*
+ * Prepare demand-paged metadata, once the tree is built : resident entries are moved to a new arena, other entries
+ * are released (they are loaded on first use).
+ */
+int tar_meta_prepare(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_meta *meta = &sbi->s_meta;
+  struct tar_entry *entry;
+  struct tar_arena arena;
+  u32 ino, g;
+  int err;
+
+  if (!meta->enabled)
+    return 0;
+
+  /* allocate groups and parents */
+  meta->nr_groups = DIV_ROUND_UP(sbi->s_ninodes, TARFS_META_GROUP_SIZE);
+  meta->groups = kvcalloc(meta->nr_groups, sizeof(struct tar_meta_group), GFP_KERNEL);
+  meta->parents = kvcalloc(sbi->s_ninodes, sizeof(u32), GFP_KERNEL);
+  if (!meta->groups || !meta->parents)
+    return -ENOMEM;
+  for (g = 0; g < meta->nr_groups; g++)
+    INIT_LIST_HEAD(&meta->groups[g].lru);
+
+  /* mark hard links targets */
+  for (ino = TARFS_ROOT_INO; ino < sbi->s_ninodes; ino++)
+    if (sbi->s_tar_entries[ino]->flags & TAR_ENTRY_HARDLINK)
+      meta->parents[sbi->s_tar_entries[ino]->target] = TAR_META_PINNED;
+
+  /* move resident entries */
+  tar_arena_init(&arena);
+  for (ino = TARFS_ROOT_INO; ino < sbi->s_ninodes; ino++) {
+    entry = sbi->s_tar_entries[ino];
+    if (meta->parents[ino] == TAR_META_PINNED) {
+      meta->parents[ino] = 0;
+    } else if (ino != TARFS_ROOT_INO && tar_meta_evictable(sb, entry)) {
+      meta->parents[ino] = entry->parent;
+      meta->groups[ino >> TARFS_META_GROUP_BITS].nr_leaves++;
+      meta->nr_evictable++;
+      sbi->s_tar_entries[ino] = NULL;
+      continue;
+    }
+
+    entry = tar_meta_copy_entry(sb, &arena, entry);
+    if (!entry) {
+      tar_arena_free(&arena);
+      return -ENOMEM;
+    }
+
+    sbi->s_tar_entries[ino] = entry;
+  }
+
+  /* release build arena */
+  tar_arena_free(&sbi->s_arena);
+  sbi->s_arena = arena;
+  sbi->s_root_entry = sbi->s_tar_entries[TARFS_ROOT_INO];
+
+  /* init readers */
+  err = init_srcu_struct(&meta->srcu);
+  if (err)
+    return err;
+
+  /* register shrinker (groups are evicted under memory pressure) */
+  meta->shrinker.count_objects = tar_meta_count;
+  meta->shrinker.scan_objects = tar_meta_scan;
+  meta->shrinker.seeks = DEFAULT_SEEKS;
+  err = register_shrinker(&meta->shrinker);
+  if (err) {
+    cleanup_srcu_struct(&meta->srcu);
+    return err;
+  }
+
+  meta->ready = true;
+  printk("TARFS : %lu of %u entries evictable (%zu resident bytes, rebuilt from %s)\n", meta->nr_evictable,
+         sbi->s_ninodes - 1, sbi->s_arena.size, meta->index_file ? "index" : "archive headers");
+  return 0;
+}
+
+/*
+ * Release demand-paged metadata.
+ */
+void tar_meta_release(struct super_block *sb)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  u32 g;
+
+  /* wait for evicted blocks release */
+  if (meta->ready) {
+    unregister_shrinker(&meta->shrinker);
+    srcu_barrier(&meta->srcu);
+    cleanup_srcu_struct(&meta->srcu);
+    meta->ready = false;
+  }
+
+  /* release resident blocks */
+  for (g = 0; meta->groups && g < meta->nr_groups; g++)
+    kvfree(meta->groups[g].block);
+
+  kvfree(meta->groups);
+  kvfree(meta->parents);
+  kvfree(meta->hdr_offs);
+  meta->groups = NULL;
+  meta->parents = NULL;
+  meta->hdr_offs = NULL;
+  meta->max_hdr_offs = 0;
+  if (meta->index_file)
+    filp_close(meta->index_file, NULL);
+  meta->index_file = NULL;
+}
+
+/*
+ * Show demand-paged metadata statistics.
+ */
+void tar_meta_show_stats(struct seq_file *seq, struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_meta *meta = &sbi->s_meta;
+
+  if (!meta->ready)
+    return;
+
+  seq_printf(seq, "\n\tmeta: entries %u resident %lu evictable %lu loads %ld evictions %ld load_ms %llu",
+             sbi->s_ninodes - 1, sbi->s_ninodes - 1 - meta->nr_evictable + READ_ONCE(meta->nr_resident),
+             meta->nr_evictable, atomic_long_read(&meta->loads), atomic_long_read(&meta->evictions),
+             div_u64(atomic64_read(&meta->load_time), NSEC_PER_MSEC));
+}
@@ -1,24 +1,5 @@
 #include "tarfs.h"
 
-/*
- * Find an entry in a directory.
- */
-static struct tar_entry *tarfs_find_entry(struct inode *dir, struct dentry *dentry)
-{
-  struct tar_entry *dir_entry, *child;
-  struct list_head *pos;
-  
-  /* lookup in children */
-  dir_entry = tarfs_i(dir)->entry;
-  list_for_each(pos, &dir_entry->children) {
-    child = list_entry(pos, struct tar_entry, list);
-    if (strlen(child->name) == dentry->d_name.len && memcmp(child->name, dentry->d_name.name, dentry->d_name.len) == 0)
-      return child;
-  }
-  
-  return NULL;
-}
-
 /*
  * Lookup for a file in a directory.
  */
@@ -26,16 +7,46 @@ static struct dentry *tarfs_lookup(struct inode *dir, struct dentry *dentry, uns
 {
   struct inode *inode = NULL;
   struct tar_entry *entry;
+  int err = 0, idx;
+  u32 ino = 0;
+  
+  /* find entry (while indexing lazily, a missing entry may still be published : wait for directory) */
+  idx = tar_meta_read_lock(dir->i_sb);
+  entry = tar_dir_find(dir->i_sb, tarfs_i(dir)->entry, dentry->d_name.name, dentry->d_name.len);
+  if (!entry) {
+    err = tar_lazy_wait(dir->i_sb, tarfs_i(dir)->entry);
+    if (!err)
+      entry = tar_dir_find(dir->i_sb, tarfs_i(dir)->entry, dentry->d_name.name, dentry->d_name.len);
+  }
+  
+  /* get inode number (hard links share their target inode) */
+  if (IS_ERR(entry))
+    err = PTR_ERR(entry);
+  else if (entry)
+    ino = tar_link_target(dir->i_sb, entry)->ino;
+  tar_meta_read_unlock(dir->i_sb, idx);
+  if (err)
+    return ERR_PTR(err);
   
-  /* find entry and get inode */
-  entry = tarfs_find_entry(dir, dentry);
-  if (entry)
-    inode = tarfs_iget(dir->i_sb, entry->ino);
+  /* get inode */
+  if (ino)
+    inode = tarfs_iget(dir->i_sb, ino);
   
   /* register inode - dentry */
   return d_splice_alias(inode, dentry);
 }
 
+/*
+ * Revalidate a dentry (negative dentries created while indexing lazily are dropped if archive is not in tree order).
+ */
+static int tarfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+  if (d_really_is_positive(dentry))
+    return 1;
+
+  return tar_lazy_negative_valid(dentry->d_sb);
+}
+
 /*
  * Get target link.
  */
@@ -63,6 +74,13 @@ struct inode_operations tarfs_dir_iops = {
   .getattr        = tarfs_getattr,
 };
 
+/*
+ * TarFS dentry operations (lazy indexing).
+ */
+const struct dentry_operations tarfs_lazy_dops = {
+  .d_revalidate   = tarfs_d_revalidate,
+};
+
 /*
  * TarFS symlink inode operations.
  */
@@ -0,0 +1,129 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/hash.h>
+
+#include "tarfs.h"
+
+/*
+ * Init names dictionary.
+ */
+int tar_names_init(struct tar_names *names)
+{
+  struct tar_names_shard *shard;
+  unsigned int i;
+
+  names->count = 0;
+  names->size = 0;
+
+  for (i = 0; i < ARRAY_SIZE(names->shards); i++) {
+    shard = &names->shards[i];
+    mutex_init(&shard->lock);
+    shard->bits = TARFS_NAMES_HASH_BITS;
+    shard->count = 0;
+    shard->size = 0;
+    shard->table = kvcalloc(1 << shard->bits, sizeof(struct tar_name *), GFP_KERNEL);
+    if (!shard->table)
+      return -ENOMEM;
+  }
+
+  return 0;
+}
+
+/*
+ * Release names dictionary (interned names stay in the arena, statistics are kept).
+ */
+void tar_names_release(struct tar_names *names)
+{
+  struct tar_names_shard *shard;
+  unsigned int i;
+
+  for (i = 0; i < ARRAY_SIZE(names->shards); i++) {
+    shard = &names->shards[i];
+    names->count += shard->count;
+    names->size += shard->size;
+    shard->count = 0;
+    shard->size = 0;
+    kvfree(shard->table);
+    shard->table = NULL;
+  }
+}
+
+/*
+ * Grow a names dictionary shard.
+ */
+static void tar_names_grow(struct tar_names_shard *shard)
+{
+  struct tar_name **old_table = shard->table, *name, *next, **bucket;
+  unsigned int old_size = 1 << shard->bits, i;
+
+  /* allocate new table */
+  shard->table = kvcalloc(old_size * 2, sizeof(struct tar_name *), GFP_KERNEL);
+  if (!shard->table) {
+    shard->table = old_table;
+    return;
+  }
+
+  /* rehash names */
+  shard->bits++;
+  for (i = 0; i < old_size; i++) {
+    for (name = old_table[i]; name; name = next) {
+      next = name->next;
+      bucket = &shard->table[hash_32(name->hash, shard->bits)];
+      name->next = *bucket;
+      *bucket = name;
+    }
+  }
+
+  kvfree(old_table);
+}
+
+/*
+ * Intern a name, allocated in an arena if it is new (names can be interned concurrently from different arenas).
+ */
+struct tar_name *tar_names_intern(struct tar_names *names, struct tar_arena *arena, const char *str, size_t len)
+{
+  unsigned int hash = tar_name_hash(str, len);
+  struct tar_names_shard *shard = &names->shards[hash & (ARRAY_SIZE(names->shards) - 1)];
+  struct tar_name *name, **bucket;
+
+  mutex_lock(&shard->lock);
+
+  /* find name */
+  bucket = &shard->table[hash_32(hash, shard->bits)];
+  for (name = *bucket; name; name = name->next)
+    if (name->hash == hash && name->len == len && memcmp(name->name, str, len) == 0)
+      goto out;
+
+  /* create name */
+  name = (struct tar_name *) tar_arena_alloc(arena, sizeof(struct tar_name) + len + 1);
+  if (!name)
+    goto out;
+  name->hash = hash;
+  name->len = len;
+  memcpy(name->name, str, len);
+  name->name[len] = 0;
+
+  /* add it to dictionary */
+  name->next = *bucket;
+  *bucket = name;
+  shard->size += len + 1;
+
+  /* keep at most one name per bucket on average */
+  if (++shard->count > (1U << shard->bits))
+    tar_names_grow(shard);
+
+out:
+  mutex_unlock(&shard->lock);
+  return name;
+}
+
+/*
+ * Intern a name (each distinct name is stored once per super block).
+ */
+struct tar_name *tar_intern_name(struct super_block *sb, const char *str, size_t len)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+
+  return tar_names_intern(&sbi->s_names, &sbi->s_arena, str, len);
+}
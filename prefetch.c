@@ -0,0 +1,244 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/fadvise.h>
+
+#include "tarfs.h"
+
+/*
+ * Prefetch work (prefetch members following an opened member).
+ */
+struct tar_prefetch_work {
+  struct work_struct    work;                 /* work */
+  struct super_block    *sb;                  /* super block */
+  u32                   start;                /* first member to prefetch */
+  u32                   end;                  /* last member to prefetch + 1 */
+};
+
+/*
+ * Init prefetcher.
+ */
+int tar_prefetch_init(struct super_block *sb)
+{
+  struct tar_prefetch *pf = &tarfs_sb(sb)->s_prefetch;
+
+  spin_lock_init(&pf->lock);
+  pf->last = 0;
+  pf->budget = TARFS_PREFETCH_BUDGET_MAX;
+  atomic_long_set(&pf->issued, 0);
+  atomic_long_set(&pf->hits, 0);
+  atomic_long_set(&pf->misses, 0);
+  atomic64_set(&pf->bytes, 0);
+
+  /* prefetch disabled */
+  pf->wq = NULL;
+  if (!pf->members)
+    return 0;
+
+  pf->wq = alloc_workqueue("tarfs-prefetch", WQ_UNBOUND, 1);
+  if (!pf->wq)
+    return -ENOMEM;
+
+  return 0;
+}
+
+/*
+ * Stop prefetcher (wait for running prefetches).
+ */
+void tar_prefetch_exit(struct super_block *sb)
+{
+  struct tar_prefetch *pf = &tarfs_sb(sb)->s_prefetch;
+
+  if (pf->wq) {
+    destroy_workqueue(pf->wq);
+    pf->wq = NULL;
+  }
+
+  xa_destroy(&pf->prefetched);
+}
+
+/*
+ * Read pages of a member in page cache (asynchronously).
+ */
+void tar_readahead_member(struct inode *inode, pgoff_t index, unsigned long nr_pages)
+{
+  struct file *file = tar_shared_file(inode);
+  struct file_ra_state ra;
+  DEFINE_READAHEAD(ractl, NULL, &ra, inode->i_mapping, index);
+
+  /* member data is cached in archive file or block device page cache */
+  if (file) {
+    vfs_fadvise(file, tarfs_i(inode)->entry->data_off + ((loff_t) index << PAGE_SHIFT),
+                (loff_t) nr_pages << PAGE_SHIFT, POSIX_FADV_WILLNEED);
+    return;
+  }
+
+  file_ra_state_init(&ra, inode->i_mapping);
+  page_cache_ra_unbounded(&ractl, nr_pages, 0);
+}
+
+/*
+ * Check if a member data is (even partially) cached, in its own page cache or in the shared archive file or block
+ * device page cache.
+ */
+static bool tar_prefetch_cached(struct inode *inode)
+{
+  struct file *file = tar_shared_file(inode);
+  loff_t start;
+
+  if (!file)
+    return inode->i_mapping->nrpages != 0;
+
+  start = tarfs_i(inode)->entry->data_off;
+  return filemap_range_has_page(file->f_mapping, start, start + i_size_read(inode) - 1);
+}
+
+/*
+ * Adapt prefetch budget : a prefetched member opened is a hit (grow budget), a prefetched member lost unused is a miss
+ * (shrink budget).
+ */
+static void tar_prefetch_feedback(struct tar_prefetch *pf, bool hit)
+{
+  atomic_long_inc(hit ? &pf->hits : &pf->misses);
+  spin_lock(&pf->lock);
+  if (hit)
+    pf->budget = min_t(unsigned long, pf->budget * 2, TARFS_PREFETCH_BUDGET_MAX);
+  else
+    pf->budget = max_t(unsigned long, pf->budget / 2, TARFS_PREFETCH_BUDGET_MIN);
+  spin_unlock(&pf->lock);
+}
+
+/*
+ * Prefetch a member data in its page cache (prefetched members are tracked by inode number : inodes of members
+ * cached in a shared page cache are released right away).
+ */
+static unsigned long tar_prefetch_member(struct super_block *sb, u32 ino, unsigned long max_pages)
+{
+  struct tar_prefetch *pf = &tarfs_sb(sb)->s_prefetch;
+  unsigned long nr_pages;
+  struct inode *inode;
+
+  inode = tarfs_iget(sb, ino);
+  if (IS_ERR(inode))
+    return 0;
+
+  /* skip members already (even partially) cached */
+  nr_pages = 0;
+  if (!tar_prefetch_cached(inode)) {
+    nr_pages = min_t(unsigned long, DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE), max_pages);
+    tar_readahead_member(inode, 0, nr_pages);
+    xa_store(&pf->prefetched, ino, xa_mk_value(1), GFP_KERNEL);
+  }
+
+  iput(inode);
+  return nr_pages;
+}
+
+/*
+ * Prefetch members (members are prefetched in archive order, within the current byte budget).
+ */
+static void tar_prefetch_work_fn(struct work_struct *work)
+{
+  struct tar_prefetch_work *pw = container_of(work, struct tar_prefetch_work, work);
+  struct super_block *sb = pw->sb;
+  struct tar_prefetch *pf = &tarfs_sb(sb)->s_prefetch;
+  unsigned long budget, nr_pages;
+  struct tar_entry *entry;
+  bool skip;
+  u32 ino;
+  int idx;
+
+  budget = READ_ONCE(pf->budget) >> PAGE_SHIFT;
+  for (ino = pw->start; ino < pw->end && budget; ino++) {
+    /* only prefetch regular files data (skip entries removed by an upper layer) */
+    idx = tar_meta_read_lock(sb);
+    entry = tar_get_entry(sb, ino);
+    skip = !entry || !S_ISREG(entry->mode) || !entry->data_len || (entry->flags & TAR_ENTRY_HIDDEN);
+    tar_meta_read_unlock(sb, idx);
+    if (skip)
+      continue;
+
+    nr_pages = tar_prefetch_member(sb, ino, budget);
+    if (nr_pages) {
+      atomic_long_inc(&pf->issued);
+      atomic64_add(nr_pages << PAGE_SHIFT, &pf->bytes);
+    }
+
+    budget -= nr_pages;
+  }
+
+  kfree(pw);
+}
+
+/*
+ * Prefetch members following an opened member.
+ */
+void tar_prefetch_neighbors(struct inode *inode)
+{
+  struct tar_prefetch *pf = &tarfs_sb(inode->i_sb)->s_prefetch;
+  struct tar_prefetch_work *pw;
+  u32 start, end;
+
+  /* prefetch disabled */
+  if (!pf->wq)
+    return;
+
+  /* opened member was prefetched : hit if its data is still cached */
+  if (xa_erase(&pf->prefetched, inode->i_ino))
+    tar_prefetch_feedback(pf, tar_prefetch_cached(inode));
+
+  /* compute members window (skip members already queued) */
+  start = inode->i_ino + 1;
+  end = min_t(u32, start + pf->members, tar_published_inodes(inode->i_sb));
+  spin_lock(&pf->lock);
+  if (pf->last >= start && pf->last < end)
+    start = pf->last + 1;
+  if (start < end)
+    pf->last = end - 1;
+  spin_unlock(&pf->lock);
+
+  if (start >= end)
+    return;
+
+  /* queue prefetch */
+  pw = kmalloc(sizeof(struct tar_prefetch_work), GFP_KERNEL);
+  if (!pw)
+    return;
+
+  INIT_WORK(&pw->work, tar_prefetch_work_fn);
+  pw->sb = inode->i_sb;
+  pw->start = start;
+  pw->end = end;
+  queue_work(pf->wq, &pw->work);
+}
+
+/*
+ * A member is evicted : if it was prefetched and never opened, this is a miss, unless its data is still in the shared
+ * page cache (the inode holds no page : the member stays tracked until it is opened).
+ */
+void tar_prefetch_evict(struct inode *inode)
+{
+  struct tar_prefetch *pf = &tarfs_sb(inode->i_sb)->s_prefetch;
+
+  if (!tarfs_i(inode)->entry || !xa_load(&pf->prefetched, inode->i_ino))
+    return;
+  if (tar_shared_file(inode) && tar_prefetch_cached(inode))
+    return;
+
+  if (xa_erase(&pf->prefetched, inode->i_ino))
+    tar_prefetch_feedback(pf, false);
+}
+
+/*
+ * Show prefetcher statistics.
+ */
+void tar_prefetch_show_stats(struct seq_file *seq, struct super_block *sb)
+{
+  struct tar_prefetch *pf = &tarfs_sb(sb)->s_prefetch;
+
+  seq_printf(seq, "\n\tprefetch: members %u budget %lu issued %lu hits %lu misses %lu bytes %lld",
+             pf->members, READ_ONCE(pf->budget), atomic_long_read(&pf->issued), atomic_long_read(&pf->hits),
+             atomic_long_read(&pf->misses), atomic64_read(&pf->bytes));
+}
@@ -1,79 +1,51 @@
 #include <linux/fs.h>
-#include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/overflow.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
 
 #include "tarfs.h"
 
 #define TARFS_ALIGN_UP(x)               (((x) + TARFS_BLOCK_SIZE - 1) & ~(TARFS_BLOCK_SIZE - 1))
 
 /*
- * Convert tar type to POSIX.
+ * Allocate a new tar entry with default attributes in an arena (entry is not attached to the tree).
  */
-static inline mode_t tar_type_to_posix(int typeflag)
+static struct tar_entry *tar_new_entry(struct tar_arena *arena, struct tar_name *name, int typeflag,
+                                       const char *linkname)
 {
-  switch(typeflag) {
-    case TAR_REGTYPE:
-    case TAR_AREGTYPE:
-      return S_IFREG;
-    case TAR_DIRTYPE:
-      return S_IFDIR;
-    case TAR_SYMTYPE:
-    case TAR_LNKTYPE:
-      return S_IFLNK;
-    case TAR_CHRTYPE:
-      return S_IFCHR;
-    case TAR_BLKTYPE:
-      return S_IFBLK;
-    case TAR_FIFOTYPE:
-      return S_IFIFO;
-    default:
-      return 0;
-  }
-}
-
-/*
- * Get or create a tar entry.
- */
-static struct tar_entry *tar_get_or_create_entry(struct super_block *sb, struct tar_entry *parent, const char *name,
-                                                 char *linkname, struct tar_header *hdr, off_t offset)
-{
-  struct tarfs_sb_info *sbi = tarfs_sb(sb);
-  struct tar_entry *entry = NULL;
-  struct list_head *pos;
+  struct tar_entry *entry;
   size_t link_name_len;
-  
-  /* check if entry already exist */
-  if (parent) {
-    list_for_each(pos, &parent->children) {
-      entry = list_entry(pos, struct tar_entry, list);
-      if (strcmp(entry->name, name) == 0)
-        return entry;
-    }
-  }
+
+  /* names are stored on 16 bits */
+  if (name->len > U16_MAX)
+    return NULL;
 
   /* create new entry */
-  entry = (struct tar_entry *) kmalloc(sizeof(struct tar_entry), GFP_KERNEL);
+  entry = (struct tar_entry *) tar_arena_alloc(arena, sizeof(struct tar_entry));
   if (!entry)
-    goto err;
+    return NULL;
 
   /* set new entry name */
   entry->linkname = NULL;
-  entry->name = kstrdup(name, GFP_KERNEL);
-  if (!entry->name)
-    goto err;
+  entry->name = name->name;
+  entry->name_len = name->len;
 
-  /* set link name (hard link : add root '/') */
-  if (hdr && hdr->typeflag == TAR_SYMTYPE) {
-    entry->linkname = kstrdup(linkname, GFP_KERNEL);
+  /* set link name (hard link : add root '/', used until it is resolved) */
+  if (typeflag == TAR_SYMTYPE) {
+    entry->linkname = tar_arena_strndup(arena, linkname, strlen(linkname));
     if (!entry->linkname)
-      goto err;
-  } else if (hdr && hdr->typeflag == TAR_LNKTYPE) {
+      return NULL;
+  } else if (typeflag == TAR_LNKTYPE) {
     link_name_len = strlen(linkname);
 
-    /* reallocate link name */
-    entry->linkname = (char *) kmalloc(link_name_len + 2, GFP_KERNEL);
+    /* allocate link name */
+    entry->linkname = (char *) tar_arena_alloc(arena, link_name_len + 2);
     if (!entry->linkname)
-      goto err;
+      return NULL;
 
     /* concat '/' and link name */
     entry->linkname[0] = '/';
@@ -81,331 +53,1565 @@ static struct tar_entry *tar_get_or_create_entry(struct super_block *sb, struct
     entry->linkname[link_name_len + 1] = 0;
   }
 
-  /* parse tar header */
-  if (hdr) {
-    entry->data_off = offset + TARFS_BLOCK_SIZE;
-    entry->mtime.tv_nsec = 0;
-    entry->atime.tv_nsec = 0;
-    entry->ctime.tv_nsec = 0;
-    
-    /* get file size */
-    if (kstrtoul(hdr->size, 8, &entry->data_len) != 0)
-      goto err;
-    
-    /* get file mode */
-    if (kstrtouint(hdr->mode, 8, &entry->mode) != 0)
-      goto err;
-    entry->mode |= tar_type_to_posix(hdr->typeflag);
-    
-    /* get uid */
-    if (kstrtouint(hdr->uid, 8, &entry->uid) != 0)
-      goto err;
-    
-    /* get gid */
-    if (kstrtouint(hdr->gid, 8, &entry->gid) != 0)
-      goto err;
-    
-    /* get last modification time */
-    if (kstrtoull(hdr->mtime, 8, &entry->mtime.tv_sec) != 0)
-      goto err;
-    
-    /* get last access time */
-    if (kstrtoull(hdr->atime, 8, &entry->atime.tv_sec) != 0)
-      entry->atime = entry->mtime;
-    
-    /* get creation time */
-    if (kstrtoull(hdr->ctime, 8, &entry->ctime.tv_sec) != 0)
-      entry->ctime = entry->mtime;
-  } else {
-    entry->data_off = 0;
-    entry->data_len = 0;
-    entry->mode = S_IFDIR | 0755;
-    entry->uid = 0;
-    entry->gid = 0;
-    entry->atime.tv_sec = entry->mtime.tv_sec = entry->ctime.tv_sec = 0;
-    entry->atime.tv_nsec = entry->mtime.tv_nsec = entry->ctime.tv_nsec = 0;
-  }
-
-  /* set inode number */
-  entry->ino = sbi->s_ninodes++;
-
-  /* init lists */
-  INIT_LIST_HEAD(&entry->children);
-  INIT_LIST_HEAD(&entry->list);
-
-  /* add to parent */
-  if (parent) {
-    entry->parent = parent;
-    list_add(&entry->list, &parent->children);
-  } else {
-    entry->parent = NULL;
-  }
+  /* set default attributes */
+  entry->data_off = 0;
+  entry->data_len = 0;
+  entry->mtime = 0;
+  entry->mode = S_IFDIR | 0755;
+  entry->uid = 0;
+  entry->gid = 0;
+  entry->ino = 0;
+  entry->parent = 0;
+  entry->flags = 0;
+  entry->layer = 0;
+  entry->opaque = 0;
+
+  /* hard link is resolved once its target is indexed */
+  if (typeflag == TAR_LNKTYPE)
+    entry->flags |= TAR_ENTRY_LNKTYPE;
 
   return entry;
-err:
-  if (entry) {
-    if (entry->name)
-      kfree(entry->name);
-    if (entry->linkname)
-      kfree(entry->linkname);
-    kfree(entry);
-  }
-  return NULL;
 }
 
 /*
- * Build a tar entry long name (long names are stored in data blocks)
- * Header and offset will be updated to point to real tar header.
+ * Allocate a new tar entry with default attributes (entry is not attached to the tree).
+ * Entries and link names are allocated in the super block arena, names are interned.
  */
-static char *tar_build_long_name(struct super_block *sb, struct tar_header *hdr, off_t *offset)
+struct tar_entry *tar_alloc_entry(struct super_block *sb, struct tar_name *name, int typeflag, const char *linkname)
 {
-  size_t full_name_len, pos, count;
-  struct buffer_head *bh;
-  char *full_name;
+  return tar_new_entry(&tarfs_sb(sb)->s_arena, name, typeflag, linkname);
+}
 
-  /* get full name length */
-  if (kstrtoul(hdr->size, 8, &full_name_len) != 0)
-    return NULL;
+/*
+ * Grow a table indexed by inode number (old table is retired : readers may still use it while indexing lazily).
+ */
+static void *tar_grow_table(struct super_block *sb, void *table, u32 *size, u32 min_size, size_t elem_size)
+{
+  u32 new_size = max_t(u32, *size ? *size * 2 : TARFS_MIN_INODES, min_size);
+  void *new_table;
 
-  /* allocate full name */
-  full_name = (char *) kmalloc(full_name_len + 1, GFP_KERNEL);
-  if (!full_name)
+  new_table = kvcalloc(new_size, elem_size, GFP_KERNEL);
+  if (!new_table)
     return NULL;
 
-  /* compute offset */
-  for (pos = 0, *offset += sb->s_blocksize; pos < full_name_len;) {
-    /* get next data block */
-    bh = sb_bread(sb, *offset / sb->s_blocksize);
-    if (!bh) {
-      kfree(full_name);
-      return NULL;
-    }
+  if (table) {
+    memcpy(new_table, table, *size * elem_size);
+    tar_lazy_retire(sb, table);
+  }
 
-    /* copy full name */
-    count = full_name_len - pos < sb->s_blocksize ? full_name_len - pos : sb->s_blocksize;
-    memcpy(full_name + pos, bh->b_data, count);
+  *size = new_size;
+  return new_table;
+}
+
+/*
+ * Attach a new tar entry to the tree and give it an inode number.
+ */
+int tar_add_entry(struct super_block *sb, struct tar_entry *parent, struct tar_entry *entry)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_entry **entries;
 
-    /* release block buffer */
-    brelse(bh);
+  /* inode numbers are stored on 32 bits */
+  if (sbi->s_ninodes == U32_MAX)
+    return -ENOSPC;
 
-    /* update position and offset */
-    pos += count;
-    *offset += sb->s_blocksize;
+  /* grow entries table */
+  if (sbi->s_ninodes >= sbi->s_max_inodes) {
+    entries = tar_grow_table(sb, sbi->s_tar_entries, &sbi->s_max_inodes, sbi->s_ninodes + 1, sizeof(struct tar_entry *));
+    if (!entries)
+      return -ENOMEM;
+    smp_store_release(&sbi->s_tar_entries, entries);
   }
 
-  /* end full name */
-  full_name[full_name_len] = 0;
+  /* set inode number and parent */
+  entry->ino = sbi->s_ninodes;
+  entry->parent = parent ? parent->ino : 0;
+  sbi->s_tar_entries[entry->ino] = entry;
+  sbi->s_ninodes++;
+
+  return 0;
+}
+
+/*
+ * Set extra times of a tar entry (only stored if they differ from mtime).
+ */
+int tar_set_xtime(struct super_block *sb, struct tar_entry *entry, s64 atime, s64 ctime)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_xtime *xtimes;
 
-  /* remove last '/' */
-  if (full_name[full_name_len - 1] == '/')
-    full_name[full_name_len - 1] = 0;
+  if (atime == entry->mtime && ctime == entry->mtime)
+    return 0;
 
-  /* get next block buffer (= real tar header) */
-  bh = sb_bread(sb, *offset / sb->s_blocksize);
-  if (!bh) {
-    kfree(full_name);
-    return NULL;
+  /* grow extra times table */
+  if (entry->ino >= sbi->s_max_xtimes) {
+    xtimes = tar_grow_table(sb, sbi->s_xtimes, &sbi->s_max_xtimes, entry->ino + 1, sizeof(struct tar_xtime));
+    if (!xtimes)
+      return -ENOMEM;
+    smp_store_release(&sbi->s_xtimes, xtimes);
   }
 
-  /* update tar header */
-  memcpy(hdr, bh->b_data, sizeof(struct tar_header));
-  brelse(bh);
+  sbi->s_xtimes[entry->ino].atime = atime;
+  sbi->s_xtimes[entry->ino].ctime = ctime;
+  entry->flags |= TAR_ENTRY_XTIME;
 
-  return full_name;
+  return 0;
 }
 
 /*
- * Build full name of a TAR entry.
+ * Set sparse map of a TAR entry (map is copied in the super block arena).
  */
-static char *tar_build_full_name(struct super_block *sb, struct tar_header *hdr, off_t *offset)
+int tar_set_sparse(struct super_block *sb, struct tar_entry *entry, struct tar_sparse_map *map)
 {
-  size_t prefix_len, name_len, full_name_len;
-  char *full_name;
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_sparse_map *new_map, **table;
 
-  /* build long name */
-  if (hdr->typeflag == TAR_LONGNAME)
-    return tar_build_long_name(sb, hdr, offset);
+  /* copy map */
+  new_map = (struct tar_sparse_map *) tar_arena_alloc(&sbi->s_arena, struct_size(map, extents, map->nr_extents));
+  if (!new_map)
+    return -ENOMEM;
+  memcpy(new_map, map, struct_size(map, extents, map->nr_extents));
+  new_map->max_extents = map->nr_extents;
 
-  /* compute name length */
-  prefix_len = strnlen(hdr->prefix, sizeof(hdr->prefix));
-  name_len = strnlen(hdr->name, sizeof(hdr->name));
-  full_name_len = prefix_len + name_len;
+  /* grow sparse maps table */
+  if (entry->ino >= sbi->s_max_sparse) {
+    table = tar_grow_table(sb, sbi->s_sparse, &sbi->s_max_sparse, entry->ino + 1, sizeof(struct tar_sparse_map *));
+    if (!table)
+      return -ENOMEM;
+    smp_store_release(&sbi->s_sparse, table);
+  }
 
-  /* allocate full name */
-  full_name = (char *) kmalloc(full_name_len + 1, GFP_KERNEL);
-  if (!full_name)
-    return NULL;
+  sbi->s_sparse[entry->ino] = new_map;
+  entry->flags |= TAR_ENTRY_SPARSE;
+
+  return 0;
+}
 
-  /* concat prefix and name */
-  memcpy(full_name, hdr->prefix, prefix_len);
-  memcpy(full_name + prefix_len, hdr->name, name_len);
-  full_name[full_name_len] = 0;
+/*
+ * Set first header offset of a tar entry (only stored for demand-paged metadata).
+ */
+static int tar_set_hdr_off(struct super_block *sb, struct tar_entry *entry, u64 hdr_off)
+{
+  struct tar_meta *meta = &tarfs_sb(sb)->s_meta;
+  u64 *hdr_offs;
+
+  if (!meta->enabled)
+    return 0;
 
-  /* remove last '/' */
-  if (full_name[full_name_len - 1] == '/')
-    full_name[full_name_len - 1] = 0;
+  /* grow headers offsets table */
+  if (entry->ino >= meta->max_hdr_offs) {
+    hdr_offs = tar_grow_table(sb, meta->hdr_offs, &meta->max_hdr_offs, entry->ino + 1, sizeof(u64));
+    if (!hdr_offs)
+      return -ENOMEM;
+    meta->hdr_offs = hdr_offs;
+  }
 
-  return full_name;
+  meta->hdr_offs[entry->ino] = hdr_off;
+  return 0;
 }
 
 /*
- * Build link name.
+ * Parse a tar header numeric field (octal, padded with spaces or NUL : v7 tars pad with spaces).
  */
-static char *tar_build_link_name(struct super_block *sb, struct tar_header *hdr, off_t *offset)
+int tar_parse_octal(const char *field, size_t size, u64 *val)
 {
-  size_t link_name_len;
-  char *link_name;
+  size_t i = 0;
 
-  /* long link name */
-  if (hdr->typeflag == TAR_LONGLINK)
-    return tar_build_long_name(sb, hdr, offset);
+  while (i < size && field[i] == ' ')
+    i++;
+  if (i == size || field[i] < '0' || field[i] > '7')
+    return -EINVAL;
 
-  /* get link name length */
-  link_name_len = strnlen(hdr->linkname, sizeof(hdr->linkname));
-  if (!link_name_len)
-    return NULL;
+  for (*val = 0; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+    if (*val >> 61)
+      return -ERANGE;
+    *val = (*val << 3) | (field[i] - '0');
+  }
 
-  /* allocate link name */
-  link_name = (char *) kmalloc(link_name_len + 1, GFP_KERNEL);
-  if (!link_name)
-    return NULL;
+  for (; i < size; i++)
+    if (field[i] != ' ' && field[i] != '\0')
+      return -EINVAL;
+
+  return 0;
+}
+
+/*
+ * Get a tar header format (-EINVAL = unknown magic, v7 headers have no magic).
+ */
+static int tar_header_format(const struct tar_header *hdr)
+{
+  if (!memcmp(hdr->magic, TARFS_MAGIC_STR, sizeof(hdr->magic)))
+    return TAR_FORMAT_GNU;
+
+  if (!memcmp(hdr->magic, TARFS_USTAR_MAGIC_STR, sizeof(hdr->magic))
+      && !memcmp(hdr->version, TARFS_USTAR_VERSION, sizeof(hdr->version)))
+    return TAR_FORMAT_USTAR;
 
-  /* set link name */
-  memcpy(link_name, hdr->linkname, link_name_len);
-  link_name[link_name_len] = 0;
+  if (!memchr_inv(hdr->magic, 0, sizeof(hdr->magic)))
+    return TAR_FORMAT_V7;
 
-  return link_name;
+  return -EINVAL;
 }
 
 /*
- * Parse a TAR entry.
+ * Decode a tar header into a member (no super block state : can run on any CPU).
  */
-static struct tar_entry *tar_parse_entry(struct super_block *sb, off_t offset)
+static int tar_decode_header(struct tar_member *member, struct tar_header *hdr, off_t data_off)
 {
-  char *full_name, *link_name, *start, *end;
-  struct tar_entry *entry = NULL, *parent;
-  struct tar_header hdr;
-  struct buffer_head *bh;
+  u64 mode, uid, gid, val;
 
-  /* read block buffer */
-  bh = sb_bread(sb, offset / sb->s_blocksize);
-  if (!bh)
-    return NULL;
+  member->typeflag = hdr->typeflag;
+  member->data_off = data_off;
 
-  /* get tar header */
-  memcpy(&hdr, bh->b_data, sizeof(struct tar_header));
-  brelse(bh);
-  
-  /* check magic string */
-  if (memcmp(hdr.magic, TARFS_MAGIC_STR, sizeof(hdr.magic)))
-    return NULL;
+  /* get file size */
+  if (tar_parse_octal(hdr->size, sizeof(hdr->size), &member->data_len))
+    return -EINVAL;
 
-  /* build link name */
-  link_name = NULL;
-  if (hdr.typeflag == TAR_LNKTYPE || hdr.typeflag == TAR_SYMTYPE || hdr.typeflag == TAR_LONGLINK) {
-    link_name = tar_build_link_name(sb, &hdr, &offset);
-    if (!link_name)
-      return NULL;
+  /* get file mode */
+  if (tar_parse_octal(hdr->mode, sizeof(hdr->mode), &mode))
+    return -EINVAL;
+  member->mode = (mode & S_IALLUGO) | tar_type_to_posix(hdr->typeflag);
+
+  /* get uid and gid */
+  if (tar_parse_octal(hdr->uid, sizeof(hdr->uid), &uid) || tar_parse_octal(hdr->gid, sizeof(hdr->gid), &gid))
+    return -EINVAL;
+  member->uid = uid;
+  member->gid = gid;
+
+  /* get last modification time */
+  if (tar_parse_octal(hdr->mtime, sizeof(hdr->mtime), &val))
+    return -EINVAL;
+  member->mtime = val;
+
+  /* extra times are only stored in GNU headers (ustar prefix overlaps them) */
+  member->atime = member->mtime;
+  member->ctime = member->mtime;
+  if (tar_header_format(hdr) != TAR_FORMAT_GNU)
+    return 0;
+
+  /* get last access time */
+  if (!tar_parse_octal(hdr->atime, sizeof(hdr->atime), &val))
+    member->atime = val;
+
+  /* get creation time */
+  if (!tar_parse_octal(hdr->ctime, sizeof(hdr->ctime), &val))
+    member->ctime = val;
+
+  return 0;
+}
+
+/*
+ * Set tar entry attributes from a decoded member.
+ */
+static int tar_set_member(struct super_block *sb, struct tar_entry *entry, struct tar_member *member)
+{
+  entry->data_off = member->data_off;
+  entry->data_len = member->data_len;
+  entry->mode = member->mode;
+  entry->uid = member->uid;
+  entry->gid = member->gid;
+  entry->mtime = member->mtime;
+
+  return tar_set_xtime(sb, entry, member->atime, member->ctime) ?: tar_set_hdr_off(sb, entry, member->hdr_off);
+}
+
+/*
+ * Hash a (parent, name) build key.
+ */
+static inline unsigned int tar_build_hash(struct tar_build *build, u32 parent, unsigned int name_hash)
+{
+  return hash_32(name_hash + parent * GOLDEN_RATIO_32, build->hash_bits);
+}
+
+/*
+ * Grow build hash table.
+ */
+static int tar_build_grow(struct tar_build *build)
+{
+  struct tar_entry **old_table = build->hash_table, *entry;
+  unsigned int old_size = 1 << build->hash_bits, mask, i, j;
+
+  /* allocate new table */
+  build->hash_table = kvcalloc(old_size * 2, sizeof(struct tar_entry *), GFP_KERNEL);
+  if (!build->hash_table) {
+    build->hash_table = old_table;
+    return -ENOMEM;
+  }
+
+  /* rehash entries */
+  build->hash_bits++;
+  mask = (1 << build->hash_bits) - 1;
+  for (i = 0; i < old_size; i++) {
+    entry = old_table[i];
+    if (!entry)
+      continue;
+
+    for (j = tar_build_hash(build, entry->parent, tar_entry_name(entry)->hash); build->hash_table[j]; j = (j + 1) & mask);
+    build->hash_table[j] = entry;
+  }
+
+  kvfree(old_table);
+  return 0;
+}
+
+/*
+ * Find a (parent, name) build hash table slot (slot of the entry or first free slot).
+ */
+static unsigned int tar_build_find(struct tar_build *build, struct tar_entry *parent, struct tar_name *iname)
+{
+  unsigned int mask = (1 << build->hash_bits) - 1, i;
+  struct tar_entry *entry;
+
+  /* interned names can be compared by address */
+  for (i = tar_build_hash(build, parent->ino, iname->hash); build->hash_table[i]; i = (i + 1) & mask) {
+    entry = build->hash_table[i];
+    if (entry->parent == parent->ino && entry->name == iname->name)
+      break;
+  }
+
+  return i;
+}
+
+/*
+ * Remove an entry built from a lower layer (its subtree is hidden at index time).
+ */
+static void tar_build_hide(struct tar_build *build, struct tar_entry *entry)
+{
+  entry->flags |= TAR_ENTRY_HIDDEN;
+
+  /* cached directory chain may hold the entry */
+  build->chain_len = 0;
+}
+
+/*
+ * Merge an existing entry with an entry of an upper layer. Returns false if the existing entry must be replaced.
+ */
+static bool tar_build_merge(struct super_block *sb, struct tar_build *build, struct tar_entry *entry,
+                            struct tar_member *member)
+{
+  /* same layer (first member wins) */
+  if (entry->layer == build->layer)
+    return true;
+
+  /* implicit directory : keep lower directory (but it is provided by this layer too) */
+  if (!member) {
+    if (!S_ISDIR(entry->mode))
+      return false;
+
+    entry->layer = build->layer;
+    return true;
+  }
+
+  /* directories are merged (upper layer attributes), other entries are replaced */
+  if (!S_ISDIR(entry->mode) || !S_ISDIR(member->mode))
+    return false;
+
+  entry->flags &= ~TAR_ENTRY_XTIME;
+  entry->layer = build->layer;
+  return tar_set_member(sb, entry, member) == 0;
+}
+
+/*
+ * Resolve a hard link to its target entry (target path is relative to the archive root).
+ */
+static int tar_resolve_hardlink(struct super_block *sb, struct tar_entry *entry)
+{
+  struct tar_entry *target = tarfs_sb(sb)->s_root_entry;
+  const char *name = entry->linkname + 1, *end;
+  struct inode *inode;
+
+  /* walk target path */
+  for (; *name && target; name = *end ? end + 1 : end) {
+    end = strchrnul(name, '/');
+    if (end - name == 2 && name[0] == '.' && name[1] == '.')
+      target = tar_get_entry(sb, target->parent);
+    else if (end > name && (end - name != 1 || *name != '.'))
+      target = S_ISDIR(target->mode) ? tar_dir_find(sb, target, name, end - name) : NULL;
+
+    if (IS_ERR(target))
+      target = NULL;
+  }
+
+  /* a link to a link shares the first target, directories can't be linked */
+  if (target)
+    target = tar_link_target(sb, target);
+  if (!target || target == entry || S_ISDIR(target->mode) || (target->flags & TAR_ENTRY_LNKTYPE))
+    return -ENOENT;
+
+  /* share target inode (symbolic links keep a single name) */
+  entry->target = target->ino;
+  entry->flags = (entry->flags & ~TAR_ENTRY_LNKTYPE) | TAR_ENTRY_HARDLINK;
+  if (S_ISLNK(target->mode))
+    return 0;
+  WRITE_ONCE(target->nlink, (target->nlink ?: 1) + 1);
+
+  /* target inode may already be cached (lazy indexing) : update its link count */
+  inode = ilookup(sb, target->ino);
+  if (inode) {
+    set_nlink(inode, READ_ONCE(target->nlink));
+    iput(inode);
   }
 
-  /* build full name */
-  full_name = tar_build_full_name(sb, &hdr, &offset);
-  if (!full_name) {
-    if (link_name)
-      kfree(link_name);
+  return 0;
+}
+
+/*
+ * Get or create a tar entry.
+ * Entries of upper layers override entries of lower layers (directories are merged).
+ */
+static struct tar_entry *tar_get_or_create_entry(struct super_block *sb, struct tar_build *build,
+                                                 struct tar_entry *parent, const char *name, size_t name_len,
+                                                 struct tar_member *member)
+{
+  struct tar_entry *entry;
+  struct tar_name *iname;
+  bool replace = false;
+  unsigned int i;
 
+  /* intern name (name of a member prepared by a parser worker is already interned) */
+  iname = member && member->iname ? member->iname : tar_intern_name(sb, name, name_len);
+  if (!iname)
     return NULL;
+
+  /* check if entry already exist */
+  i = tar_build_find(build, parent, iname);
+  entry = build->hash_table[i];
+  if (entry) {
+    if (!(entry->flags & TAR_ENTRY_HIDDEN) && tar_build_merge(sb, build, entry, member))
+      return entry;
+
+    /* replace entry (in the same hash slot) */
+    tar_build_hide(build, entry);
+    replace = true;
   }
 
-  /* parse full name */
-  for (start = full_name, parent = tarfs_sb(sb)->s_root_entry;;) {
+  /* parent must be a directory */
+  if (!S_ISDIR(parent->mode))
+    return NULL;
+
+  /* create new entry (or take the entry prepared by a parser worker) */
+  entry = member && member->entry ? member->entry
+                                  : tar_alloc_entry(sb, iname, member ? member->typeflag : TAR_DIRTYPE,
+                                                    member ? member->link : NULL);
+  if (!entry)
+    return NULL;
+
+  /* add entry to the tree */
+  entry->layer = build->layer;
+  if (tar_add_entry(sb, parent, entry))
+    return NULL;
+  if (member && tar_set_member(sb, entry, member))
+    return NULL;
+  if (member && member->sparse && tar_set_sparse(sb, entry, member->sparse))
+    return NULL;
+
+  /* add entry to build hash table */
+  build->hash_table[i] = entry;
+
+  /* lazy indexing : resolve hard link on published entries, then publish entry in its parent directory */
+  if (build->lazy && (entry->flags & TAR_ENTRY_LNKTYPE))
+    tar_resolve_hardlink(sb, entry);
+  if (build->lazy && tar_lazy_publish(sb, parent, entry))
+    return NULL;
+
+  if (replace)
+    return entry;
+
+  /* keep hash table at most half full */
+  if (++build->hash_count > (1U << build->hash_bits) / 2 && tar_build_grow(build))
+    return NULL;
+
+  return entry;
+}
+
+/*
+ * Normalize a path in place (remove leading, trailing and duplicate '/' and "." components).
+ */
+static size_t tar_normalize_path(char *path)
+{
+  char *src = path, *dst = path, *end;
+  size_t len;
+
+  while (*src) {
     /* skip '/' */
-    for (; *start == '/' && *start; start++);
+    for (; *src == '/'; src++);
+    if (!*src)
+      break;
+
+    /* find component end */
+    end = strchrnul(src, '/');
+    len = end - src;
+
+    /* copy component (skip ".") */
+    if (len != 1 || *src != '.') {
+      if (dst != path)
+        *dst++ = '/';
+      memmove(dst, src, len);
+      dst += len;
+    }
+
+    src = end;
+  }
+
+  *dst = 0;
+  return dst - path;
+}
 
-    /* find next folder in path */
-    end = strchr(start, '/');
-    if (end)
-      *end = 0;
+/*
+ * Resolve (and create if needed) the directory of a member.
+ * Tar streams are mostly grouped by directory, so the last resolved directory chain is reused.
+ */
+static struct tar_entry *tar_resolve_dir(struct super_block *sb, struct tar_build *build, const char *path, size_t len)
+{
+  struct tar_entry *parent = tarfs_sb(sb)->s_root_entry;
+  size_t start = 0, end;
+  unsigned int depth;
+  const char *sep;
+  char *chain_path;
 
-    /* create a new entry */
-    entry = tar_get_or_create_entry(sb, parent, start, end ? NULL : link_name, end ? NULL : &hdr, offset);
-    if (!end || !entry)
+  /* reuse cached chain */
+  for (depth = 0; depth < build->chain_len; depth++) {
+    end = build->chain_end[depth];
+    if (end > len || (end < len && path[end] != '/') || memcmp(path + start, build->chain_path + start, end - start))
       break;
 
-    /* go to next folder */
+    parent = build->chain[depth];
     start = end + 1;
-    parent = entry;
   }
 
-  /* free full name */
-  kfree(full_name);
-  if (link_name)
-    kfree(link_name);
+  /* resolve remaining components */
+  while (start < len) {
+    sep = memchr(path + start, '/', len - start);
+    end = sep ? sep - path : len;
 
-  return entry;
+    parent = tar_get_or_create_entry(sb, build, parent, path + start, end - start, NULL);
+    if (!parent)
+      break;
+
+    /* cache component */
+    if (depth < TARFS_CHAIN_MAX) {
+      build->chain[depth] = parent;
+      build->chain_end[depth] = end;
+      depth++;
+    }
+
+    start = end + 1;
+  }
+
+  /* save chain path */
+  build->chain_len = 0;
+  if (!parent)
+    return NULL;
+
+  if (len + 1 > build->chain_path_size) {
+    chain_path = krealloc(build->chain_path, len + 1, GFP_KERNEL);
+    if (!chain_path)
+      return parent;
+
+    build->chain_path = chain_path;
+    build->chain_path_size = len + 1;
+  }
+
+  memcpy(build->chain_path, path, len);
+  build->chain_len = depth;
+
+  return parent;
 }
 
 /*
- * Create and parse a tar archive.
+ * Read a GNU long name (long names are stored in data blocks).
  */
-int tar_create(struct super_block *sb)
+static char *tar_read_long_name(struct tar_scan *scan, off_t offset, size_t len)
 {
-  struct tarfs_sb_info *sbi = tarfs_sb(sb);
-  struct tar_entry *entry;
-  off_t offset;
-  
-  /* set start inode */
-  sbi->s_ninodes = TARFS_ROOT_INO;
+  const char *block;
+  size_t pos, count;
+  char *long_name;
 
-  /* create root entry */
-  sbi->s_root_entry = tar_get_or_create_entry(sb, NULL, "/", NULL, NULL, 0);
-  if (!sbi->s_root_entry)
-    return -ENOSPC;
+  if (!len)
+    return NULL;
 
-  /* parse each entry */
-  for (offset = 0;;) {
-    /* parse entry */
-    entry = tar_parse_entry(sb, offset);
-    if (!entry)
-      break;
+  /* allocate long name */
+  long_name = (char *) kmalloc(len + 1, GFP_KERNEL);
+  if (!long_name)
+    return NULL;
+
+  /* copy data blocks */
+  for (pos = 0; pos < len; pos += count, offset += TARFS_BLOCK_SIZE) {
+    block = tar_scan_read(scan, offset);
+    if (IS_ERR(block)) {
+      kfree(long_name);
+      return NULL;
+    }
+
+    count = min_t(size_t, len - pos, TARFS_BLOCK_SIZE);
+    memcpy(long_name + pos, block, count);
+  }
+
+  /* end long name and remove last '/' */
+  long_name[len] = 0;
+  if (long_name[len - 1] == '/')
+    long_name[len - 1] = 0;
+
+  return long_name;
+}
+
+/*
+ * Release a raw member.
+ */
+void tar_release_raw(struct tar_raw *raw)
+{
+  kfree(raw->long_name);
+  kfree(raw->long_link);
+  raw->long_name = NULL;
+  raw->long_link = NULL;
+  tar_sparse_release(raw);
+}
+
+/*
+ * Check a tar header block checksum. Bytes are summed 8 at a time (4 lanes of 16 bits), checksum
+ * field is summed as spaces. Old tars summed signed chars : both sums are accepted.
+ * Returns -ENODATA on a zero block (end of archive) and -EBADMSG on a bad checksum.
+ */
+int tar_check_header(const char *block)
+{
+  const u64 *words = (const u64 *) block;
+  const char *field = ((const struct tar_header *) block)->chksum;
+  u64 lanes = 0, high_lanes = 0, word, chksum;
+  unsigned int sum, nr_high, i;
+
+  for (i = 0; i < TARFS_BLOCK_SIZE / sizeof(u64); i++) {
+    word = words[i];
+    lanes += (word & 0x00FF00FF00FF00FFULL) + ((word >> 8) & 0x00FF00FF00FF00FFULL);
+    high_lanes += (word >> 7) & 0x0101010101010101ULL;
+  }
+
+  /* fold lanes (each 16 bits lane is at most 64 * 2 * 255) */
+  sum = (lanes & 0xFFFF) + ((lanes >> 16) & 0xFFFF) + ((lanes >> 32) & 0xFFFF) + (lanes >> 48);
+  high_lanes = (high_lanes & 0x00FF00FF00FF00FFULL) + ((high_lanes >> 8) & 0x00FF00FF00FF00FFULL);
+  nr_high = (high_lanes * 0x0001000100010001ULL) >> 48;
 
-    /* update offset */
-    offset = TARFS_ALIGN_UP(entry->data_off + entry->data_len);
+  /* zero block */
+  if (!sum)
+    return -ENODATA;
+
+  /* checksum field is summed as spaces */
+  for (i = 0; i < 8; i++) {
+    sum += ' ' - (u8) field[i];
+    nr_high -= (u8) field[i] >> 7;
   }
 
+  if (tar_parse_octal(field, sizeof_field(struct tar_header, chksum), &chksum))
+    return -EBADMSG;
+  if (chksum != sum && chksum != sum - 256 * nr_high)
+    return -EBADMSG;
+
   return 0;
 }
 
 /*
- * Free a tar entry and its children.
+ * Check if the checksum of a header block can be verified later by a parser worker : the sequential pass only needs
+ * the data length of members without extension headers or sparse map to parse.
  */
-void tar_free(struct tar_entry *entry)
+static bool tar_defer_checksum(struct tar_scan *scan, struct tar_raw *raw, const char *block)
 {
-  struct list_head *pos, *n;
-  
-  /* free name */
-  if (entry->name)
-    kfree(entry->name);
-  
-  /* free children */
-  list_for_each_safe(pos, n, &entry->children)
-    tar_free(list_entry(pos, struct tar_entry, list));
+  char typeflag = ((const struct tar_header *) block)->typeflag;
+
+  return scan->defer_checksum && !raw->sparse && typeflag != TAR_XHDTYPE && typeflag != TAR_XGLTYPE
+         && typeflag != TAR_LONGNAME && typeflag != TAR_LONGLINK && typeflag != TAR_GNUTYPE_SPARSE;
 }
 
 /*
- * Index a tar entry by its inode number.
+ * Validate a tar header block (GNU, POSIX ustar or v7) and get member data length.
  */
-void tar_index(struct super_block *sb, struct tar_entry *entry)
+static int tar_validate_header(struct super_block *sb, loff_t size, const char *block, off_t offset, bool defer,
+                               size_t *data_len)
 {
-  struct list_head *pos;
-  
-  if (!entry)
-    return;
-  
-  /* index entry */
-  tarfs_sb(sb)->s_tar_entries[entry->ino] = entry;
-  
-  /* index children */
-  list_for_each(pos, &entry->children)
-    tar_index(sb, list_entry(pos, struct tar_entry, list));
+  const struct tar_header *hdr = (const struct tar_header *) block;
+  bool checksum = tarfs_sb(sb)->s_checksum;
+  int format, err;
+  u64 len;
+
+  /* verify checksum (zero block = end of archive), v7 headers have no magic : they are always checked */
+  format = tar_header_format(hdr);
+  if ((checksum && !defer) || format == TAR_FORMAT_V7) {
+    err = tar_check_header(block);
+    if (err)
+      return checksum ? err : -ENODATA;
+  }
+
+  /* check magic string */
+  if (format < 0)
+    return checksum ? -EBADMSG : -ENODATA;
+
+  /* get data length (member must fit in archive) */
+  if (tar_parse_octal(hdr->size, sizeof(hdr->size), &len) || len > size - offset - TARFS_BLOCK_SIZE)
+    return -EBADMSG;
+
+  *data_len = len;
+  return 0;
+}
+
+/*
+ * Parse pax records of a member header : path and linkpath replace the header names (GNU.sparse.name wins over path),
+ * GNU.sparse.* records describe a sparse member, other records are ignored.
+ */
+static int tar_parse_pax(struct tar_raw *raw, const char *records, size_t len)
+{
+  size_t prefix_len = strlen(TAR_PAX_SPARSE_PREFIX), key_len, val_len;
+  const char *p, *end = records + len, *rec_end, *key, *val;
+  bool sparse_name = false;
+  u64 rec_len, offset = 0;
+  char **name;
+  int err;
+
+  /* records are "<length> <key>=<value>\n" */
+  for (p = records; p < end && *p; p = rec_end) {
+    for (rec_len = 0, key = p; key < end && *key >= '0' && *key <= '9' && rec_len <= len; key++)
+      rec_len = rec_len * 10 + *key - '0';
+    if (key == p || key == end || *key != ' ' || rec_len > end - p || rec_len <= key + 1 - p)
+      return -EINVAL;
+
+    rec_end = p + rec_len;
+    key++;
+    val = memchr(key, '=', rec_end - key);
+    if (!val || rec_end[-1] != '\n')
+      return -EINVAL;
+    key_len = val - key;
+    val++;
+    val_len = rec_end - 1 - val;
+
+    /* sparse record */
+    if (key_len > prefix_len && !memcmp(key, TAR_PAX_SPARSE_PREFIX, prefix_len)) {
+      key += prefix_len;
+      key_len -= prefix_len;
+      sparse_name |= key_len == strlen("name") && !memcmp(key, "name", key_len);
+      err = tar_sparse_parse_pax(raw, key, key_len, val, val_len, &offset);
+      if (err)
+        return err;
+      continue;
+    }
+
+    /* path or link path (same as GNU long names) */
+    if (key_len == strlen("path") && !memcmp(key, "path", key_len))
+      name = sparse_name ? NULL : &raw->long_name;
+    else if (key_len == strlen("linkpath") && !memcmp(key, "linkpath", key_len))
+      name = &raw->long_link;
+    else
+      continue;
+
+    if (name) {
+      kfree(*name);
+      *name = kstrndup(val, val_len, GFP_KERNEL);
+      if (!*name)
+        return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Locate next member (sequential pass : header is copied, pax headers are skipped, GNU long names are read,
+ * member data is skipped). On success, offset is updated to point to the next header. With deferred checksums, a bad
+ * header returns -EAGAIN (offset points to the member first header).
+ */
+static int tar_locate_member(struct tar_scan *scan, off_t *offset, struct tar_raw *raw)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(scan->sb);
+  struct tar_header *hdr = &raw->hdr;
+  char **long_name, *records;
+  const char *block;
+  size_t data_len;
+  bool defer;
+  int err;
+
+  raw->long_name = NULL;
+  raw->long_link = NULL;
+  raw->sparse = NULL;
+  raw->sparse_in_data = false;
+  raw->hdr_off = *offset;
+
+  for (;;) {
+    /* read header block */
+    block = tar_scan_read(scan, *offset);
+    if (IS_ERR(block))
+      goto err;
+
+    /* validate header : bad headers stop the scan or are skipped (badhdr= mount option) */
+    defer = tar_defer_checksum(scan, raw, block);
+    err = tar_validate_header(scan->sb, scan->size, block, *offset, defer, &data_len);
+    if (err == -EBADMSG && scan->defer_checksum) {
+      /* parallel pass (a previous deferred header may be bad) : member is located again with its checksum */
+      *offset = raw->hdr_off;
+      tar_release_raw(raw);
+      return -EAGAIN;
+    }
+    if (err == -EBADMSG) {
+      sbi->s_bad_headers++;
+      printk_ratelimited("TARFS : bad header at offset %lld%s\n", (long long) *offset,
+                         sbi->s_badhdr_skip ? ", skipped" : ", end of scan");
+      if (sbi->s_badhdr_skip) {
+        *offset += TARFS_BLOCK_SIZE;
+        raw->hdr_off = *offset;
+        continue;
+      }
+    }
+    if (err)
+      goto err;
+
+    /* get tar header */
+    memcpy(raw->block, block, TARFS_BLOCK_SIZE);
+    raw->check_header = defer;
+
+    /* pax headers (global headers are ignored) */
+    if (hdr->typeflag == TAR_XHDTYPE || hdr->typeflag == TAR_XGLTYPE) {
+      if (hdr->typeflag == TAR_XHDTYPE && data_len) {
+        records = tar_read_long_name(scan, *offset + TARFS_BLOCK_SIZE, data_len);
+        err = records ? tar_parse_pax(raw, records, data_len) : -ENOMEM;
+        kfree(records);
+        if (err)
+          goto err;
+      }
+
+      *offset = TARFS_ALIGN_UP(*offset + TARFS_BLOCK_SIZE + data_len);
+      continue;
+    }
+
+    /* GNU long name or long link name : read it and go to real tar header */
+    if (hdr->typeflag == TAR_LONGNAME || hdr->typeflag == TAR_LONGLINK) {
+      long_name = hdr->typeflag == TAR_LONGNAME ? &raw->long_name : &raw->long_link;
+      kfree(*long_name);
+      *long_name = tar_read_long_name(scan, *offset + TARFS_BLOCK_SIZE, data_len);
+      if (!*long_name)
+        goto err;
+
+      *offset = TARFS_ALIGN_UP(*offset + TARFS_BLOCK_SIZE + data_len);
+      continue;
+    }
+
+    /* real header : read sparse extension blocks or sparse map */
+    raw->offset = *offset;
+    raw->data_off = *offset + TARFS_BLOCK_SIZE;
+    err = 0;
+    if (hdr->typeflag == TAR_GNUTYPE_SPARSE)
+      err = tar_sparse_parse_gnu(scan, raw);
+    else if (raw->sparse && raw->sparse_in_data)
+      err = tar_sparse_read_map(scan, raw, &data_len);
+    if (!err && raw->sparse)
+      err = tar_sparse_check(raw->sparse, data_len);
+    if (err)
+      goto err;
+
+    /* skip member data */
+    *offset = TARFS_ALIGN_UP(raw->data_off + data_len);
+    return 0;
+  }
+
+err:
+  tar_release_raw(raw);
+  return -EINVAL;
+}
+
+/*
+ * Decode a raw member (no super block state : can run on any CPU). Full name is normalized.
+ */
+static int tar_decode_member(struct tar_raw *raw, struct tar_member *member)
+{
+  struct tar_header *hdr = &raw->hdr;
+  size_t prefix_len, name_len, link_len;
+  int format, err;
+  char *path;
+
+  member->iname = NULL;
+  member->entry = NULL;
+
+  /* build full name (concat prefix and name : GNU sparse fields overlap prefix, ustar prefix spans extra times, v7
+     headers have no prefix) */
+  format = tar_header_format(hdr);
+  name_len = strnlen(hdr->name, sizeof(hdr->name));
+  if (raw->long_name) {
+    path = raw->long_name;
+  } else {
+    prefix_len = 0;
+    if (format == TAR_FORMAT_USTAR)
+      prefix_len = strnlen(hdr->ustar_prefix, sizeof(hdr->ustar_prefix));
+    else if (format == TAR_FORMAT_GNU && hdr->typeflag != TAR_GNUTYPE_SPARSE)
+      prefix_len = strnlen(hdr->prefix, sizeof(hdr->prefix));
+    if (!prefix_len && !name_len)
+      return -EINVAL;
+
+    path = member->path_buf;
+    memcpy(path, hdr->ustar_prefix, prefix_len);
+    path[prefix_len] = '/';
+    memcpy(path + prefix_len + 1, hdr->name, name_len);
+    path[prefix_len + 1 + name_len] = 0;
+  }
+
+  /* v7 directories are regular members with a trailing slash */
+  if (format == TAR_FORMAT_V7 && (hdr->typeflag == TAR_REGTYPE || hdr->typeflag == TAR_AREGTYPE)
+      && name_len && hdr->name[name_len - 1] == '/')
+    hdr->typeflag = TAR_DIRTYPE;
+
+  member->path = path;
+  member->path_len = tar_normalize_path(path);
+
+  /* build link name */
+  member->link = NULL;
+  if (hdr->typeflag == TAR_LNKTYPE || hdr->typeflag == TAR_SYMTYPE) {
+    if (raw->long_link) {
+      member->link = raw->long_link;
+    } else {
+      link_len = strnlen(hdr->linkname, sizeof(hdr->linkname));
+      if (!link_len)
+        return -EINVAL;
+
+      memcpy(member->link_buf, hdr->linkname, link_len);
+      member->link_buf[link_len] = 0;
+      member->link = member->link_buf;
+    }
+  }
+
+  err = tar_decode_header(member, hdr, raw->data_off);
+  if (err)
+    return err;
+  member->hdr_off = raw->hdr_off;
+
+  /* sparse member : real size (GNU sparse fields overlap extra times) */
+  member->sparse = NULL;
+  if (raw->sparse && S_ISREG(member->mode)) {
+    member->sparse = raw->sparse;
+    member->data_len = raw->sparse->size;
+    if (hdr->typeflag == TAR_GNUTYPE_SPARSE)
+      member->atime = member->ctime = member->mtime;
+  }
+
+  return 0;
+}
+
+/*
+ * Read and decode the member at a header offset (raw member must be released once member is used).
+ */
+int tar_read_member(struct tar_scan *scan, off_t offset, struct tar_raw *raw, struct tar_member *member)
+{
+  int err;
+
+  err = tar_locate_member(scan, &offset, raw);
+  if (err)
+    return err;
+
+  err = tar_decode_member(raw, member);
+  if (err)
+    tar_release_raw(raw);
+
+  return err;
+}
+
+/*
+ * Apply an OCI whiteout of an upper layer (".wh.<name>" removes a lower entry, ".wh..wh..opq" hides all lower
+ * children of its directory). Returns the directory.
+ */
+static struct tar_entry *tar_whiteout(struct super_block *sb, struct tar_build *build, struct tar_entry *parent,
+                                      const char *name, size_t name_len)
+{
+  size_t prefix_len = strlen(TAR_WHITEOUT_PREFIX);
+  struct tar_entry *entry;
+  struct tar_name *iname;
+
+  /* opaque directory */
+  if (name_len == strlen(TAR_WHITEOUT_OPAQUE) && !memcmp(name, TAR_WHITEOUT_OPAQUE, name_len)) {
+    parent->opaque = build->layer;
+    parent->layer = build->layer;
+    return parent;
+  }
+
+  /* remove lower entry */
+  iname = tar_intern_name(sb, name + prefix_len, name_len - prefix_len);
+  if (!iname)
+    return NULL;
+
+  entry = build->hash_table[tar_build_find(build, parent, iname)];
+  if (entry && entry->layer < build->layer)
+    tar_build_hide(build, entry);
+
+  return parent;
+}
+
+/*
+ * Add a decoded member to the tree (members must be added in archive order).
+ */
+static int tar_add_member(struct super_block *sb, struct tar_build *build, struct tar_member *member)
+{
+  struct tar_entry *entry, *parent;
+  const char *path = member->path, *sep;
+  size_t len = member->path_len;
+
+  /* resolve parent directory and create entry (an empty path is the root itself) */
+  entry = tarfs_sb(sb)->s_root_entry;
+  if (len) {
+    sep = strrchr(path, '/');
+    parent = sep ? tar_resolve_dir(sb, build, path, sep - path) : tarfs_sb(sb)->s_root_entry;
+    sep = sep ? sep + 1 : path;
+    if (parent && build->layer && !strncmp(sep, TAR_WHITEOUT_PREFIX, strlen(TAR_WHITEOUT_PREFIX)))
+      entry = tar_whiteout(sb, build, parent, sep, path + len - sep);
+    else
+      entry = parent ? tar_get_or_create_entry(sb, build, parent, sep, path + len - sep, member) : NULL;
+  }
+
+  if (!entry)
+    return -EINVAL;
+
+  /* lazy indexing : complete directories left by the scan */
+  if (build->lazy && tar_lazy_track(sb, build, entry))
+    return -ENOMEM;
+
+  return 0;
+}
+
+/*
+ * Allocate a build context (and create root entry).
+ */
+struct tar_build *tar_build_alloc(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_build *build;
+  struct tar_name *name;
+
+  /* set start inode */
+  sbi->s_ninodes = TARFS_ROOT_INO;
+
+  /* create root entry */
+  name = tar_intern_name(sb, "/", 1);
+  sbi->s_root_entry = name ? tar_alloc_entry(sb, name, TAR_DIRTYPE, NULL) : NULL;
+  if (!sbi->s_root_entry || tar_add_entry(sb, NULL, sbi->s_root_entry))
+    return ERR_PTR(-ENOSPC);
+
+  /* allocate build context */
+  build = (struct tar_build *) kzalloc(sizeof(struct tar_build), GFP_KERNEL);
+  if (!build)
+    return ERR_PTR(-ENOMEM);
+
+  /* allocate build hash table */
+  build->hash_bits = TARFS_BUILD_HASH_BITS;
+  build->hash_table = kvcalloc(1 << build->hash_bits, sizeof(struct tar_entry *), GFP_KERNEL);
+  if (!build->hash_table) {
+    kfree(build);
+    return ERR_PTR(-ENOMEM);
+  }
+
+  return build;
+}
+
+/*
+ * Release a build context.
+ */
+void tar_build_free(struct tar_build *build)
+{
+  kvfree(build->hash_table);
+  kfree(build->chain_path);
+  kfree(build->open_dirs);
+  kfree(build->path);
+  kfree(build);
+}
+
+/*
+ * Locate, decode and add next member to the tree (sequential parser). Returns false at end of archive or on error.
+ */
+static bool tar_build_next(struct super_block *sb, struct tar_build *build, off_t *offset, int *err)
+{
+  if (tar_locate_member(&build->scan, offset, &build->raw))
+    return false;
+
+  *err = tar_decode_member(&build->raw, &build->member) ?: tar_add_member(sb, build, &build->member);
+  tar_release_raw(&build->raw);
+  return !*err;
+}
+
+/*
+ * Prepare the entry of a decoded member (worker) : its name is interned and its entry allocated in the batch arena,
+ * so merging it only links the entry in the tree. The root and whiteouts are left to the merge (as are members
+ * that can't be prepared).
+ */
+static void tar_prepare_member(struct tar_batch *batch, struct tar_member *member)
+{
+  struct tar_build *build = batch->build;
+  const char *name = strrchr(member->path, '/');
+  size_t name_len;
+
+  if (!member->path_len)
+    return;
+
+  name = name ? name + 1 : member->path;
+  name_len = member->path + member->path_len - name;
+  if (build->layer && !strncmp(name, TAR_WHITEOUT_PREFIX, strlen(TAR_WHITEOUT_PREFIX)))
+    return;
+
+  member->iname = tar_names_intern(&tarfs_sb(build->scan.sb)->s_names, &batch->arena, name, name_len);
+  if (member->iname)
+    member->entry = tar_new_entry(&batch->arena, member->iname, member->typeflag, member->link);
+}
+
+/*
+ * Decode a parser batch (worker) : verify deferred header checksums, decode members and prepare their entries.
+ */
+static void tar_batch_work_fn(struct work_struct *work)
+{
+  struct tar_batch *batch = container_of(work, struct tar_batch, work);
+  struct tar_member *member;
+  u32 i;
+
+  for (i = 0; i < batch->nr; i++) {
+    member = &batch->members[i];
+    member->err = -EBADMSG;
+    if (batch->raws[i].check_header && tar_check_header(batch->raws[i].block))
+      continue;
+
+    member->err = tar_decode_member(&batch->raws[i], member);
+    if (!member->err)
+      tar_prepare_member(batch, member);
+  }
+
+  complete(&batch->done);
+}
+
+/*
+ * Merge a decoded parser batch in the tree (stop at first bad member, as the sequential parser does). On a member
+ * header with a bad deferred checksum, restart is set to the member first header offset and next members are dropped
+ * (the sequential parser locates it again).
+ */
+static int tar_batch_merge(struct super_block *sb, struct tar_build *build, struct tar_batch *batch, int err,
+                           off_t *restart)
+{
+  struct tar_member *member;
+  u32 i;
+
+  wait_for_completion(&batch->done);
+
+  for (i = 0; i < batch->nr; i++) {
+    member = &batch->members[i];
+    if (!err && *restart < 0 && member->err == -EBADMSG)
+      *restart = batch->raws[i].hdr_off;
+    if (!err && *restart < 0)
+      err = member->err ?: tar_add_member(sb, build, member);
+    tar_release_raw(&batch->raws[i]);
+  }
+
+  batch->nr = 0;
+  return err;
+}
+
+/*
+ * Parse a layer archive on all CPUs : members are located by a sequential pass (data is skipped, member header
+ * checksums are deferred), batches of members are decoded by workers, which also intern names and allocate entries,
+ * and entries are linked in the tree in archive order (inode numbers are deterministic).
+ */
+static int tar_build_layer_parallel(struct super_block *sb, struct tar_build *build)
+{
+  u32 nr_batches, head = 0, count = 0, i;
+  struct tar_batch **batches, *batch;
+  off_t offset = 0, restart = -1, stall = -1;
+  bool end = false;
+  int err = 0, ret;
+
+  /* allocate batches (enough to keep all workers busy while merging) */
+  nr_batches = min_t(u32, build->nr_threads * 2, TARFS_PARSE_BATCHES_MAX);
+  batches = kcalloc(nr_batches, sizeof(struct tar_batch *), GFP_KERNEL);
+  if (!batches)
+    return -ENOMEM;
+  for (i = 0; i < nr_batches; i++) {
+    batches[i] = kvmalloc(sizeof(struct tar_batch), GFP_KERNEL);
+    if (!batches[i]) {
+      err = -ENOMEM;
+      goto out;
+    }
+
+    INIT_WORK(&batches[i]->work, tar_batch_work_fn);
+    init_completion(&batches[i]->done);
+    batches[i]->build = build;
+    tar_arena_init_chunk(&batches[i]->arena, TARFS_PARSE_ARENA_CHUNK_SIZE);
+    batches[i]->nr = 0;
+  }
+
+  build->scan.defer_checksum = tarfs_sb(sb)->s_checksum;
+  while (!end || count || restart >= 0) {
+    /* all batches in flight, end of archive or bad member header : merge (or drop) oldest one */
+    if (count && (count == nr_batches || end || restart >= 0)) {
+      err = tar_batch_merge(sb, build, batches[head], err, &restart);
+      head = (head + 1) % nr_batches;
+      count--;
+      continue;
+    }
+
+    /* bad header met by the locate pass : locate it again once previous members are merged (unless a previous
+       member header was bad) */
+    if (stall >= 0) {
+      if (restart < 0 && !err)
+        restart = stall;
+      stall = -1;
+    }
+
+    /* bad member header : locate it again with its checksum (bad header is counted, then stops the scan or is
+       skipped), then resume */
+    if (restart >= 0) {
+      offset = restart;
+      restart = -1;
+      build->scan.defer_checksum = false;
+      end = !tar_build_next(sb, build, &offset, &err);
+      build->scan.defer_checksum = true;
+      continue;
+    }
+
+    /* locate next members (stop locating after a merge error) */
+    batch = batches[(head + count) % nr_batches];
+    while (!err && batch->nr < TARFS_PARSE_BATCH) {
+      ret = tar_locate_member(&build->scan, &offset, &batch->raws[batch->nr]);
+      if (ret) {
+        if (ret == -EAGAIN)
+          stall = offset;
+        end = true;
+        break;
+      }
+
+      batch->nr++;
+    }
+    if (err)
+      end = true;
+
+    /* decode batch */
+    reinit_completion(&batch->done);
+    queue_work(build->wq, &batch->work);
+    count++;
+  }
+
+out:
+  /* prepared names and entries are released with the super block arena */
+  for (i = 0; i < nr_batches && batches[i]; i++) {
+    tar_arena_merge(&tarfs_sb(sb)->s_arena, &batches[i]->arena);
+    kvfree(batches[i]);
+  }
+  kfree(batches);
+  return err == -ENOMEM ? err : 0;
+}
+
+/*
+ * Parse a layer archive (stop at end of archive, or when the lazy scan thread is stopped).
+ */
+int tar_build_layer(struct super_block *sb, struct tar_build *build, u8 layer)
+{
+  off_t offset;
+  int err;
+
+  /* init scanner */
+  err = tar_scan_init(&build->scan, sb, layer);
+  if (err)
+    return err;
+
+  build->layer = layer;
+  build->chain_len = 0;
+
+  /* parse members on all CPUs */
+  if (build->wq) {
+    err = tar_build_layer_parallel(sb, build);
+    goto out;
+  }
+
+  /* or parse each member */
+  for (offset = 0;;) {
+    if (build->lazy && kthread_should_stop())
+      break;
+    if (!tar_build_next(sb, build, &offset, &err))
+      break;
+  }
+
+  err = err == -ENOMEM ? err : 0;
+out:
+  /* release scanner */
+  tar_scan_exit(&build->scan);
+  return err;
+}
+
+/*
+ * Create and parse a tar archive.
+ */
+int tar_create(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_build *build;
+  int err = 0;
+  u8 layer;
+
+  build = tar_build_alloc(sb);
+  if (IS_ERR(build))
+    return PTR_ERR(build);
+
+  /* decode members on all CPUs */
+  build->nr_threads = sbi->s_parse_threads ?: num_online_cpus();
+  if (build->nr_threads > 1) {
+    build->wq = alloc_workqueue("tarfs-parse", WQ_UNBOUND, build->nr_threads);
+    if (!build->wq)
+      printk("TARFS : can't create parser workqueue, parsing on a single CPU\n");
+  }
+
+  /* parse each layer, from lowest to uppest */
+  for (layer = 0; layer < sbi->s_nr_layers && !err; layer++)
+    err = tar_build_layer(sb, build, layer);
+
+  if (build->wq)
+    destroy_workqueue(build->wq);
+  tar_build_free(build);
+
+  if (sbi->s_bad_headers)
+    printk("TARFS : %llu bad headers %s\n", sbi->s_bad_headers, sbi->s_badhdr_skip ? "skipped" : "found");
+
+  return err;
+}
+
+/*
+ * Check if an archive is page aligned (built by tarfs-pack) : the first member is a pax global header holding
+ * an alignment marker, and data of each regular member starts on a page boundary.
+ */
+bool tar_check_aligned(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  char *block, *marker, *end;
+  struct tar_header *hdr;
+  struct tar_entry *entry;
+  unsigned int align;
+  size_t data_len;
+  bool ret = false;
+  u32 ino;
+
+  block = kmalloc(2 * TARFS_BLOCK_SIZE, GFP_KERNEL);
+  if (!block)
+    return false;
+
+  /* read first header and its data (marker header is always checksummed) */
+  hdr = (struct tar_header *) block;
+  if (tar_archive_read(sb, block, 2 * TARFS_BLOCK_SIZE, 0) || tar_check_header(block)
+      || tar_validate_header(sb, tar_archive_size(sb), block, 0, false, &data_len)
+      || memcmp(hdr->magic, TARFS_MAGIC_STR, sizeof(hdr->magic)) || hdr->typeflag != TAR_XGLTYPE
+      || !data_len || data_len >= TARFS_BLOCK_SIZE)
+    goto out;
+
+  /* find marker */
+  block[TARFS_BLOCK_SIZE + data_len] = 0;
+  marker = strstr(block + TARFS_BLOCK_SIZE, " " TARFS_ALIGNED_MARKER);
+  if (!marker)
+    goto out;
+  marker += strlen(" " TARFS_ALIGNED_MARKER);
+  end = strchr(marker, '\n');
+  if (!end)
+    goto out;
+  *end = 0;
+  if (kstrtouint(marker, 10, &align) != 0 || !align || align % PAGE_SIZE)
+    goto out;
+
+  /* check members */
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes; ino++) {
+    entry = tar_get_entry(sb, ino);
+    if (S_ISREG(entry->mode) && entry->data_len && !PAGE_ALIGNED(entry->data_off)) {
+      printk("TARFS : archive marked as aligned has unaligned members\n");
+      goto out;
+    }
+  }
+
+  ret = true;
+out:
+  kfree(block);
+  return ret;
+}
+
+/*
+ * Hash a directory children (children are reordered by bucket).
+ */
+int tar_hash_dir(struct super_block *sb, struct tar_dir *dir)
+{
+  u32 nr_buckets, i, b, *pos;
+  struct tar_dirent *tmp;
+
+  /* allocate buckets (at least one bucket per child) */
+  dir->hash_bits = order_base_2(dir->nr_children);
+  nr_buckets = 1 << dir->hash_bits;
+  dir->buckets = (u32 *) tar_arena_alloc(&tarfs_sb(sb)->s_arena, sizeof(u32) * (nr_buckets + 1));
+  if (!dir->buckets)
+    return -ENOMEM;
+
+  /* allocate temporary children */
+  tmp = kvmalloc_array(dir->nr_children, sizeof(struct tar_dirent), GFP_KERNEL);
+  if (!tmp)
+    return -ENOMEM;
+  memcpy(tmp, dir->children, sizeof(struct tar_dirent) * dir->nr_children);
+
+  /* count children per bucket */
+  memset(dir->buckets, 0, sizeof(u32) * (nr_buckets + 1));
+  for (i = 0; i < dir->nr_children; i++)
+    dir->buckets[hash_32(tmp[i].hash, dir->hash_bits) + 1]++;
+
+  /* compute buckets start */
+  for (b = 0; b < nr_buckets; b++)
+    dir->buckets[b + 1] += dir->buckets[b];
+
+  /* place children (use bucket start as insert position, then restore it) */
+  for (i = 0; i < dir->nr_children; i++) {
+    pos = &dir->buckets[hash_32(tmp[i].hash, dir->hash_bits)];
+    dir->children[(*pos)++] = tmp[i];
+  }
+  for (b = nr_buckets; b > 0; b--)
+    dir->buckets[b] = dir->buckets[b - 1];
+  dir->buckets[0] = 0;
+
+  kvfree(tmp);
+  return 0;
+}
+
+/*
+ * Hide entries of layered archives : children of hidden directories, and children from layers below an opaque
+ * directory (parents always have a lower inode number than their children).
+ */
+static int tar_hide_layers(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_entry *entry, *parent;
+  u8 *floors;
+  u32 ino;
+
+  /* lowest visible layer below each directory */
+  floors = kvcalloc(sbi->s_ninodes, sizeof(u8), GFP_KERNEL);
+  if (!floors)
+    return -ENOMEM;
+
+  floors[TARFS_ROOT_INO] = sbi->s_root_entry->opaque;
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes; ino++) {
+    entry = tar_get_entry(sb, ino);
+    parent = tar_get_entry(sb, entry->parent);
+    if ((parent->flags & TAR_ENTRY_HIDDEN) || entry->layer < floors[entry->parent])
+      entry->flags |= TAR_ENTRY_HIDDEN;
+
+    floors[ino] = max(floors[entry->parent], entry->opaque);
+  }
+
+  kvfree(floors);
+  return 0;
+}
+
+/*
+ * Index tar entries : store children of each directory contiguously (and hash large directories).
+ */
+int tar_index(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct tar_entry *entry, *parent;
+  u32 *counts, ino, nr_unresolved = 0;
+  struct tar_dir *dir;
+  int err = 0;
+
+  /* hide removed subtrees of layered archives */
+  if (sbi->s_nr_layers > 1) {
+    err = tar_hide_layers(sb);
+    if (err)
+      return err;
+  }
+
+  /* count children of each directory */
+  counts = kvcalloc(sbi->s_ninodes, sizeof(u32), GFP_KERNEL);
+  if (!counts)
+    return -ENOMEM;
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes; ino++)
+    if (!(tar_get_entry(sb, ino)->flags & TAR_ENTRY_HIDDEN))
+      counts[tar_get_entry(sb, ino)->parent]++;
+
+  /* allocate directories */
+  for (ino = TARFS_ROOT_INO; ino < sbi->s_ninodes; ino++) {
+    entry = tar_get_entry(sb, ino);
+    if (!S_ISDIR(entry->mode) || !counts[ino])
+      continue;
+
+    dir = (struct tar_dir *) tar_arena_alloc(&sbi->s_arena, struct_size(dir, children, counts[ino]));
+    if (!dir) {
+      err = -ENOMEM;
+      goto out;
+    }
+
+    dir->nr_children = 0;
+    dir->max_children = counts[ino];
+    dir->hash_bits = 0;
+    dir->buckets = NULL;
+    entry->dir = dir;
+  }
+
+  /* add children in archive order */
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes; ino++) {
+    entry = tar_get_entry(sb, ino);
+    if (entry->flags & TAR_ENTRY_HIDDEN)
+      continue;
+
+    parent = tar_get_entry(sb, entry->parent);
+    dir = parent->dir;
+    dir->children[dir->nr_children].hash = tar_entry_name(entry)->hash;
+    dir->children[dir->nr_children].ino = ino;
+    dir->nr_children++;
+  }
+
+  /* hash large directories (small ones are scanned) */
+  for (ino = TARFS_ROOT_INO; ino < sbi->s_ninodes; ino++) {
+    entry = tar_get_entry(sb, ino);
+    if (S_ISDIR(entry->mode) && entry->dir && entry->dir->nr_children >= TARFS_DIR_HASH_MIN) {
+      err = tar_hash_dir(sb, entry->dir);
+      if (err)
+        goto out;
+    }
+  }
+
+  /* resolve hard links (unresolved ones stay symbolic links to their target path) */
+  for (ino = TARFS_ROOT_INO + 1; ino < sbi->s_ninodes; ino++) {
+    entry = tar_get_entry(sb, ino);
+    if ((entry->flags & TAR_ENTRY_LNKTYPE) && !(entry->flags & TAR_ENTRY_HIDDEN) && tar_resolve_hardlink(sb, entry))
+      nr_unresolved++;
+  }
+  if (nr_unresolved)
+    printk("TARFS : %u hard links can't be resolved, kept as symbolic links\n", nr_unresolved);
+
+out:
+  kvfree(counts);
+  return err;
+}
+
+/*
+ * Find a child in a directory (evicted children are loaded : ERR_PTR on load error).
+ */
+struct tar_entry *tar_dir_find(struct super_block *sb, struct tar_entry *dir_entry, const char *name, unsigned int len)
+{
+  unsigned int hash = tar_name_hash(name, len);
+  struct tar_entry *child;
+  struct tar_dir *dir;
+  u32 i, end;
+
+  /* empty directory (directories are published while indexing lazily) */
+  dir = smp_load_acquire(&dir_entry->dir);
+  if (!dir)
+    return NULL;
+
+  /* large directory : lookup in hash bucket only */
+  i = 0;
+  end = smp_load_acquire(&dir->nr_children);
+  if (dir->buckets) {
+    i = dir->buckets[hash_32(hash, dir->hash_bits)];
+    end = dir->buckets[hash_32(hash, dir->hash_bits) + 1];
+  }
+
+  /* compare hash, then length and name */
+  for (; i < end; i++) {
+    if (dir->children[i].hash != hash)
+      continue;
+
+    child = tar_get_entry(sb, dir->children[i].ino);
+    if (!child)
+      return ERR_PTR(-EIO);
+
+    if (child->name_len == len && memcmp(child->name, name, len) == 0) {
+      tar_meta_touch(sb, child->ino);
+      return child;
+    }
+  }
+
+  return NULL;
 }
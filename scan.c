@@ -0,0 +1,359 @@
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/gfp.h>
+#include <linux/fadvise.h>
+#include <linux/uio.h>
+
+#include "tarfs.h"
+
+/*
+ * Get archive size.
+ */
+loff_t tar_archive_size(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+
+  if (sbi->s_compress)
+    return sbi->s_compress->size;
+
+  if (sbi->s_backing_file)
+    return i_size_read(file_inode(sbi->s_backing_file));
+
+  return bdev_nr_bytes(sb->s_bdev);
+}
+
+/*
+ * Read archive data (synchronously).
+ */
+int tar_archive_read(struct super_block *sb, void *buf, size_t len, loff_t off)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  struct file *file = sbi->s_backing_file ?: sbi->s_bdev_file;
+  struct tar_scan scan;
+  const char *data;
+  size_t count;
+  ssize_t ret;
+  int err;
+
+  /* compressed archive : decompress frames covering the range */
+  if (sbi->s_compress)
+    return tar_compress_read(sb, buf, len, off);
+
+  /* file backed archive or block device : read through archive file or block device page cache */
+  if (file) {
+    ret = kernel_read(file, buf, len, &off);
+    if (ret < 0)
+      return ret;
+
+    return ret == len ? 0 : -EIO;
+  }
+
+  /* block device file can't be opened : read by a scanner (no buffer heads are left in block device cache) */
+  err = tar_scan_init_window(&scan, sb, 0, PAGE_SIZE);
+  if (err)
+    return err;
+
+  for (; len; buf += count, off += count, len -= count) {
+    count = len;
+    data = tar_scan_read_range(&scan, off, &count);
+    if (IS_ERR(data)) {
+      err = PTR_ERR(data);
+      break;
+    }
+
+    memcpy(buf, data, count);
+  }
+
+  tar_scan_exit(&scan);
+  return err;
+}
+
+/*
+ * Get a layer archive size (layer 0 = mount source).
+ */
+loff_t tar_layer_size(struct super_block *sb, u8 layer)
+{
+  if (!layer)
+    return tar_archive_size(sb);
+
+  return i_size_read(file_inode(tarfs_sb(sb)->s_layers[layer]));
+}
+
+/*
+ * Read a layer archive data (synchronously).
+ */
+int tar_layer_read(struct super_block *sb, u8 layer, void *buf, size_t len, loff_t off)
+{
+  ssize_t ret;
+
+  if (!layer)
+    return tar_archive_read(sb, buf, len, off);
+
+  /* upper layers are plain archive files */
+  ret = kernel_read(tarfs_sb(sb)->s_layers[layer], buf, len, &off);
+  if (ret < 0)
+    return ret;
+
+  return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Read a layer archive data to an iterator (synchronously). Archive files and the block device are read through
+ * their page cache (with readahead), compressed archives are decompressed through a bounce buffer.
+ */
+int tar_layer_read_iter(struct super_block *sb, u8 layer, struct iov_iter *iter, size_t len, loff_t off)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  size_t left = iov_iter_count(iter) - len, count;
+  struct file *file;
+  ssize_t ret;
+  void *buf;
+  int err = 0;
+
+  /* read source file */
+  if (layer)
+    file = sbi->s_layers[layer];
+  else
+    file = sbi->s_compress ? NULL : sbi->s_backing_file ?: sbi->s_bdev_file;
+  if (file) {
+    iov_iter_truncate(iter, len);
+    ret = vfs_iter_read(file, iter, &off, 0);
+    iov_iter_reexpand(iter, iov_iter_count(iter) + left);
+    if (ret < 0)
+      return ret;
+
+    return ret == len ? 0 : -EIO;
+  }
+
+  /* or copy archive data (compressed archive or no block device file) */
+  buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  for (; len && !err; len -= count, off += count) {
+    count = min_t(size_t, len, PAGE_SIZE);
+    err = tar_archive_read(sb, buf, count, off);
+    if (!err && copy_to_iter(buf, count, iter) != count)
+      err = -EFAULT;
+  }
+
+  kfree(buf);
+  return err;
+}
+
+/*
+ * Read completion of a scan window.
+ */
+static void tar_scan_end_io(struct bio *bio)
+{
+  struct tar_scan_window *win = bio->bi_private;
+
+  win->status = blk_status_to_errno(bio->bi_status);
+  complete(&win->done);
+  bio_put(bio);
+}
+
+/*
+ * Wait for a scan window read.
+ */
+static int tar_scan_wait(struct tar_scan *scan, struct tar_scan_window *win)
+{
+  if (win->pending) {
+    /* file backed archive : read window (backing file readahead was started at submit time) */
+    if (scan->file)
+      win->status = tar_layer_read(scan->sb, scan->layer, win->buf, win->len, win->off);
+    else
+      wait_for_completion(&win->done);
+    win->pending = false;
+
+    /* invalidate window on error */
+    if (win->status)
+      win->off = -1;
+  }
+
+  return win->status;
+}
+
+/*
+ * Start reading a scan window (asynchronously).
+ */
+static void tar_scan_submit(struct tar_scan *scan, struct tar_scan_window *win, loff_t off)
+{
+  struct block_device *bdev = scan->sb->s_bdev;
+  unsigned int i, nr_pages;
+  size_t len, count;
+  struct bio *bio;
+
+  /* compute window length (stop at end of archive) */
+  len = min_t(loff_t, scan->win_size, scan->size - off);
+  len = round_down(len, scan->file ? TARFS_BLOCK_SIZE : bdev_logical_block_size(bdev));
+
+  /* set window */
+  win->off = off;
+  win->len = len;
+  win->status = 0;
+  if (!len) {
+    win->off = -1;
+    win->status = -EIO;
+    return;
+  }
+
+  /* file backed archive : start backing file readahead (plain archive only), window is read at wait time */
+  if (scan->file) {
+    if (scan->layer || !tarfs_sb(scan->sb)->s_compress)
+      vfs_fadvise(scan->file, off, len, POSIX_FADV_WILLNEED);
+    win->pending = true;
+    return;
+  }
+
+  /* submit a single bio for the whole window (one vector per page) */
+  nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+  bio = bio_alloc(bdev, nr_pages, REQ_OP_READ, GFP_KERNEL);
+  bio->bi_iter.bi_sector = off >> SECTOR_SHIFT;
+  bio->bi_end_io = tar_scan_end_io;
+  bio->bi_private = win;
+  for (i = 0; i < nr_pages; i++) {
+    count = min_t(size_t, len - ((size_t) i << PAGE_SHIFT), PAGE_SIZE);
+    if (bio_add_page(bio, nth_page(win->page, i), count, 0) != count) {
+      bio_put(bio);
+      win->off = -1;
+      win->status = -EIO;
+      return;
+    }
+  }
+
+  reinit_completion(&win->done);
+  win->pending = true;
+  submit_bio(bio);
+}
+
+/*
+ * Init an archive scanner with a window size (on a layer, layer 0 = mount source).
+ */
+int tar_scan_init_window(struct tar_scan *scan, struct super_block *sb, u8 layer, size_t win_size)
+{
+  unsigned int order;
+  int i;
+
+  scan->sb = sb;
+  scan->file = layer ? tarfs_sb(sb)->s_layers[layer] : tarfs_sb(sb)->s_backing_file;
+  scan->layer = layer;
+  scan->size = tar_layer_size(sb, layer);
+  scan->cur = 0;
+  scan->defer_checksum = false;
+
+  /* a window is read by a single bio */
+  win_size = min_t(size_t, win_size, BIO_MAX_VECS << PAGE_SHIFT);
+
+  /* allocate windows (try smaller windows if memory is fragmented) */
+  for (order = get_order(win_size);; order--) {
+    for (i = 0; i < 2; i++) {
+      scan->win[i].page = alloc_pages(GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN, order);
+      if (!scan->win[i].page)
+        break;
+    }
+
+    /* success */
+    if (i == 2)
+      break;
+
+    /* release first window and retry */
+    if (i == 1)
+      __free_pages(scan->win[0].page, order);
+    if (!order)
+      return -ENOMEM;
+  }
+
+  /* init windows */
+  scan->win_size = PAGE_SIZE << order;
+  scan->win_order = order;
+  for (i = 0; i < 2; i++) {
+    scan->win[i].buf = page_address(scan->win[i].page);
+    scan->win[i].off = -1;
+    scan->win[i].len = 0;
+    scan->win[i].status = 0;
+    scan->win[i].pending = false;
+    init_completion(&scan->win[i].done);
+  }
+
+  return 0;
+}
+
+/*
+ * Init an archive scanner (on a layer, layer 0 = mount source).
+ */
+int tar_scan_init(struct tar_scan *scan, struct super_block *sb, u8 layer)
+{
+  return tar_scan_init_window(scan, sb, layer, TARFS_SCAN_WINDOW_SIZE);
+}
+
+/*
+ * Release an archive scanner.
+ */
+void tar_scan_exit(struct tar_scan *scan)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (!scan->file)
+      tar_scan_wait(scan, &scan->win[i]);
+    __free_pages(scan->win[i].page, scan->win_order);
+  }
+}
+
+/*
+ * Get an archive block. The returned pointer is valid until the next call.
+ */
+const char *tar_scan_read(struct tar_scan *scan, loff_t off)
+{
+  struct tar_scan_window *win = &scan->win[scan->cur], *next;
+  loff_t next_off;
+  int err;
+
+  /* block is in current window */
+  if (win->off >= 0 && off >= win->off && off + TARFS_BLOCK_SIZE <= win->off + win->len)
+    return win->buf + (off - win->off);
+
+  /* end of archive */
+  if (off + TARFS_BLOCK_SIZE > scan->size)
+    return ERR_PTR(-EIO);
+
+  /* block is in prefetched window : switch to it */
+  next = &scan->win[!scan->cur];
+  err = tar_scan_wait(scan, next);
+  if (!err && next->off >= 0 && off >= next->off && off + TARFS_BLOCK_SIZE <= next->off + next->len) {
+    scan->cur = !scan->cur;
+    swap(win, next);
+  } else {
+    /* block is far away (large member skipped) : read its window synchronously */
+    tar_scan_submit(scan, win, round_down(off, scan->win_size));
+    err = tar_scan_wait(scan, win);
+    if (err)
+      return ERR_PTR(err);
+    if (off + TARFS_BLOCK_SIZE > win->off + win->len)
+      return ERR_PTR(-EIO);
+  }
+
+  /* prefetch next window while current one is parsed */
+  next_off = win->off + scan->win_size;
+  if (next_off < scan->size)
+    tar_scan_submit(scan, next, next_off);
+
+  return win->buf + (off - win->off);
+}
+
+/*
+ * Get archive data at a block offset (up to len bytes) : len is reduced to the data held by the scan window.
+ * The returned pointer is valid until the next call.
+ */
+const char *tar_scan_read_range(struct tar_scan *scan, loff_t off, size_t *len)
+{
+  const char *data = tar_scan_read(scan, off);
+  struct tar_scan_window *win = &scan->win[scan->cur];
+
+  if (!IS_ERR(data))
+    *len = min_t(size_t, *len, win->off + win->len - off);
+
+  return data;
+}
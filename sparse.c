@@ -0,0 +1,414 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/uio.h>
+
+#include "tarfs.h"
+
+/*
+ * Parse a GNU sparse number (octal, padded with spaces or NUL).
+ */
+static int tar_sparse_octal(const char *field, size_t len, u64 *val)
+{
+  char buf[16];
+
+  len = strnlen(field, min_t(size_t, len, sizeof(buf) - 1));
+  memcpy(buf, field, len);
+  buf[len] = 0;
+
+  return kstrtoull(strim(buf), 8, val);
+}
+
+/*
+ * Parse a pax sparse number (decimal).
+ */
+static int tar_sparse_decimal(const char *str, size_t len, u64 *val)
+{
+  char buf[24];
+
+  if (!len || len >= sizeof(buf))
+    return -EINVAL;
+
+  memcpy(buf, str, len);
+  buf[len] = 0;
+
+  return kstrtoull(buf, 10, val);
+}
+
+/*
+ * Get sparse map of a member being parsed (allocated on first use).
+ */
+static struct tar_sparse_map *tar_sparse_get_map(struct tar_raw *raw)
+{
+  if (!raw->sparse) {
+    raw->sparse = kmalloc(struct_size(raw->sparse, extents, 8), GFP_KERNEL);
+    if (!raw->sparse)
+      return NULL;
+
+    raw->sparse->size = 0;
+    raw->sparse->nr_extents = 0;
+    raw->sparse->max_extents = 8;
+  }
+
+  return raw->sparse;
+}
+
+/*
+ * Add an extent to a sparse map (extents must be sorted, empty extents only mark the file size).
+ */
+static int tar_sparse_add(struct tar_raw *raw, u64 offset, u64 len)
+{
+  struct tar_sparse_map *map = tar_sparse_get_map(raw), *new_map;
+  struct tar_extent *prev;
+
+  if (!map)
+    return -ENOMEM;
+
+  /* check extent */
+  prev = map->nr_extents ? &map->extents[map->nr_extents - 1] : NULL;
+  if (offset + len < offset || (prev && offset < prev->offset + prev->len))
+    return -EINVAL;
+  if (!len)
+    return 0;
+
+  /* grow extents */
+  if (map->nr_extents == map->max_extents) {
+    if (map->max_extents >= TARFS_SPARSE_MAX_EXTENTS)
+      return -EFBIG;
+
+    new_map = krealloc(map, struct_size(map, extents, map->max_extents * 2), GFP_KERNEL);
+    if (!new_map)
+      return -ENOMEM;
+
+    new_map->max_extents *= 2;
+    raw->sparse = map = new_map;
+    prev = map->nr_extents ? &map->extents[map->nr_extents - 1] : NULL;
+  }
+
+  /* extents data are packed */
+  map->extents[map->nr_extents].offset = offset;
+  map->extents[map->nr_extents].len = len;
+  map->extents[map->nr_extents].data_off = prev ? prev->data_off + prev->len : 0;
+  map->nr_extents++;
+
+  return 0;
+}
+
+/*
+ * Add GNU sparse extents (an empty entry ends the list).
+ */
+static int tar_sparse_add_gnu(struct tar_raw *raw, const struct tar_sparse *sparse, int nr)
+{
+  u64 offset, len;
+  int i, err;
+
+  for (i = 0; i < nr && sparse[i].offset[0]; i++) {
+    if (tar_sparse_octal(sparse[i].offset, sizeof(sparse[i].offset), &offset)
+        || tar_sparse_octal(sparse[i].numbytes, sizeof(sparse[i].numbytes), &len))
+      return -EINVAL;
+
+    err = tar_sparse_add(raw, offset, len);
+    if (err)
+      return err;
+  }
+
+  return 0;
+}
+
+/*
+ * Parse a GNU sparse member (type 'S') : extents in header, then in extension blocks (skipped in data offset).
+ */
+int tar_sparse_parse_gnu(struct tar_scan *scan, struct tar_raw *raw)
+{
+  const struct tar_sparse_header *sh = (const void *) ((const char *) &raw->hdr + TAR_SPARSE_HDR_OFFSET);
+  const struct tar_sparse_ext *ext;
+  struct tar_sparse_map *map;
+  bool extended;
+  int err;
+
+  map = tar_sparse_get_map(raw);
+  if (!map)
+    return -ENOMEM;
+
+  /* get real size */
+  if (tar_sparse_octal(sh->realsize, sizeof(sh->realsize), &map->size))
+    return -EINVAL;
+
+  /* header extents */
+  err = tar_sparse_add_gnu(raw, sh->sparse, TAR_SPARSE_HDR_EXTENTS);
+  if (err)
+    return err;
+
+  /* extension blocks */
+  for (extended = sh->isextended; extended; raw->data_off += TARFS_BLOCK_SIZE) {
+    ext = (const struct tar_sparse_ext *) tar_scan_read(scan, raw->data_off);
+    if (IS_ERR(ext))
+      return PTR_ERR(ext);
+
+    err = tar_sparse_add_gnu(raw, ext->sparse, TAR_SPARSE_EXT_EXTENTS);
+    if (err)
+      return err;
+
+    extended = ext->isextended;
+  }
+
+  return 0;
+}
+
+/*
+ * Parse a pax sparse record (GNU.sparse.* keywords of pax formats 0.0, 0.1 and 1.0, key is given without prefix).
+ * Offset holds the pending extent offset of format 0.0 between records.
+ */
+int tar_sparse_parse_pax(struct tar_raw *raw, const char *key, size_t key_len, const char *val, size_t val_len,
+                         u64 *offset)
+{
+  struct tar_sparse_map *map;
+  const char *end, *sep;
+  u64 len;
+  int err;
+
+  map = tar_sparse_get_map(raw);
+  if (!map)
+    return -ENOMEM;
+
+#define TAR_SPARSE_KEY(name)    (key_len == strlen(name) && !memcmp(key, name, key_len))
+
+  /* real name (pax 0.1 and 1.0 : header name is a generated one) */
+  if (TAR_SPARSE_KEY("name")) {
+    kfree(raw->long_name);
+    raw->long_name = kstrndup(val, val_len, GFP_KERNEL);
+    return raw->long_name ? 0 : -ENOMEM;
+  }
+
+  /* real size */
+  if (TAR_SPARSE_KEY("size") || TAR_SPARSE_KEY("realsize"))
+    return tar_sparse_decimal(val, val_len, &map->size);
+
+  /* pax 1.0 : map is stored at start of data */
+  if (TAR_SPARSE_KEY("major")) {
+    raw->sparse_in_data = val_len == 1 && val[0] == '1';
+    return 0;
+  }
+
+  /* pax 0.0 : extents are pairs of records */
+  if (TAR_SPARSE_KEY("offset"))
+    return tar_sparse_decimal(val, val_len, offset);
+  if (TAR_SPARSE_KEY("numbytes")) {
+    err = tar_sparse_decimal(val, val_len, &len);
+    return err ?: tar_sparse_add(raw, *offset, len);
+  }
+
+  /* pax 0.1 : extents are comma separated pairs */
+  if (TAR_SPARSE_KEY("map")) {
+    for (end = val + val_len; val < end; val = sep + 1) {
+      sep = memchr(val, ',', end - val);
+      if (!sep)
+        return -EINVAL;
+      err = tar_sparse_decimal(val, sep - val, offset);
+      if (err)
+        return err;
+
+      val = sep + 1;
+      sep = memchr(val, ',', end - val) ?: end;
+      err = tar_sparse_decimal(val, sep - val, &len) ?: tar_sparse_add(raw, *offset, len);
+      if (err)
+        return err;
+    }
+  }
+
+#undef TAR_SPARSE_KEY
+
+  return 0;
+}
+
+/*
+ * Read a pax 1.0 sparse map at start of member data : decimal numbers, one per line (number of extents, then offset
+ * and length of each extent), padded to a block. Map blocks are removed from member data.
+ */
+int tar_sparse_read_map(struct tar_scan *scan, struct tar_raw *raw, size_t *data_len)
+{
+  u64 val = 0, offset = 0, nr_values = 1, i = 0;
+  const char *block = NULL;
+  bool digit = false;
+  size_t pos, len;
+  int err;
+
+  for (pos = 0; i < nr_values; pos++) {
+    if (pos >= *data_len)
+      return -EINVAL;
+
+    /* read next block */
+    if (!(pos % TARFS_BLOCK_SIZE)) {
+      block = tar_scan_read(scan, raw->data_off + pos);
+      if (IS_ERR(block))
+        return PTR_ERR(block);
+    }
+
+    /* parse a digit */
+    if (isdigit(block[pos % TARFS_BLOCK_SIZE])) {
+      if (val > (U64_MAX - 9) / 10)
+        return -EINVAL;
+      val = val * 10 + block[pos % TARFS_BLOCK_SIZE] - '0';
+      digit = true;
+      continue;
+    }
+
+    /* end of number */
+    if (block[pos % TARFS_BLOCK_SIZE] != '\n' || !digit)
+      return -EINVAL;
+
+    if (i == 0) {
+      if (val > TARFS_SPARSE_MAX_EXTENTS)
+        return -EFBIG;
+      nr_values += val * 2;
+    } else if (i % 2) {
+      offset = val;
+    } else {
+      err = tar_sparse_add(raw, offset, val);
+      if (err)
+        return err;
+    }
+
+    val = 0;
+    digit = false;
+    i++;
+  }
+
+  /* skip map blocks */
+  len = round_up(pos, TARFS_BLOCK_SIZE);
+  if (len > *data_len)
+    return -EINVAL;
+
+  raw->data_off += len;
+  *data_len -= len;
+  return tar_sparse_get_map(raw) ? 0 : -ENOMEM;
+}
+
+/*
+ * Check a sparse map against the packed data length (extents must fit in data and in file).
+ */
+int tar_sparse_check(struct tar_sparse_map *map, u64 data_len)
+{
+  struct tar_extent *last;
+
+  if (!map->nr_extents)
+    return 0;
+
+  last = &map->extents[map->nr_extents - 1];
+  if (last->data_off + last->len > data_len || last->offset + last->len > map->size)
+    return -EINVAL;
+
+  return 0;
+}
+
+/*
+ * Release sparse map of a member being parsed.
+ */
+void tar_sparse_release(struct tar_raw *raw)
+{
+  kfree(raw->sparse);
+  raw->sparse = NULL;
+  raw->sparse_in_data = false;
+}
+
+/*
+ * Get sparse map of an inode.
+ */
+static struct tar_sparse_map *tar_sparse_map(struct inode *inode)
+{
+  return smp_load_acquire(&tarfs_sb(inode->i_sb)->s_sparse)[tarfs_i(inode)->entry->ino];
+}
+
+/*
+ * Find first extent ending after a file offset (NULL = no data after offset).
+ */
+static struct tar_extent *tar_sparse_find(struct tar_sparse_map *map, loff_t pos)
+{
+  u32 lo = 0, hi = map->nr_extents, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (map->extents[mid].offset + map->extents[mid].len <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo < map->nr_extents ? &map->extents[lo] : NULL;
+}
+
+/*
+ * Get packed data length of a sparse inode.
+ */
+u64 tar_sparse_data_len(struct inode *inode)
+{
+  struct tar_sparse_map *map = tar_sparse_map(inode);
+
+  if (!map->nr_extents)
+    return 0;
+
+  return map->extents[map->nr_extents - 1].data_off + map->extents[map->nr_extents - 1].len;
+}
+
+/*
+ * Read a sparse inode range to an iterator : holes are zeroed, data runs are read at their packed offset.
+ */
+int tar_sparse_read(struct inode *inode, struct iov_iter *iter, size_t len, loff_t pos)
+{
+  struct tar_entry *entry = tarfs_i(inode)->entry;
+  struct tar_sparse_map *map = tar_sparse_map(inode);
+  struct tar_extent *ext, *end = map->extents + map->nr_extents;
+  size_t count;
+  int err;
+
+  for (ext = tar_sparse_find(map, pos); len; pos += count, len -= count) {
+    /* hole */
+    if (!ext || pos < ext->offset) {
+      count = ext ? min_t(u64, len, ext->offset - pos) : len;
+      iov_iter_zero(count, iter);
+      continue;
+    }
+
+    /* data */
+    count = min_t(u64, len, ext->offset + ext->len - pos);
+    err = tar_layer_read_iter(inode->i_sb, entry->layer, iter, count,
+                              entry->data_off + ext->data_off + pos - ext->offset);
+    if (err)
+      return err;
+
+    if (++ext == end)
+      ext = NULL;
+  }
+
+  return 0;
+}
+
+/*
+ * Seek to next data or hole of a sparse inode.
+ */
+loff_t tar_sparse_llseek(struct file *file, loff_t offset, int whence)
+{
+  struct inode *inode = file_inode(file);
+  struct tar_sparse_map *map = tar_sparse_map(inode);
+  struct tar_extent *ext, *end = map->extents + map->nr_extents;
+  loff_t size = i_size_read(inode);
+
+  if (offset < 0 || offset >= size)
+    return -ENXIO;
+
+  ext = tar_sparse_find(map, offset);
+  if (whence == SEEK_DATA) {
+    if (!ext)
+      return -ENXIO;
+
+    offset = max_t(loff_t, offset, ext->offset);
+  } else {
+    /* skip contiguous extents (end of file is a hole) */
+    for (; ext && ext < end && ext->offset <= offset; ext++)
+      offset = ext->offset + ext->len;
+  }
+
+  return vfs_setpos(file, min_t(loff_t, offset, size), inode->i_sb->s_maxbytes);
+}
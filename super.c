@@ -4,6 +4,11 @@
 #include <linux/vfs.h>
 #include <linux/buffer_head.h>
 #include <linux/writeback.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/namei.h>
+#include <linux/file.h>
 
 #include "tarfs.h"
 
@@ -26,22 +31,129 @@ static int tarfs_statfs(struct dentry *dentry, struct kstatfs *buf)
   buf->f_files = sbi->s_ninodes - 1;
   buf->f_ffree = 0;
   buf->f_namelen = 0;
-  buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+  buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_dev));
   
   return 0;
 }
 
+/*
+ * Release TAR entries.
+ */
+static void tar_release_entries(struct tarfs_sb_info *sbi)
+{
+  tar_arena_free(&sbi->s_arena);
+  kvfree(sbi->s_tar_entries);
+  kvfree(sbi->s_xtimes);
+  kvfree(sbi->s_sparse);
+  sbi->s_tar_entries = NULL;
+  sbi->s_xtimes = NULL;
+  sbi->s_sparse = NULL;
+  sbi->s_ninodes = 0;
+  sbi->s_max_inodes = 0;
+  sbi->s_max_xtimes = 0;
+  sbi->s_max_sparse = 0;
+}
+
+/*
+ * Open upper layers (layers= mount option : archive files separated by ':', from lowest to uppest).
+ */
+static int tar_open_layers(struct tarfs_sb_info *sbi)
+{
+  char *paths, *p, *path;
+  struct file *file;
+  u32 nr_layers;
+
+  if (!sbi->s_layers_path)
+    return 0;
+
+  /* allocate layers (layer 0 is the mount source) */
+  nr_layers = 1;
+  for (p = sbi->s_layers_path; *p; p++)
+    nr_layers += *p == ':';
+  if (++nr_layers > TARFS_MAX_LAYERS) {
+    printk("TARFS : too many layers (max %d)\n", TARFS_MAX_LAYERS);
+    return -EINVAL;
+  }
+
+  sbi->s_layers = kcalloc(nr_layers, sizeof(struct file *), GFP_KERNEL);
+  if (!sbi->s_layers)
+    return -ENOMEM;
+
+  paths = kstrdup(sbi->s_layers_path, GFP_KERNEL);
+  if (!paths)
+    return -ENOMEM;
+
+  /* open layers */
+  for (p = paths; (path = strsep(&p, ":")) != NULL;) {
+    if (!*path)
+      continue;
+
+    file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(file)) {
+      printk("TARFS : can't open layer %s (error %ld)\n", path, PTR_ERR(file));
+      kfree(paths);
+      return PTR_ERR(file);
+    }
+
+    sbi->s_layers[sbi->s_nr_layers++] = file;
+    if (!S_ISREG(file_inode(file)->i_mode)) {
+      printk("TARFS : layer %s is not a regular file\n", path);
+      kfree(paths);
+      return -EINVAL;
+    }
+  }
+
+  kfree(paths);
+  return 0;
+}
+
+/*
+ * Close upper layers.
+ */
+static void tar_close_layers(struct tarfs_sb_info *sbi)
+{
+  u32 i;
+
+  if (!sbi->s_layers)
+    return;
+
+  for (i = 1; i < sbi->s_nr_layers; i++)
+    fput(sbi->s_layers[i]);
+
+  kfree(sbi->s_layers);
+  sbi->s_layers = NULL;
+  sbi->s_nr_layers = 1;
+}
+
 /*
  * Release a TarFS super block.
  */
 static void tarfs_put_super(struct super_block *sb)
 {
   struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  int err;
+  
+  /* write recorded manifest */
+  err = tar_record_write(sb);
+  if (err)
+    printk("TARFS : can't write manifest %s (err = %d)\n", sbi->s_record_path, err);
+  tar_record_release(&sbi->s_record);
   
   /* free tar entries */
-  tar_free(sbi->s_root_entry);
-  if (sbi->s_tar_entries)
-    kfree(sbi->s_tar_entries);
+  tar_meta_release(sb);
+  tar_release_entries(sbi);
+  kfree(sbi->s_index_path);
+  kfree(sbi->s_record_path);
+  kfree(sbi->s_replay_path);
+  kfree(sbi->s_layers_path);
+  tar_close_layers(sbi);
+  tar_lazy_release(sb);
+  tar_dedup_release(sb);
+  tar_compress_exit(sb);
+  if (sbi->s_backing_file)
+    fput(sbi->s_backing_file);
+  if (sbi->s_bdev_file)
+    fput(sbi->s_bdev_file);
   
   sb->s_fs_info = NULL;
   kfree(sbi);
@@ -58,6 +170,8 @@ static struct inode *tarfs_alloc_inode(struct super_block *sb)
   if (!tarfs_inode)
     return NULL;
   
+  tarfs_inode->entry = NULL;
+  tarfs_inode->dedup = NULL;
   return &tarfs_inode->vfs_inode;
 }
 
@@ -69,6 +183,19 @@ static void tarfs_free_inode(struct inode *inode)
   kmem_cache_free(tarfs_inode_cache, tarfs_i(inode));
 }
 
+/*
+ * Evict a TarFS inode.
+ */
+static void tarfs_evict_inode(struct inode *inode)
+{
+  truncate_inode_pages_final(&inode->i_data);
+  clear_inode(inode);
+  tar_prefetch_evict(inode);
+  tar_dedup_evict(inode);
+  if (tarfs_i(inode)->entry)
+    tar_meta_unpin(inode->i_sb, inode->i_ino);
+}
+
 /*
  * Init a new inode from cache.
  */
@@ -101,24 +228,250 @@ static void destroy_inodecache(void)
   kmem_cache_destroy(tarfs_inode_cache);
 }
 
+/*
+ * Show TarFS mount options.
+ */
+static int tarfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(root->d_sb);
+
+  if (sbi->s_index_path)
+    seq_show_option(seq, "index", sbi->s_index_path);
+  if (sbi->s_record_path)
+    seq_show_option(seq, "record", sbi->s_record_path);
+  if (sbi->s_replay_path)
+    seq_show_option(seq, "replay", sbi->s_replay_path);
+  if (sbi->s_layers_path)
+    seq_show_option(seq, "layers", sbi->s_layers_path);
+  if (sbi->s_lazy.enabled)
+    seq_puts(seq, ",lazy");
+  if (sbi->s_parse_threads)
+    seq_printf(seq, ",threads=%u", sbi->s_parse_threads);
+  if (!sbi->s_checksum)
+    seq_puts(seq, ",nochecksum");
+  if (sbi->s_badhdr_skip)
+    seq_puts(seq, ",badhdr=skip");
+  if (sbi->s_dedup.enabled)
+    seq_puts(seq, ",dedup");
+  if (sbi->s_meta.enabled)
+    seq_puts(seq, ",evict");
+  if (sbi->s_prefetch.members != TARFS_PREFETCH_MEMBERS)
+    seq_printf(seq, ",prefetch=%u", sbi->s_prefetch.members);
+
+  return 0;
+}
+
+/*
+ * Show TarFS statistics.
+ */
+static int tarfs_show_stats(struct seq_file *seq, struct dentry *root)
+{
+  tar_prefetch_show_stats(seq, root->d_sb);
+  tar_manifest_show_stats(seq, root->d_sb);
+  tar_compress_show_stats(seq, root->d_sb);
+  tar_lazy_show_stats(seq, root->d_sb);
+  tar_dedup_show_stats(seq, root->d_sb);
+  tar_meta_show_stats(seq, root->d_sb);
+  seq_printf(seq, "\n\tshared: bytes %lld", atomic64_read(&tarfs_sb(root->d_sb)->s_shared_bytes));
+  seq_printf(seq, "\n\theaders: bad %llu", tarfs_sb(root->d_sb)->s_bad_headers);
+  return 0;
+}
+
 /*
  * TarFS super operations.
  */
 static struct super_operations tarfs_sops = {
   .alloc_inode          = tarfs_alloc_inode,
   .free_inode           = tarfs_free_inode,
+  .evict_inode          = tarfs_evict_inode,
   .put_super            = tarfs_put_super,
   .statfs               = tarfs_statfs,
+  .show_options         = tarfs_show_options,
+  .show_stats           = tarfs_show_stats,
 };
 
+/*
+ * TarFS mount options.
+ */
+enum {
+  Opt_index,
+  Opt_prefetch,
+  Opt_record,
+  Opt_replay,
+  Opt_layers,
+  Opt_lazy,
+  Opt_threads,
+  Opt_nochecksum,
+  Opt_badhdr_stop,
+  Opt_badhdr_skip,
+  Opt_dedup,
+  Opt_evict,
+  Opt_err,
+};
+
+static const match_table_t tarfs_tokens = {
+  { Opt_index,          "index=%s" },
+  { Opt_prefetch,       "prefetch=%u" },
+  { Opt_record,         "record=%s" },
+  { Opt_replay,         "replay=%s" },
+  { Opt_layers,         "layers=%s" },
+  { Opt_lazy,           "lazy" },
+  { Opt_threads,        "threads=%u" },
+  { Opt_nochecksum,     "nochecksum" },
+  { Opt_badhdr_stop,    "badhdr=stop" },
+  { Opt_badhdr_skip,    "badhdr=skip" },
+  { Opt_dedup,          "dedup" },
+  { Opt_evict,          "evict" },
+  { Opt_err,            NULL },
+};
+
+/*
+ * Parse TarFS mount options.
+ */
+static int tarfs_parse_options(struct tarfs_sb_info *sbi, char *options)
+{
+  substring_t args[MAX_OPT_ARGS];
+  int option;
+  char *p;
+
+  if (!options)
+    return 0;
+
+  while ((p = strsep(&options, ",")) != NULL) {
+    if (!*p)
+      continue;
+
+    switch (match_token(p, tarfs_tokens, args)) {
+      case Opt_index:
+        kfree(sbi->s_index_path);
+        sbi->s_index_path = match_strdup(&args[0]);
+        if (!sbi->s_index_path)
+          return -ENOMEM;
+        break;
+      case Opt_prefetch:
+        if (match_int(&args[0], &option) || option < 0)
+          return -EINVAL;
+        sbi->s_prefetch.members = option;
+        break;
+      case Opt_record:
+        kfree(sbi->s_record_path);
+        sbi->s_record_path = match_strdup(&args[0]);
+        if (!sbi->s_record_path)
+          return -ENOMEM;
+        break;
+      case Opt_replay:
+        kfree(sbi->s_replay_path);
+        sbi->s_replay_path = match_strdup(&args[0]);
+        if (!sbi->s_replay_path)
+          return -ENOMEM;
+        break;
+      case Opt_layers:
+        kfree(sbi->s_layers_path);
+        sbi->s_layers_path = match_strdup(&args[0]);
+        if (!sbi->s_layers_path)
+          return -ENOMEM;
+        break;
+      case Opt_lazy:
+        sbi->s_lazy.enabled = true;
+        break;
+      case Opt_threads:
+        if (match_int(&args[0], &option) || option < 0)
+          return -EINVAL;
+        sbi->s_parse_threads = option;
+        break;
+      case Opt_nochecksum:
+        sbi->s_checksum = false;
+        break;
+      case Opt_badhdr_stop:
+        sbi->s_badhdr_skip = false;
+        break;
+      case Opt_badhdr_skip:
+        sbi->s_badhdr_skip = true;
+        break;
+      case Opt_dedup:
+        sbi->s_dedup.enabled = true;
+        break;
+      case Opt_evict:
+        sbi->s_meta.enabled = true;
+        break;
+      default:
+        printk("TARFS : unknown mount option \"%s\"\n", p);
+        return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Build TarFS tree (from an index file or by scanning the archive).
+ */
+static int tarfs_build(struct super_block *sb)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(sb);
+  u64 start;
+  int err;
+  
+  /* load tar index (an index describes a single archive) */
+  start = ktime_get_ns();
+  err = -ENOENT;
+  if (sbi->s_index_path && sbi->s_nr_layers > 1)
+    printk("TARFS : index is ignored on a layered mount\n");
+  else if (sbi->s_index_path) {
+    err = tar_load_index(sb, sbi->s_index_path);
+    if (err) {
+      printk("TARFS : can't load index %s (err = %d), scanning archive\n", sbi->s_index_path, err);
+      tar_release_entries(sbi);
+      tar_names_release(&sbi->s_names);
+      err = tar_names_init(&sbi->s_names);
+      if (err)
+        return err;
+      err = -ENOENT;
+    }
+  }
+  
+  /* or parse tar archive */
+  if (err)
+    err = tar_create(sb);
+  if (err)
+    return err;
+  
+  /* index tar entries */
+  err = tar_index(sb);
+  if (err) {
+    printk("TARFS : can't create tar index\n");
+    return err;
+  }
+  
+  /* check if archive is page aligned (upper layers members are checked one by one) */
+  sbi->s_aligned = sbi->s_nr_layers == 1 && tar_check_aligned(sb);
+  
+  /* names dictionary is not needed anymore */
+  tar_names_release(&sbi->s_names);
+  
+  /* report build time */
+  sbi->s_build_time = ktime_get_ns() - start;
+  printk("TARFS : %u entries (%u distinct names, %zu bytes) built in %llu ms%s\n", sbi->s_ninodes - 1,
+         sbi->s_names.count, sbi->s_names.size, div_u64(sbi->s_build_time, NSEC_PER_MSEC),
+         sbi->s_aligned ? ", page aligned archive" : "");
+  
+  /* all entries are published */
+  sbi->s_lazy.published = sbi->s_ninodes;
+  return 0;
+}
+
 /*
  * Fill in a TarFS super block.
  */
 static int tarfs_fill_super(struct super_block *sb, void *data, int silent)
 {
+  struct tarfs_mount_data *mdata = data;
   struct tarfs_sb_info *sbi;
   struct inode *root_inode;
-  int err, i;
+  int err;
+  
+  /* entries must fit in a cache line */
+  BUILD_BUG_ON(sizeof(struct tar_entry) > 64);
   
   /* allocate TarFS super block */
   sb->s_fs_info = sbi = (struct tarfs_sb_info *) kmalloc(sizeof(struct tarfs_sb_info), GFP_KERNEL);
@@ -126,27 +479,107 @@ static int tarfs_fill_super(struct super_block *sb, void *data, int silent)
     return -ENOMEM;
   
   /* set super block */
-  sb_set_blocksize(sb, TARFS_BLOCK_SIZE);
+  sbi->s_backing_file = NULL;
+  sbi->s_bdev_file = mdata->bdev_file ? get_file(mdata->bdev_file) : NULL;
+  atomic64_set(&sbi->s_shared_bytes, 0);
+  sbi->s_aligned = false;
+  sbi->s_compress = NULL;
+  sbi->s_layers_path = NULL;
+  sbi->s_layers = NULL;
+  sbi->s_nr_layers = 1;
+  if (mdata->file) {
+    sbi->s_backing_file = get_file(mdata->file);
+    sb->s_blocksize = TARFS_BLOCK_SIZE;
+    sb->s_blocksize_bits = TARFS_BLOCK_SIZE_BITS;
+    sb->s_flags |= SB_RDONLY;
+  } else {
+    sb_set_blocksize(sb, TARFS_BLOCK_SIZE);
+  }
   sbi->s_ninodes = 0;
+  sbi->s_max_inodes = 0;
+  sbi->s_max_xtimes = 0;
   sbi->s_root_entry = NULL;
   sbi->s_tar_entries = NULL;
+  sbi->s_xtimes = NULL;
+  sbi->s_sparse = NULL;
+  sbi->s_max_sparse = 0;
+  sbi->s_index_path = NULL;
+  sbi->s_record_path = NULL;
+  sbi->s_replay_path = NULL;
+  sbi->s_build_time = 0;
+  sbi->s_parse_threads = 0;
+  sbi->s_checksum = true;
+  sbi->s_badhdr_skip = false;
+  sbi->s_bad_headers = 0;
+  tar_arena_init(&sbi->s_arena);
+  memset(&sbi->s_names, 0, sizeof(sbi->s_names));
+  sbi->s_prefetch.wq = NULL;
+  xa_init(&sbi->s_prefetch.prefetched);
+  sbi->s_prefetch.members = TARFS_PREFETCH_MEMBERS;
+  tar_record_init(&sbi->s_record);
+  tar_replay_init(&sbi->s_replay);
+  tar_lazy_init(&sbi->s_lazy);
+  tar_dedup_init(&sbi->s_dedup);
+  tar_meta_init(&sbi->s_meta);
+  
+  /* parse mount options */
+  err = tarfs_parse_options(sbi, mdata->options);
+  if (err)
+    goto err_bad_opts;
+  
+  /* create names dictionary */
+  err = tar_names_init(&sbi->s_names);
+  if (err)
+    goto err;
   
-  /* parse tar archive */
-  err = tar_create(sb);
+  /* detect compressed archive */
+  err = tar_compress_init(sb);
   if (err)
     goto err_bad_sb;
   
-  /* create tar entries index */
-  sbi->s_tar_entries = (struct tar_entry **) kmalloc(sizeof(struct tar_entry *) * sbi->s_ninodes, GFP_KERNEL);
-  if (!sbi->s_tar_entries) {
-    err = -ENOMEM;
-    goto err_index;
+  /* open upper layers */
+  err = tar_open_layers(sbi);
+  if (err)
+    goto err;
+  
+  /* lazy indexing only applies to a single scanned archive */
+  if (sbi->s_lazy.enabled && (sbi->s_index_path || sbi->s_nr_layers > 1)) {
+    printk("TARFS : lazy indexing is ignored with an index or layers\n");
+    sbi->s_lazy.enabled = false;
   }
   
-  /* index tar entries */
-  for (i = 0; i < sbi->s_ninodes; i++)
-    sbi->s_tar_entries[i] = NULL;
-  tar_index(sb, sbi->s_root_entry);
+  /* demand-paged metadata only applies to a single fully built archive (and entries can't share page cache) */
+  if (sbi->s_meta.enabled && (sbi->s_lazy.enabled || sbi->s_nr_layers > 1)) {
+    printk("TARFS : evict is ignored with lazy indexing or layers\n");
+    sbi->s_meta.enabled = false;
+  }
+  if (sbi->s_meta.enabled && sbi->s_dedup.enabled) {
+    printk("TARFS : dedup is ignored with evict\n");
+    sbi->s_dedup.enabled = false;
+  }
+  
+  /* build tree (or only root entry, the archive is scanned in background) */
+  err = sbi->s_lazy.enabled ? tar_lazy_prepare(sb) : tarfs_build(sb);
+  if (err)
+    goto err_bad_sb;
+  
+  /* release evictable entries (they are loaded on first use) */
+  err = tar_meta_prepare(sb);
+  if (err)
+    goto err;
+  
+  /* start prefetcher */
+  err = tar_prefetch_init(sb);
+  if (err)
+    goto err;
+  
+  /* start lazy indexing (negative dentries are revalidated) */
+  if (sbi->s_lazy.enabled) {
+    err = tar_lazy_start(sb);
+    if (err)
+      goto err;
+    sb->s_d_op = &tarfs_lazy_dops;
+  }
   
   /* set super operations */
   sb->s_op = &tarfs_sops;
@@ -165,18 +598,41 @@ static int tarfs_fill_super(struct super_block *sb, void *data, int silent)
     goto err_no_root;
   }
   
+  /* start replay and deduplication (lazy indexing starts them once all entries are known) */
+  if (!sbi->s_lazy.enabled) {
+    tar_replay_start(sb);
+    tar_dedup_start(sb);
+  }
+  
   return 0;
 err_no_root:
   printk("TARFS : can't get root inode\n");
-  goto err_release_tar;
-err_index:
-  printk("TARFS : can't create tar index\n");
-err_release_tar:
-  tar_free(sbi->s_root_entry);
   goto err;
 err_bad_sb:
   printk("TARFS : can't read super block\n");
+  goto err;
+err_bad_opts:
+  printk("TARFS : bad mount options\n");
 err:
+  tar_lazy_stop(sb);
+  tar_replay_stop(sb);
+  tar_dedup_stop(sb);
+  tar_prefetch_exit(sb);
+  tar_names_release(&sbi->s_names);
+  tar_meta_release(sb);
+  tar_release_entries(sbi);
+  kfree(sbi->s_index_path);
+  kfree(sbi->s_record_path);
+  kfree(sbi->s_replay_path);
+  kfree(sbi->s_layers_path);
+  tar_close_layers(sbi);
+  tar_lazy_release(sb);
+  tar_dedup_release(sb);
+  tar_compress_exit(sb);
+  if (sbi->s_backing_file)
+    fput(sbi->s_backing_file);
+  if (sbi->s_bdev_file)
+    fput(sbi->s_bdev_file);
   kfree(sbi);
   sb->s_fs_info = NULL;
   return err;
@@ -187,7 +643,58 @@ err:
  */
 static struct dentry *tarfs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data)
 {
-  return mount_bdev(fs_type, flags, dev_name, data, tarfs_fill_super);
+  struct tarfs_mount_data mdata = { .options = data, .file = NULL, .bdev_file = NULL };
+  struct dentry *root;
+  struct path path;
+  bool is_file;
+  int err;
+
+  /* check if archive is a regular file */
+  err = kern_path(dev_name, LOOKUP_FOLLOW, &path);
+  if (err)
+    return ERR_PTR(err);
+  is_file = S_ISREG(d_inode(path.dentry)->i_mode);
+  path_put(&path);
+
+  /* block device, mounted read only (page aligned members share block device page cache, if it can be opened) */
+  if (!is_file) {
+    mdata.bdev_file = filp_open(dev_name, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(mdata.bdev_file))
+      mdata.bdev_file = NULL;
+
+    root = mount_bdev(fs_type, flags | SB_RDONLY, dev_name, &mdata, tarfs_fill_super);
+    if (mdata.bdev_file)
+      fput(mdata.bdev_file);
+    return root;
+  }
+
+  /* regular file : read archive through its page cache (no loop device) */
+  mdata.file = filp_open(dev_name, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(mdata.file))
+    return ERR_CAST(mdata.file);
+
+  root = mount_nodev(fs_type, flags | SB_RDONLY, &mdata, tarfs_fill_super);
+  fput(mdata.file);
+  return root;
+}
+
+/*
+ * Kill a TarFS super block.
+ */
+static void tarfs_kill_sb(struct super_block *sb)
+{
+  /* lazy indexing, prefetch and replay hold inodes : stop them before inodes are evicted */
+  if (tarfs_sb(sb)) {
+    tar_lazy_stop(sb);
+    tar_replay_stop(sb);
+    tar_dedup_stop(sb);
+    tar_prefetch_exit(sb);
+  }
+
+  if (sb->s_bdev)
+    kill_block_super(sb);
+  else
+    kill_anon_super(sb);
 }
 
 /*
@@ -197,8 +704,7 @@ static struct file_system_type tarfs_type = {
   .owner          = THIS_MODULE,
   .name           = "tarfs",
   .mount          = tarfs_mount,
-  .kill_sb        = kill_block_super,
-  .fs_flags       = FS_REQUIRES_DEV,
+  .kill_sb        = tarfs_kill_sb,
 };
 
 /*
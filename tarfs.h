@@ -2,15 +2,75 @@
 #define _TARFS_H_
 
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/completion.h>
+#include <linux/stringhash.h>
+#include <linux/iomap.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
+#include <linux/zlib.h>
+#include <linux/zstd.h>
 
 #define TARFS_BLOCK_SIZE_BITS               9
 #define TARFS_BLOCK_SIZE                    (1 << TARFS_BLOCK_SIZE_BITS)
 
 #define TARFS_MAGIC_STR                     "ustar "
+#define TARFS_USTAR_MAGIC_STR               "ustar"     /* POSIX ustar and pax (NUL terminated) */
+#define TARFS_USTAR_VERSION                 "00"
 #define TARFS_MAGIC                         0xAFAF
 
 #define TARFS_ROOT_INO                      1
 
+#define TARFS_ALIGNED_MARKER                "comment=tarfs-aligned="
+
+#define TARFS_DIR_HASH_MIN                  16
+#define TARFS_MIN_INODES                    1024
+
+#define TARFS_ARENA_CHUNK_SIZE              (256 * 1024)
+
+#define TARFS_NAMES_HASH_BITS               6
+#define TARFS_NAMES_SHARD_BITS              4
+
+#define TARFS_SCAN_WINDOW_SIZE              (1 << 20)
+
+#define TARFS_BACKING_RA_PAGES              32
+
+#define TARFS_PREFETCH_MEMBERS              8
+#define TARFS_PREFETCH_BUDGET_MIN           (256 * 1024)
+#define TARFS_PREFETCH_BUDGET_MAX           (8 * 1024 * 1024)
+
+#define TARFS_RECORD_MAX                    (1 << 20)
+
+#define TARFS_MAX_LAYERS                    64
+#define TARFS_SPARSE_MAX_EXTENTS            (1 << 20)
+
+#define TARFS_DEDUP_CHUNK_SIZE              (256 * 1024)
+
+#define TARFS_META_GROUP_BITS               8
+#define TARFS_META_GROUP_SIZE               (1 << TARFS_META_GROUP_BITS)
+#define TARFS_META_WINDOW_SIZE              (64 * 1024)
+
+#define TAR_WHITEOUT_PREFIX                 ".wh."
+#define TAR_WHITEOUT_OPAQUE                 ".wh..wh..opq"
+
+#define TARFS_FRAME_MAX_SIZE                (16 * 1024 * 1024)
+#define TARFS_FRAME_CACHE_SIZE              (32 * 1024 * 1024)
+
+#define TARFS_COMPRESS_ZSTD                 1
+#define TARFS_COMPRESS_GZIP                 2
+
+#define TARFS_BUILD_HASH_BITS               10
+#define TARFS_PARSE_BATCH                   128
+#define TARFS_PARSE_BATCHES_MAX             32
+#define TARFS_PARSE_ARENA_CHUNK_SIZE        (32 * 1024)
+#define TARFS_CHAIN_MAX                     32
+
 #define TAR_REGTYPE                         '0'
 #define TAR_AREGTYPE                        '\0'
 #define TAR_LNKTYPE                         '1'
@@ -22,6 +82,19 @@
 #define TAR_CONTTYPE                        '7'
 #define TAR_LONGNAME                        'L'
 #define TAR_LONGLINK                        'K'
+#define TAR_XHDTYPE                         'x'
+#define TAR_XGLTYPE                         'g'
+#define TAR_GNUTYPE_SPARSE                  'S'
+
+#define TAR_PAX_SPARSE_PREFIX               "GNU.sparse."
+
+#define TAR_FORMAT_GNU                      0
+#define TAR_FORMAT_USTAR                    1
+#define TAR_FORMAT_V7                       2
+
+#define TAR_SPARSE_HDR_OFFSET               386         /* GNU sparse fields offset in a sparse header */
+#define TAR_SPARSE_HDR_EXTENTS              4           /* extents in a sparse header */
+#define TAR_SPARSE_EXT_EXTENTS              21          /* extents in a sparse extension block */
 
 /*
  * TAR header.
@@ -42,38 +115,504 @@ struct tar_header {
   char gname[32];
   char devmajor[8];
   char devminor[8];
-  char prefix[131];
-  char atime[12];
-  char ctime[12];
+  union {
+    struct {
+      char prefix[131];
+      char atime[12];
+      char ctime[12];
+    };
+    char ustar_prefix[155];                   /* POSIX ustar prefix (spans extra times) */
+  };
+};
+
+/*
+ * GNU sparse extent (in sparse headers and extension blocks).
+ */
+struct tar_sparse {
+  char offset[12];
+  char numbytes[12];
+};
+
+/*
+ * GNU sparse header fields (at TAR_SPARSE_HDR_OFFSET of a sparse header).
+ */
+struct tar_sparse_header {
+  struct tar_sparse sparse[TAR_SPARSE_HDR_EXTENTS];
+  char isextended;
+  char realsize[12];
+};
+
+/*
+ * GNU sparse extension block.
+ */
+struct tar_sparse_ext {
+  struct tar_sparse sparse[TAR_SPARSE_EXT_EXTENTS];
+  char isextended;
+};
+
+/*
+ * Sparse member data extent (extents data are packed in the archive, holes are not stored).
+ */
+struct tar_extent {
+  u64                   offset;               /* offset in file */
+  u64                   len;                  /* length */
+  u64                   data_off;             /* offset in member packed data */
+};
+
+/*
+ * Sparse member map.
+ */
+struct tar_sparse_map {
+  u64                   size;                 /* real file size */
+  u32                   nr_extents;           /* number of extents */
+  u32                   max_extents;          /* extents size (while parsing) */
+  struct tar_extent     extents[];            /* extents (sorted by offset) */
+};
+
+/*
+ * Directory entry (children of a directory are stored contiguously).
+ */
+struct tar_dirent {
+  u32                   hash;                 /* child name hash */
+  u32                   ino;                  /* child inode number */
 };
 
 /*
- * TAR entry.
+ * Directory children.
+ * Large directories are hashed : children of bucket b are children[buckets[b]] to children[buckets[b + 1] - 1].
+ */
+struct tar_dir {
+  u32                   nr_children;          /* number of children */
+  u32                   max_children;         /* children size (lazy indexing) */
+  u32                   hash_bits;            /* hash table size (log2, 0 = no hash table) */
+  u32                   *buckets;             /* hash buckets (large directories only) */
+  struct tar_dirent     children[];           /* children */
+};
+
+/*
+ * Extra times (only stored for entries having atime or ctime different from mtime).
+ */
+struct tar_xtime {
+  s64                   atime;                /* last access time */
+  s64                   ctime;                /* creation time */
+};
+
+/*
+ * TAR entry (fits in a cache line).
  */
 struct tar_entry {
-  char                  *name;
-  char                  *linkname;
-  off_t                 data_off;
-  size_t                data_len;
-  mode_t                mode;
-  uid_t                 uid;
-  gid_t                 gid;
-  struct timespec64     atime;
-  struct timespec64     mtime;
-  struct timespec64     ctime;
-  ino_t                 ino;
-  struct list_head      children;
-  struct list_head      list;
-  struct tar_entry      *parent;
+  const char            *name;                /* interned name */
+  union {
+    char                *linkname;            /* symbolic link target (unresolved hard link : "/" + target path) */
+    struct tar_dir      *dir;                 /* directory children */
+    u32                 target;               /* hard link target inode number (resolved hard link) */
+    u32                 nlink;                /* number of names (hard link target, 0 = 1) */
+  };
+  u64                   data_off;             /* data offset in archive */
+  u64                   data_len;             /* data length */
+  s64                   mtime;                /* last modification time */
+  u32                   ino;                  /* inode number */
+  u32                   parent;               /* parent inode number */
+  u32                   uid;                  /* user id */
+  u32                   gid;                  /* group id */
+  u16                   mode;                 /* mode */
+  u16                   name_len;             /* name length */
+  u16                   flags;                /* entry flags */
+  u8                    layer;                /* layer providing the entry (and its data) */
+  u8                    opaque;               /* children from layers below are hidden (0 = not opaque) */
+};
+
+#define TAR_ENTRY_XTIME                     (1 << 0)    /* atime/ctime stored in s_xtimes */
+#define TAR_ENTRY_HIDDEN                    (1 << 1)    /* entry removed by a whiteout or an upper layer */
+#define TAR_ENTRY_COMPLETE                  (1 << 2)    /* all directory children are indexed (lazy indexing) */
+#define TAR_ENTRY_LNKTYPE                   (1 << 3)    /* hard link member, not resolved yet (seen as a symlink) */
+#define TAR_ENTRY_HARDLINK                  (1 << 4)    /* hard link resolved to target inode */
+#define TAR_ENTRY_SPARSE                    (1 << 5)    /* sparse member (map stored in s_sparse) */
+
+/*
+ * Arena chunk.
+ */
+struct tar_arena_chunk {
+  struct tar_arena_chunk *next;               /* next chunk */
+  char                  data[];               /* chunk data */
+};
+
+/*
+ * Arena (bump allocator for entries and names, released in one pass at umount).
+ */
+struct tar_arena {
+  struct tar_arena_chunk *chunks;             /* allocated chunks */
+  char                  *cur;                 /* current chunk free space */
+  size_t                left;                 /* current chunk free space size */
+  size_t                size;                 /* total allocated size */
+  size_t                chunk_size;           /* chunk size */
+};
+
+/*
+ * Interned name.
+ */
+struct tar_name {
+  struct tar_name       *next;                /* next name in dictionary bucket */
+  unsigned int          hash;                 /* name hash */
+  unsigned int          len;                  /* name length */
+  char                  name[];               /* name */
+};
+
+/*
+ * Names dictionary shard.
+ */
+struct tar_names_shard {
+  struct mutex          lock;                 /* protects shard (names are interned by parser workers) */
+  struct tar_name       **table;              /* hash table */
+  unsigned int          bits;                 /* hash table size (log2) */
+  unsigned int          count;                /* number of distinct names */
+  size_t                size;                 /* size of distinct names */
+};
+
+/*
+ * Names dictionary (used to intern names while entries are built, sharded by name hash).
+ */
+struct tar_names {
+  struct tar_names_shard shards[1 << TARFS_NAMES_SHARD_BITS];        /* shards */
+  unsigned int          count;                /* number of distinct names (summed at release) */
+  size_t                size;                 /* size of distinct names (summed at release) */
+};
+
+/*
+ * Archive scanner window.
+ */
+struct tar_scan_window {
+  struct page           *page;                /* window pages */
+  char                  *buf;                 /* window buffer */
+  loff_t                off;                  /* archive offset (-1 = empty window) */
+  size_t                len;                  /* window length */
+  int                   status;               /* read status */
+  bool                  pending;              /* read in flight */
+  struct completion     done;                 /* read completion */
+};
+
+/*
+ * Archive scanner (reads the archive in large windows, next window is read while current one is parsed).
+ */
+struct tar_scan {
+  struct super_block    *sb;                  /* super block */
+  struct file           *file;                /* backing file (file backed archive) */
+  u8                    layer;                /* scanned layer */
+  loff_t                size;                 /* archive size */
+  size_t                win_size;             /* window size */
+  unsigned int          win_order;            /* window pages order */
+  int                   cur;                  /* current window */
+  bool                  defer_checksum;       /* member header checksums are verified by parser workers */
+  struct tar_scan_window win[2];              /* windows */
+};
+
+/*
+ * Raw tar member (located by the sequential pass).
+ */
+struct tar_raw {
+  union {
+    struct tar_header   hdr;                  /* member header */
+    char                block[TARFS_BLOCK_SIZE];              /* member header block */
+  };
+  bool                  check_header;         /* header checksum is still to be verified */
+  off_t                 offset;               /* header offset */
+  off_t                 hdr_off;              /* first header offset (pax and GNU long name headers included) */
+  char                  *long_name;           /* GNU long name (NULL = header name) */
+  char                  *long_link;           /* GNU long link name (NULL = header link name) */
+  off_t                 data_off;             /* data offset (after sparse extension blocks or sparse map) */
+  struct tar_sparse_map *sparse;              /* sparse map (NULL = dense member) */
+  bool                  sparse_in_data;       /* sparse map is stored at start of data (pax sparse 1.0) */
+};
+
+/*
+ * Decoded tar member.
+ */
+struct tar_member {
+  const char            *path;                /* normalized full name */
+  size_t                path_len;             /* full name length */
+  const char            *link;                /* link name (NULL = not a link) */
+  struct tar_sparse_map *sparse;              /* sparse map (NULL = dense member) */
+  u64                   hdr_off;              /* first header offset in archive */
+  u64                   data_off;             /* data offset in archive */
+  u64                   data_len;             /* data length */
+  s64                   mtime;                /* last modification time */
+  s64                   atime;                /* last access time */
+  s64                   ctime;                /* creation time */
+  u32                   uid;                  /* user id */
+  u32                   gid;                  /* group id */
+  u16                   mode;                 /* mode */
+  char                  typeflag;             /* tar type */
+  int                   err;                  /* decode status */
+  struct tar_name       *iname;               /* interned name (prepared by a parser worker, NULL = not prepared) */
+  struct tar_entry      *entry;               /* new entry (prepared by a parser worker, NULL = not prepared) */
+  char                  path_buf[sizeof_field(struct tar_header, ustar_prefix) + 1 + sizeof_field(struct tar_header, name) + 1];
+  char                  link_buf[sizeof_field(struct tar_header, linkname) + 1];
+};
+
+/*
+ * Parser batch (members located sequentially, decoded by a worker, then merged in archive order).
+ */
+struct tar_batch {
+  struct work_struct    work;                 /* decode work */
+  struct completion     done;                 /* decode completion */
+  struct tar_build      *build;               /* build context */
+  struct tar_arena      arena;                /* names and entries prepared by the worker */
+  u32                   nr;                   /* number of members */
+  struct tar_raw        raws[TARFS_PARSE_BATCH];              /* raw members */
+  struct tar_member     members[TARFS_PARSE_BATCH];           /* decoded members */
+};
+
+/*
+ * Tar tree build context (used while scanning the archive).
+ */
+struct tar_build {
+  struct tar_scan       scan;                 /* archive scanner */
+  u8                    layer;                /* layer being scanned */
+  struct tar_entry      **hash_table;         /* (parent, name) hash table (open addressing) */
+  unsigned int          hash_bits;            /* hash table size (log2) */
+  unsigned int          hash_count;           /* number of hashed entries */
+  char                  *chain_path;          /* last resolved directory path */
+  size_t                chain_path_size;      /* last resolved directory path buffer size */
+  unsigned int          chain_len;            /* last resolved directory depth */
+  size_t                chain_end[TARFS_CHAIN_MAX];           /* end of each resolved component */
+  struct tar_entry      *chain[TARFS_CHAIN_MAX];              /* last resolved directory chain */
+  bool                  lazy;                 /* entries are published while scanning */
+  struct tar_entry      **open_dirs;          /* directories of the last member (lazy indexing) */
+  struct tar_entry      **path;               /* directories of the current member (lazy indexing) */
+  u32                   nr_open_dirs;         /* number of open directories */
+  u32                   max_open_dirs;        /* open directories size */
+  unsigned int          nr_threads;           /* number of parser threads */
+  struct workqueue_struct *wq;                /* parser workqueue (NULL = sequential parser) */
+  struct tar_raw        raw;                  /* current raw member (sequential parser) */
+  struct tar_member     member;               /* current decoded member (sequential parser) */
+};
+
+/*
+ * Table retired while indexing lazily (readers may still use it, released at umount).
+ */
+struct tar_retired {
+  struct tar_retired    *next;                /* next retired table */
+  void                  *table;               /* table */
+};
+
+/*
+ * Lazy indexing (mount returns once the root is ready, the archive is scanned in background).
+ * A directory is complete once the scan has left its subtree (archives written in tree order), or at end of scan.
+ */
+struct tar_lazy {
+  bool                  enabled;              /* lazy indexing (lazy mount option) */
+  bool                  done;                 /* scan is over */
+  bool                  unordered;            /* archive is not in tree order (wait for end of scan) */
+  u32                   published;            /* number of published inodes */
+  struct task_struct    *task;                /* scan thread */
+  struct tar_build      *build;               /* build context */
+  wait_queue_head_t     wait;                 /* readers waiting for a directory */
+  struct tar_retired    *retired;             /* retired tables */
+  u64                   start;                /* mount start (ns) */
+  u64                   ready_time;           /* time to mount (ns) */
+  u64                   index_time;           /* time to full index (ns) */
+  atomic64_t            first_open;           /* time to first open (ns, 0 = no open yet) */
+};
+
+/*
+ * Neighbor prefetcher (members following an opened member are read ahead in archive order).
+ */
+struct tar_prefetch {
+  struct workqueue_struct *wq;                /* prefetch workqueue (NULL = disabled) */
+  spinlock_t            lock;                 /* protects budget and last */
+  u32                   members;              /* number of members to prefetch after an opened member */
+  u32                   last;                 /* last queued member */
+  unsigned long         budget;               /* bytes budget per prefetch */
+  atomic_long_t         issued;               /* number of prefetched members */
+  atomic_long_t         hits;                 /* prefetched members opened */
+  atomic_long_t         misses;               /* prefetched members evicted unused */
+  atomic64_t            bytes;                /* prefetched bytes */
+  struct xarray         prefetched;           /* members prefetched, not opened yet (by inode number) */
+};
+
+/*
+ * Range of pages read from a member.
+ */
+struct tar_range {
+  u64                   off;                  /* archive offset of first page */
+  u32                   ino;                  /* member inode number */
+  u32                   index;                /* first page */
+  u32                   nr_pages;             /* number of pages */
+};
+
+/*
+ * Record mode (ranges read from members are logged to a manifest, written at umount).
+ */
+struct tar_record {
+  struct mutex          lock;                 /* protects ranges */
+  struct tar_range      *ranges;              /* recorded ranges (in access order) */
+  u32                   nr;                   /* number of recorded ranges */
+  u32                   max;                  /* ranges size */
+};
+
+/*
+ * Replay mode (manifest ranges are streamed in page cache at mount, in archive order).
+ */
+struct tar_replay {
+  struct tar_range      *ranges;              /* ranges to load (sorted by archive offset) */
+  u32                   nr;                   /* number of ranges */
+  atomic_t              done;                 /* number of loaded ranges */
+  bool                  stopped;              /* replay is over (or disabled) */
+  wait_queue_head_t     wait;                 /* readers waiting for a range */
+  struct task_struct    *task;                /* replay thread */
+};
+
+/*
+ * Content deduplication (identical regular members share the page cache of the first one, in archive order).
+ */
+struct tar_dedup {
+  bool                  enabled;              /* content deduplication (dedup mount option) */
+  bool                  done;                 /* fingerprinting is over */
+  u32                   *canon;               /* canonical inode numbers (indexed by inode number, 0 = unique) */
+  struct task_struct    *task;                /* fingerprinting thread */
+  u64                   nr_members;           /* number of fingerprinted members */
+  u64                   nr_dups;              /* number of duplicate members */
+  u64                   bytes_hashed;         /* fingerprinted bytes */
+  u64                   bytes_saved;          /* duplicate bytes (not cached twice) */
+  u64                   time;                 /* fingerprinting time (ns) */
+  atomic64_t            nr_shared;            /* number of inodes sharing a canonical page cache */
+};
+
+/*
+ * Demand-paged entries of a metadata group (released after readers are done).
+ */
+struct tar_meta_block {
+  struct rcu_head       rcu;                  /* deferred release */
+  u32                   nr;                   /* number of entries */
+  struct tar_entry      entries[];            /* entries (names and link names follow) */
+};
+
+/*
+ * Metadata group (consecutive inodes, i.e. a contiguous run of the archive).
+ */
+struct tar_meta_group {
+  struct list_head      lru;                  /* resident groups (most recently loaded first) */
+  struct tar_meta_block *block;               /* evictable entries (NULL = evicted) */
+  u32                   nr_leaves;            /* number of evictable entries */
+  u32                   pins;                 /* number of in core inodes (group can't be evicted) */
+  bool                  referenced;           /* used since last shrinker pass */
+};
+
+/*
+ * Demand-paged metadata (directories stay resident, other entries are evicted by groups under memory pressure and
+ * rebuilt from their archive headers or from the index on next use).
+ */
+struct tar_meta {
+  bool                  enabled;              /* demand-paged metadata (evict mount option) */
+  bool                  ready;                /* evictable entries released, shrinker registered */
+  struct tar_meta_group *groups;              /* groups (indexed by inode number >> TARFS_META_GROUP_BITS) */
+  u32                   nr_groups;            /* number of groups */
+  u32                   *parents;             /* parents of evictable entries (indexed by inode number, 0 = resident) */
+  u64                   *hdr_offs;            /* members first header offset (indexed by inode number, archive scan) */
+  u32                   max_hdr_offs;         /* headers offsets table size */
+  struct file           *index_file;          /* index file (entries are rebuilt from the index) */
+  loff_t                strtab_off;           /* index string table offset */
+  struct mutex          lock;                 /* serializes group loads */
+  spinlock_t            lru_lock;             /* protects groups blocks, pins and LRU */
+  struct list_head      lru;                  /* resident groups */
+  struct srcu_struct    srcu;                 /* readers of evictable entries */
+  struct shrinker       shrinker;             /* groups shrinker */
+  unsigned long         nr_evictable;         /* number of evictable entries */
+  unsigned long         nr_resident;          /* number of resident evictable entries */
+  atomic_long_t         loads;                /* number of loaded groups */
+  atomic_long_t         evictions;            /* number of evicted groups */
+  atomic64_t            load_time;            /* groups load time (ns) */
+};
+
+/*
+ * Compressed frame (frames are decompressed independently).
+ */
+struct tar_frame {
+  u64                   coff;                 /* compressed offset */
+  u64                   doff;                 /* decompressed offset */
+  u32                   clen;                 /* compressed length */
+  u32                   dlen;                 /* decompressed length */
+};
+
+/*
+ * Decompressed frame (cached).
+ */
+struct tar_frame_buf {
+  struct list_head      lru;                  /* frames cache LRU list */
+  u32                   index;                /* frame index */
+  char                  *data;                /* decompressed data */
+};
+
+/*
+ * Compressed archive (zstd seekable frames or BGZF gzip members).
+ */
+struct tar_compress {
+  struct file           *file;                /* compressed archive file */
+  int                   type;                 /* compression type */
+  struct tar_frame      *frames;              /* frames (sorted by offset) */
+  u32                   nr_frames;            /* number of frames */
+  u32                   max_clen;             /* largest compressed frame */
+  u64                   size;                 /* decompressed archive size */
+  struct mutex          lock;                 /* protects frames cache and decompression context */
+  struct tar_frame_buf  **cache;              /* cached frames (indexed by frame) */
+  struct list_head      lru;                  /* cached frames (most recently used first) */
+  unsigned long         nr_cached;            /* number of cached frames */
+  size_t                cache_size;           /* cached bytes */
+  size_t                cache_max;            /* cached bytes limit */
+  unsigned long         hits;                 /* frames found in cache */
+  unsigned long         misses;               /* frames decompressed */
+  char                  *cbuf;                /* compressed frame buffer */
+  void                  *workspace;           /* decompression workspace */
+  zstd_dctx             *dctx;                /* zstd context */
+  z_stream              zstrm;                /* zlib context */
+  struct shrinker       shrinker;             /* frames cache shrinker */
+};
+
+/*
+ * TarFS mount data (passed to fill_super).
+ */
+struct tarfs_mount_data {
+  char                  *options;             /* mount options */
+  struct file           *file;                /* archive file (NULL = block device) */
+  struct file           *bdev_file;           /* block device file (block device, shared page cache) */
 };
 
 /*
  * TarFS in memory super block.
  */
 struct tarfs_sb_info {
+  struct file           *s_backing_file;      /* archive file (file backed mount, NULL = block device) */
+  struct file           *s_bdev_file;         /* block device file (page cache shared by page aligned members) */
+  atomic64_t            s_shared_bytes;       /* bytes read or mapped from shared page cache */
+  bool                  s_aligned;            /* all regular members are page aligned (tarfs-pack archive) */
+  struct tar_compress   *s_compress;          /* compressed archive (NULL = plain archive) */
+  char                  *s_layers_path;       /* upper layers (layers= mount option) */
+  struct file           **s_layers;           /* upper layers files (indexed by layer, layer 0 = mount source) */
+  u32                   s_nr_layers;          /* number of layers */
   struct tar_entry      *s_root_entry;        /* root TAR entry */
-  struct tar_entry      **s_tar_entries;      /* TAR entries */
-  ino_t                 s_ninodes;            /* number of inodes */
+  struct tar_entry      **s_tar_entries;      /* TAR entries (indexed by inode number) */
+  struct tar_xtime      *s_xtimes;            /* TAR entries extra times (indexed by inode number) */
+  struct tar_sparse_map **s_sparse;           /* sparse members maps (indexed by inode number) */
+  u32                   s_ninodes;            /* number of inodes */
+  u32                   s_max_inodes;         /* TAR entries table size */
+  u32                   s_max_xtimes;         /* extra times table size */
+  u32                   s_max_sparse;         /* sparse maps table size */
+  char                  *s_index_path;        /* index file (index= mount option) */
+  char                  *s_record_path;       /* manifest to record (record= mount option) */
+  char                  *s_replay_path;       /* manifest to replay (replay= mount option) */
+  u64                   s_build_time;         /* tree build time (ns) */
+  unsigned int          s_parse_threads;      /* number of parser threads (threads= mount option, 0 = all CPUs) */
+  bool                  s_checksum;           /* verify headers checksum (nochecksum mount option disables it) */
+  bool                  s_badhdr_skip;        /* skip bad headers instead of ending the scan (badhdr= mount option) */
+  u64                   s_bad_headers;        /* number of bad headers found */
+  struct tar_arena      s_arena;              /* entries and names arena */
+  struct tar_names      s_names;              /* names dictionary */
+  struct tar_prefetch   s_prefetch;           /* neighbor prefetcher */
+  struct tar_record     s_record;             /* record mode */
+  struct tar_replay     s_replay;             /* replay mode */
+  struct tar_lazy       s_lazy;               /* lazy indexing */
+  struct tar_dedup      s_dedup;              /* content deduplication */
+  struct tar_meta       s_meta;               /* demand-paged metadata */
 };
 
 /*
@@ -81,6 +620,7 @@ struct tarfs_sb_info {
  */
 struct tarfs_inode_info {
   struct tar_entry      *entry;               /* TAR entry */
+  struct inode          *dedup;               /* canonical inode (page cache is shared, NULL = own page cache) */
   struct inode          vfs_inode;            /* VFS inode */
 };
 
@@ -91,17 +631,168 @@ extern struct inode_operations tarfs_symlink_iops;
 extern struct file_operations tarfs_dir_fops;
 extern struct file_operations tarfs_file_fops;
 extern struct address_space_operations tarfs_aops;
+extern struct address_space_operations tarfs_backing_aops;
+extern const struct iomap_ops tarfs_iomap_ops;
+extern const struct dentry_operations tarfs_lazy_dops;
 
 /* Tar library prototypes (defined in proc.c) */
 int tar_create(struct super_block *sb);
-void tar_free(struct tar_entry *entry);
-void tar_index(struct super_block *sb, struct tar_entry *entry);
+int tar_index(struct super_block *sb);
+struct tar_entry *tar_alloc_entry(struct super_block *sb, struct tar_name *name, int typeflag, const char *linkname);
+int tar_add_entry(struct super_block *sb, struct tar_entry *parent, struct tar_entry *entry);
+int tar_set_xtime(struct super_block *sb, struct tar_entry *entry, s64 atime, s64 ctime);
+int tar_set_sparse(struct super_block *sb, struct tar_entry *entry, struct tar_sparse_map *map);
+int tar_read_member(struct tar_scan *scan, off_t offset, struct tar_raw *raw, struct tar_member *member);
+int tar_parse_octal(const char *field, size_t size, u64 *val);
+int tar_check_header(const char *block);
+void tar_release_raw(struct tar_raw *raw);
+struct tar_entry *tar_dir_find(struct super_block *sb, struct tar_entry *dir, const char *name, unsigned int len);
+bool tar_check_aligned(struct super_block *sb);
+struct tar_build *tar_build_alloc(struct super_block *sb);
+void tar_build_free(struct tar_build *build);
+int tar_build_layer(struct super_block *sb, struct tar_build *build, u8 layer);
+int tar_hash_dir(struct super_block *sb, struct tar_dir *dir);
+
+/* Arena prototypes (defined in arena.c) */
+void tar_arena_init_chunk(struct tar_arena *arena, size_t chunk_size);
+void tar_arena_init(struct tar_arena *arena);
+void *tar_arena_alloc(struct tar_arena *arena, size_t size);
+char *tar_arena_strndup(struct tar_arena *arena, const char *s, size_t len);
+void tar_arena_merge(struct tar_arena *dst, struct tar_arena *src);
+void tar_arena_free(struct tar_arena *arena);
+
+/* Names dictionary prototypes (defined in names.c) */
+int tar_names_init(struct tar_names *names);
+void tar_names_release(struct tar_names *names);
+struct tar_name *tar_names_intern(struct tar_names *names, struct tar_arena *arena, const char *str, size_t len);
+struct tar_name *tar_intern_name(struct super_block *sb, const char *str, size_t len);
+
+/* Archive scanner prototypes (defined in scan.c) */
+int tar_scan_init(struct tar_scan *scan, struct super_block *sb, u8 layer);
+int tar_scan_init_window(struct tar_scan *scan, struct super_block *sb, u8 layer, size_t win_size);
+void tar_scan_exit(struct tar_scan *scan);
+const char *tar_scan_read(struct tar_scan *scan, loff_t off);
+const char *tar_scan_read_range(struct tar_scan *scan, loff_t off, size_t *len);
+loff_t tar_archive_size(struct super_block *sb);
+int tar_archive_read(struct super_block *sb, void *buf, size_t len, loff_t off);
+loff_t tar_layer_size(struct super_block *sb, u8 layer);
+int tar_layer_read(struct super_block *sb, u8 layer, void *buf, size_t len, loff_t off);
+int tar_layer_read_iter(struct super_block *sb, u8 layer, struct iov_iter *iter, size_t len, loff_t off);
+
+/* Compressed archive prototypes (defined in compress.c) */
+int tar_compress_init(struct super_block *sb);
+void tar_compress_exit(struct super_block *sb);
+int tar_compress_read(struct super_block *sb, void *buf, size_t len, loff_t off);
+void tar_compress_show_stats(struct seq_file *seq, struct super_block *sb);
+
+/* Sparse members prototypes (defined in sparse.c) */
+int tar_sparse_parse_gnu(struct tar_scan *scan, struct tar_raw *raw);
+int tar_sparse_parse_pax(struct tar_raw *raw, const char *key, size_t key_len, const char *val, size_t val_len,
+                         u64 *offset);
+int tar_sparse_read_map(struct tar_scan *scan, struct tar_raw *raw, size_t *data_len);
+int tar_sparse_check(struct tar_sparse_map *map, u64 data_len);
+void tar_sparse_release(struct tar_raw *raw);
+u64 tar_sparse_data_len(struct inode *inode);
+int tar_sparse_read(struct inode *inode, struct iov_iter *iter, size_t len, loff_t pos);
+loff_t tar_sparse_llseek(struct file *file, loff_t offset, int whence);
+
+/* Tar index prototypes (defined in index.c) */
+int tar_load_index(struct super_block *sb, const char *path);
+
+/* Prefetch prototypes (defined in prefetch.c) */
+int tar_prefetch_init(struct super_block *sb);
+void tar_prefetch_exit(struct super_block *sb);
+void tar_prefetch_neighbors(struct inode *inode);
+void tar_prefetch_evict(struct inode *inode);
+void tar_prefetch_show_stats(struct seq_file *seq, struct super_block *sb);
+void tar_readahead_member(struct inode *inode, pgoff_t index, unsigned long nr_pages);
+
+/* Manifest prototypes (defined in manifest.c) */
+void tar_record_init(struct tar_record *record);
+void tar_record_range(struct inode *inode, pgoff_t index, unsigned long nr_pages);
+int tar_record_write(struct super_block *sb);
+void tar_record_release(struct tar_record *record);
+void tar_replay_init(struct tar_replay *replay);
+void tar_replay_start(struct super_block *sb);
+void tar_replay_stop(struct super_block *sb);
+void tar_replay_wait(struct inode *inode, loff_t pos, size_t count);
+void tar_manifest_show_stats(struct seq_file *seq, struct super_block *sb);
+
+/* Lazy indexing prototypes (defined in lazy.c) */
+void tar_lazy_init(struct tar_lazy *lazy);
+int tar_lazy_prepare(struct super_block *sb);
+int tar_lazy_start(struct super_block *sb);
+void tar_lazy_stop(struct super_block *sb);
+void tar_lazy_release(struct super_block *sb);
+void tar_lazy_retire(struct super_block *sb, void *table);
+int tar_lazy_publish(struct super_block *sb, struct tar_entry *parent, struct tar_entry *entry);
+int tar_lazy_track(struct super_block *sb, struct tar_build *build, struct tar_entry *entry);
+int tar_lazy_wait(struct super_block *sb, struct tar_entry *dir);
+bool tar_lazy_negative_valid(struct super_block *sb);
+void tar_lazy_open(struct super_block *sb);
+void tar_lazy_show_stats(struct seq_file *seq, struct super_block *sb);
+
+/* Demand-paged metadata prototypes (defined in meta.c) */
+void tar_meta_init(struct tar_meta *meta);
+int tar_meta_prepare(struct super_block *sb);
+void tar_meta_release(struct super_block *sb);
+struct tar_entry *tar_meta_load(struct super_block *sb, u32 ino);
+struct tar_entry *tar_meta_pin(struct super_block *sb, u32 ino);
+void tar_meta_unpin(struct super_block *sb, u32 ino);
+void tar_meta_touch(struct super_block *sb, u32 ino);
+void tar_meta_show_stats(struct seq_file *seq, struct super_block *sb);
+
+/* Content deduplication prototypes (defined in dedup.c) */
+void tar_dedup_init(struct tar_dedup *dedup);
+void tar_dedup_start(struct super_block *sb);
+void tar_dedup_stop(struct super_block *sb);
+void tar_dedup_release(struct super_block *sb);
+void tar_dedup_inode(struct inode *inode);
+void tar_dedup_evict(struct inode *inode);
+void tar_dedup_show_stats(struct seq_file *seq, struct super_block *sb);
+
+/* TarFS ioctl prototypes (defined in ioctl.c) */
+long tarfs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /* TarFS inode prototypes (defined in inode.c) */
 struct inode *tarfs_iget(struct super_block *sb, ino_t ino);
 int tarfs_getattr(struct user_namespace *mnt_userns, const struct path *path,
                   struct kstat *stat, u32 request_mask, unsigned int flags);
 
+/*
+ * Convert tar type to POSIX.
+ */
+static inline mode_t tar_type_to_posix(int typeflag)
+{
+  switch(typeflag) {
+    case TAR_REGTYPE:
+    case TAR_AREGTYPE:
+    case TAR_GNUTYPE_SPARSE:
+      return S_IFREG;
+    case TAR_DIRTYPE:
+      return S_IFDIR;
+    case TAR_SYMTYPE:
+    case TAR_LNKTYPE:
+      return S_IFLNK;
+    case TAR_CHRTYPE:
+      return S_IFCHR;
+    case TAR_BLKTYPE:
+      return S_IFBLK;
+    case TAR_FIFOTYPE:
+      return S_IFIFO;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Hash a TAR entry name.
+ */
+static inline unsigned int tar_name_hash(const char *name, unsigned int len)
+{
+  return full_name_hash(NULL, name, len);
+}
+
 /*
  * Get TarFS in memory super block from generic super block.
  */
@@ -110,6 +801,62 @@ static inline struct tarfs_sb_info *tarfs_sb(struct super_block *sb)
   return sb->s_fs_info;
 }
 
+/*
+ * Get a TAR entry interned name.
+ */
+static inline struct tar_name *tar_entry_name(struct tar_entry *entry)
+{
+  return container_of(entry->name, struct tar_name, name[0]);
+}
+
+/*
+ * Get a TAR entry by its inode number.
+ */
+static inline struct tar_entry *tar_get_entry(struct super_block *sb, u32 ino)
+{
+  /* entries table may be replaced while indexing lazily */
+  struct tar_entry *entry = READ_ONCE(READ_ONCE(tarfs_sb(sb)->s_tar_entries)[ino]);
+
+  /* demand-paged metadata : load evicted entry (NULL on error, readers must hold tar_meta_read_lock) */
+  if (unlikely(!entry) && tarfs_sb(sb)->s_meta.enabled)
+    return tar_meta_load(sb, ino);
+
+  return entry;
+}
+
+/*
+ * Start using entries (evicted entries are released once all readers are done).
+ */
+static inline int tar_meta_read_lock(struct super_block *sb)
+{
+  return tarfs_sb(sb)->s_meta.ready ? srcu_read_lock(&tarfs_sb(sb)->s_meta.srcu) : 0;
+}
+
+/*
+ * Stop using entries.
+ */
+static inline void tar_meta_read_unlock(struct super_block *sb, int idx)
+{
+  if (tarfs_sb(sb)->s_meta.ready)
+    srcu_read_unlock(&tarfs_sb(sb)->s_meta.srcu, idx);
+}
+
+/*
+ * Get the entry holding the inode of a name (a hard link shares its target inode).
+ */
+static inline struct tar_entry *tar_link_target(struct super_block *sb, struct tar_entry *entry)
+{
+  return (entry->flags & TAR_ENTRY_HARDLINK) ? tar_get_entry(sb, entry->target) : entry;
+}
+
+/*
+ * Get number of published inodes (inodes which can be looked up).
+ */
+static inline u32 tar_published_inodes(struct super_block *sb)
+{
+  return smp_load_acquire(&tarfs_sb(sb)->s_lazy.published);
+}
+
 /*
  * Get TarFS in memory inode from generic inode.
  */
@@ -118,4 +865,40 @@ static inline struct tarfs_inode_info *tarfs_i(struct inode *inode)
   return container_of(inode, struct tarfs_inode_info, vfs_inode);
 }
 
+/*
+ * Check if an inode data is page aligned in the archive (no per member check on aligned archives).
+ */
+static inline bool tar_data_aligned(struct inode *inode)
+{
+  return tarfs_sb(inode->i_sb)->s_aligned || PAGE_ALIGNED(tarfs_i(inode)->entry->data_off);
+}
+
+/*
+ * Get the file whose page cache holds an inode data (NULL = data is cached in inode mapping).
+ * File backed archives and upper layers always read through the archive file (unless compressed or sparse), page
+ * aligned members of a block device are read through the block device page cache.
+ */
+static inline struct file *tar_shared_file(struct inode *inode)
+{
+  struct tarfs_sb_info *sbi = tarfs_sb(inode->i_sb);
+  u8 layer = tarfs_i(inode)->entry->layer;
+
+  if (tarfs_i(inode)->entry->flags & TAR_ENTRY_SPARSE)
+    return NULL;
+
+  if (layer)
+    return sbi->s_layers[layer];
+
+  if (sbi->s_compress)
+    return NULL;
+
+  if (sbi->s_backing_file)
+    return sbi->s_backing_file;
+
+  if (sbi->s_bdev_file && S_ISREG(inode->i_mode) && tar_data_aligned(inode))
+    return sbi->s_bdev_file;
+
+  return NULL;
+}
+
 #endif
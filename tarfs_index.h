@@ -0,0 +1,70 @@
+#ifndef _TARFS_INDEX_H_
+#define _TARFS_INDEX_H_
+
+/*
+ * TarFS archive index format (shared by the kernel module and tools/tarfs-index).
+ *
+ * An index file is made of :
+ *   - a super block (struct tarfs_index_super)
+ *   - nr_entries entries (struct tarfs_index_entry), in inode order (entry i = inode i + 1)
+ *   - a string table of strtab_size bytes (null terminated names and link names)
+ *
+ * All fields are little endian.
+ */
+#include <linux/types.h>
+
+#define TARFS_INDEX_MAGIC                   0x58494654    /* "TFIX" */
+#define TARFS_INDEX_VERSION                 2
+
+/*
+ * Index super block.
+ */
+struct tarfs_index_super {
+  __le32                magic;                /* TARFS_INDEX_MAGIC */
+  __le32                version;              /* TARFS_INDEX_VERSION */
+  __le64                archive_size;         /* offset of the end of archive block */
+  __le64                file_size;            /* archive file size */
+  __le64                first_hdr_hash;       /* hash of the first archive block */
+  __le64                last_hdr_off;         /* offset of the last parsed header */
+  __le64                last_hdr_hash;        /* hash of the last parsed header */
+  __le32                nr_entries;           /* number of entries (root included) */
+  __le32                strtab_size;          /* string table size */
+};
+
+/*
+ * Index entry.
+ */
+struct tarfs_index_entry {
+  __le64                data_off;             /* data offset in archive */
+  __le64                data_len;             /* data length */
+  __le64                mtime;                /* last modification time */
+  __le64                atime;                /* last access time */
+  __le64                ctime;                /* creation time */
+  __le32                parent;               /* parent entry index (root = 0 = its own parent) */
+  __le32                mode;                 /* permission bits */
+  __le32                uid;                  /* user id */
+  __le32                gid;                  /* group id */
+  __le32                name_off;             /* name offset in string table */
+  __le32                link_off;             /* link name offset in string table (0 = no link name) */
+  __u8                  typeflag;             /* tar type flag */
+  __u8                  pad[7];
+};
+
+/*
+ * Hash an archive block (FNV-1a), used to detect stale indexes.
+ */
+static inline __u64 tarfs_index_hash(const void *buf, unsigned int len)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  __u64 hash = 0xcbf29ce484222325ULL;
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _TARFS_IOCTL_H_
+#define _TARFS_IOCTL_H_
+
+/*
+ * TarFS ioctls (shared by the kernel module and tools/tarfs-walk).
+ *
+ * TARFS_IOC_WALK, on a directory, fills a buffer with the metadata of its whole subtree (directory itself excluded),
+ * in preorder : a record always follows the record of its parent, so paths are rebuilt from parent inode numbers.
+ * The walk is resumed with the returned cookie until TARFS_WALK_DONE is set. No inode or dentry is created.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define TARFS_IOC_MAGIC                     'T'
+#define TARFS_IOC_WALK                      _IOWR(TARFS_IOC_MAGIC, 1, struct tarfs_walk)
+
+#define TARFS_WALK_DONE                     (1 << 0)    /* whole subtree has been walked */
+
+/*
+ * Walk request.
+ */
+struct tarfs_walk {
+  __u64                 cookie;               /* in : resume cookie (0 = start), out : next cookie */
+  __u64                 buf;                  /* user buffer */
+  __u32                 buf_size;             /* user buffer size */
+  __u32                 nr_records;           /* out : number of records in buffer */
+  __u32                 flags;                /* out : TARFS_WALK_* flags */
+  __u32                 pad;
+};
+
+/*
+ * Walk record (records are 8 bytes aligned, use rec_len to get the next one).
+ */
+struct tarfs_walk_record {
+  __u64                 size;                 /* data length */
+  __u64                 data_off;             /* data offset in archive (in layer archive) */
+  __s64                 mtime;                /* last modification time */
+  __u32                 ino;                  /* inode number (hard links share their target inode number) */
+  __u32                 parent;               /* parent inode number */
+  __u32                 mode;                 /* mode */
+  __u32                 uid;                  /* user id */
+  __u32                 gid;                  /* group id */
+  __u32                 layer;                /* layer providing the entry */
+  __u16                 rec_len;              /* record length */
+  __u16                 name_len;             /* name length */
+  char                  name[];               /* name (null terminated) */
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _TARFS_MANIFEST_H_
+#define _TARFS_MANIFEST_H_
+
+/*
+ * TarFS prefetch manifest format (written with the record= mount option, read with the replay= mount option).
+ *
+ * A manifest file is made of :
+ *   - a header (struct tarfs_manifest_header)
+ *   - nr_records records (struct tarfs_manifest_record), in access order
+ *
+ * All fields are little endian.
+ */
+#include <linux/types.h>
+
+#define TARFS_MANIFEST_MAGIC                0x464d4654    /* "TFMF" */
+#define TARFS_MANIFEST_VERSION              1
+
+/*
+ * Manifest header.
+ */
+struct tarfs_manifest_header {
+  __le32                magic;                /* TARFS_MANIFEST_MAGIC */
+  __le32                version;              /* TARFS_MANIFEST_VERSION */
+  __le32                nr_records;           /* number of records */
+  __le32                pad;
+};
+
+/*
+ * Manifest record (a range of pages read from a member).
+ */
+struct tarfs_manifest_record {
+  __le64                data_off;             /* member data offset in archive (used to detect stale manifests) */
+  __le32                ino;                  /* member inode number */
+  __le32                index;                /* first page */
+  __le32                nr_pages;             /* number of pages */
+  __le32                pad;
+};
+
+#endif
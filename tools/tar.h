@@ -0,0 +1,173 @@
+#ifndef _TOOLS_TAR_H_
+#define _TOOLS_TAR_H_
+
+/*
+ * Userspace TAR helpers (mirror the kernel parser in proc.c).
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+
+#define TAR_BLOCK_SIZE                      512
+#define TAR_ALIGN_UP(x)                     (((x) + TAR_BLOCK_SIZE - 1) & ~((uint64_t) TAR_BLOCK_SIZE - 1))
+
+#define TAR_MAGIC_STR                       "ustar "
+#define TAR_USTAR_MAGIC_STR                 "ustar"
+#define TAR_USTAR_VERSION                   "00"
+
+#define TAR_ALIGNED_MARKER                  "comment=tarfs-aligned="
+
+#define TAR_REGTYPE                         '0'
+#define TAR_AREGTYPE                        '\0'
+#define TAR_LNKTYPE                         '1'
+#define TAR_SYMTYPE                         '2'
+#define TAR_CHRTYPE                         '3'
+#define TAR_BLKTYPE                         '4'
+#define TAR_DIRTYPE                         '5'
+#define TAR_FIFOTYPE                        '6'
+#define TAR_CONTTYPE                        '7'
+#define TAR_LONGNAME                        'L'
+#define TAR_LONGLINK                        'K'
+#define TAR_XHDTYPE                         'x'
+#define TAR_XGLTYPE                         'g'
+#define TAR_GNUTYPE_SPARSE                  'S'
+
+#define TAR_FORMAT_GNU                      0
+#define TAR_FORMAT_USTAR                    1
+#define TAR_FORMAT_V7                       2
+
+/*
+ * TAR header (same layout as struct tar_header in tarfs.h).
+ */
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  union {
+    struct {
+      char prefix[131];
+      char atime[12];
+      char ctime[12];
+    };
+    char ustar_prefix[155];                   /* POSIX ustar prefix (spans extra times) */
+  };
+};
+
+/*
+ * Parse an octal header field (same rules as tar_parse_octal() in proc.c : padded with spaces or NUL).
+ */
+static inline int tar_octal(const char *field, size_t len, uint64_t *res)
+{
+  uint64_t val = 0;
+  size_t i = 0;
+
+  while (i < len && field[i] == ' ')
+    i++;
+  if (i == len || field[i] < '0' || field[i] > '7')
+    return -EINVAL;
+
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+    if (val >> 61)
+      return -ERANGE;
+    val = (val << 3) | (field[i] - '0');
+  }
+
+  for (; i < len; i++)
+    if (field[i] != ' ' && field[i] != '\0')
+      return -EINVAL;
+
+  *res = val;
+  return 0;
+}
+
+/*
+ * Get a header format (same rules as tar_header_format() in proc.c, -EINVAL = unknown magic).
+ */
+static inline int tar_header_format(const struct tar_header *hdr)
+{
+  size_t i;
+
+  if (!memcmp(hdr->magic, TAR_MAGIC_STR, sizeof(hdr->magic)))
+    return TAR_FORMAT_GNU;
+
+  if (!memcmp(hdr->magic, TAR_USTAR_MAGIC_STR, sizeof(hdr->magic))
+      && !memcmp(hdr->version, TAR_USTAR_VERSION, sizeof(hdr->version)))
+    return TAR_FORMAT_USTAR;
+
+  for (i = 0; i < sizeof(hdr->magic) && !hdr->magic[i]; i++);
+  return i == sizeof(hdr->magic) ? TAR_FORMAT_V7 : -EINVAL;
+}
+
+/*
+ * Check a header checksum (unsigned or signed sum, checksum field summed as spaces, a zero block fails).
+ */
+static inline int tar_check_header(const struct tar_header *hdr)
+{
+  const unsigned char *block = (const unsigned char *) hdr;
+  uint64_t sum = 0, ssum = 0, chksum;
+  size_t i;
+
+  for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+    if (i >= offsetof(struct tar_header, chksum) && i < offsetof(struct tar_header, chksum) + sizeof(hdr->chksum)) {
+      sum += ' ';
+      ssum += ' ';
+    } else {
+      sum += block[i];
+      ssum += (signed char) block[i];
+    }
+  }
+
+  if (tar_octal(hdr->chksum, sizeof(hdr->chksum), &chksum) || (chksum != sum && chksum != (uint32_t) ssum))
+    return -EINVAL;
+
+  return 0;
+}
+
+/*
+ * Normalize a path in place (same rules as tar_normalize_path() in proc.c).
+ */
+static inline size_t tar_normalize_path(char *path)
+{
+  char *src = path, *dst = path, *end;
+  size_t len;
+
+  while (*src) {
+    /* skip '/' */
+    for (; *src == '/'; src++);
+    if (!*src)
+      break;
+
+    /* find component end */
+    end = strchrnul(src, '/');
+    len = end - src;
+
+    /* copy component (skip ".") */
+    if (len != 1 || *src != '.') {
+      if (dst != path)
+        *dst++ = '/';
+      memmove(dst, src, len);
+      dst += len;
+    }
+
+    src = end;
+  }
+
+  *dst = 0;
+  return dst - path;
+}
+
+#endif
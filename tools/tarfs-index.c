@@ -0,0 +1,473 @@
+/*
+ * tarfs-index : build a TarFS index file for a tar archive.
+ *
+ * Usage : tarfs-index <archive.tar> <index file>
+ *
+ * The index is loaded at mount time with the "index=<index file>" option, so the kernel
+ * does not have to scan every archive header.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "tar.h"
+#include "tarfs_index.h"
+
+#define HASH_BITS                           16
+#define HASH_SIZE                           (1 << HASH_BITS)
+
+/*
+ * Index entry being built.
+ */
+struct entry {
+  char                  *name;
+  char                  *linkname;
+  uint64_t              data_off;
+  uint64_t              data_len;
+  uint64_t              mtime;
+  uint64_t              atime;
+  uint64_t              ctime;
+  uint32_t              parent;
+  uint32_t              mode;
+  uint32_t              uid;
+  uint32_t              gid;
+  char                  typeflag;
+  int32_t               hash_next;
+};
+
+static struct entry *entries;
+static uint32_t nr_entries, max_entries;
+static int32_t hash_table[HASH_SIZE];
+
+/*
+ * Hash a (parent, name) key.
+ */
+static uint32_t key_hash(uint32_t parent, const char *name)
+{
+  uint32_t hash = parent * 0x9e3779b1;
+
+  for (; *name; name++)
+    hash = (hash ^ (unsigned char) *name) * 0x01000193;
+
+  return hash & (HASH_SIZE - 1);
+}
+
+/*
+ * Read an archive block.
+ */
+static int read_block(FILE *fp, uint64_t offset, void *buf)
+{
+  if (fseeko(fp, offset, SEEK_SET) != 0 || fread(buf, TAR_BLOCK_SIZE, 1, fp) != 1)
+    return -EIO;
+
+  return 0;
+}
+
+/*
+ * Get or create an entry (same semantics as tar_get_or_create_entry() in proc.c).
+ */
+static int get_or_create_entry(uint32_t parent, const char *name, const char *linkname, struct tar_header *hdr,
+                               uint64_t offset, uint32_t *res)
+{
+  uint32_t hash = key_hash(parent, name);
+  uint64_t mode, uid, gid;
+  struct entry *entry;
+  int32_t i;
+
+  /* check if entry already exist */
+  if (nr_entries) {
+    for (i = hash_table[hash]; i >= 0; i = entries[i].hash_next) {
+      if (entries[i].parent == parent && strcmp(entries[i].name, name) == 0) {
+        *res = i;
+        return 0;
+      }
+    }
+  }
+
+  /* grow entries */
+  if (nr_entries == max_entries) {
+    max_entries = max_entries ? max_entries * 2 : 1024;
+    entries = realloc(entries, sizeof(struct entry) * max_entries);
+    if (!entries)
+      return -ENOMEM;
+  }
+
+  /* create new entry */
+  entry = &entries[nr_entries];
+  memset(entry, 0, sizeof(struct entry));
+  entry->parent = parent;
+  entry->name = strdup(name);
+  entry->linkname = strdup(linkname ? linkname : "");
+  if (!entry->name || !entry->linkname)
+    return -ENOMEM;
+
+  /* parse tar header */
+  if (hdr) {
+    entry->typeflag = hdr->typeflag;
+    entry->data_off = offset + TAR_BLOCK_SIZE;
+    if (tar_octal(hdr->size, sizeof(hdr->size), &entry->data_len)
+        || tar_octal(hdr->mtime, sizeof(hdr->mtime), &entry->mtime))
+      return -EINVAL;
+
+    if (tar_octal(hdr->mode, sizeof(hdr->mode), &mode)
+        || tar_octal(hdr->uid, sizeof(hdr->uid), &uid)
+        || tar_octal(hdr->gid, sizeof(hdr->gid), &gid))
+      return -EINVAL;
+    entry->mode = mode;
+    entry->uid = uid;
+    entry->gid = gid;
+
+    /* extra times are only stored in GNU headers (ustar prefix overlaps them) */
+    if (tar_header_format(hdr) != TAR_FORMAT_GNU || tar_octal(hdr->atime, sizeof(hdr->atime), &entry->atime))
+      entry->atime = entry->mtime;
+    if (tar_header_format(hdr) != TAR_FORMAT_GNU || tar_octal(hdr->ctime, sizeof(hdr->ctime), &entry->ctime))
+      entry->ctime = entry->mtime;
+  } else {
+    entry->typeflag = TAR_DIRTYPE;
+    entry->mode = 0755;
+  }
+
+  /* hash entry */
+  entry->hash_next = nr_entries ? hash_table[hash] : -1;
+  hash_table[hash] = nr_entries;
+
+  *res = nr_entries++;
+  return 0;
+}
+
+/*
+ * Read a long name (stored in data blocks). Offset is updated to point to the real header.
+ */
+static char *build_long_name(FILE *fp, struct tar_header *hdr, uint64_t *offset)
+{
+  uint64_t len, pos;
+  char *name;
+
+  if (tar_octal(hdr->size, sizeof(hdr->size), &len) || len == 0)
+    return NULL;
+
+  name = malloc(TAR_ALIGN_UP(len) + 1);
+  if (!name)
+    return NULL;
+
+  /* read name blocks */
+  for (pos = 0, *offset += TAR_BLOCK_SIZE; pos < len; pos += TAR_BLOCK_SIZE, *offset += TAR_BLOCK_SIZE) {
+    if (read_block(fp, *offset, name + pos)) {
+      free(name);
+      return NULL;
+    }
+  }
+
+  /* end name and remove last '/' */
+  name[len] = 0;
+  if (name[len - 1] == '/')
+    name[len - 1] = 0;
+
+  /* read real header */
+  if (read_block(fp, *offset, hdr)) {
+    free(name);
+    return NULL;
+  }
+
+  return name;
+}
+
+/*
+ * Read pax records of a member header (same rules as tar_parse_pax() in proc.c) : path and linkpath are returned,
+ * sparse records are not supported.
+ */
+static int read_pax_records(FILE *fp, uint64_t offset, uint64_t len, char **path, char **linkpath)
+{
+  char *records, *p, *end, *key, *val, **name;
+  uint64_t pos, rec_len;
+  int err = -EINVAL;
+
+  records = malloc(TAR_ALIGN_UP(len));
+  if (!records)
+    return -ENOMEM;
+
+  for (pos = 0; pos < len; pos += TAR_BLOCK_SIZE) {
+    if (read_block(fp, offset + pos, records + pos)) {
+      free(records);
+      return -EIO;
+    }
+  }
+
+  /* records are "<length> <key>=<value>\n" */
+  for (p = records, end = records + len; p < end && *p; p += rec_len) {
+    for (rec_len = 0, key = p; key < end && *key >= '0' && *key <= '9' && rec_len <= len; key++)
+      rec_len = rec_len * 10 + *key - '0';
+    if (key == p || key == end || *key != ' ' || rec_len > (uint64_t) (end - p) || rec_len <= (uint64_t) (key + 1 - p))
+      goto out;
+
+    key++;
+    val = memchr(key, '=', p + rec_len - key);
+    if (!val || p[rec_len - 1] != '\n')
+      goto out;
+    *val++ = 0;
+
+    if (!strncmp(key, "GNU.sparse.", strlen("GNU.sparse."))) {
+      err = -ENOTSUP;
+      goto out;
+    }
+
+    name = !strcmp(key, "path") ? path : !strcmp(key, "linkpath") ? linkpath : NULL;
+    if (name) {
+      free(*name);
+      *name = strndup(val, p + rec_len - 1 - val);
+      if (!*name) {
+        err = -ENOMEM;
+        goto out;
+      }
+    }
+  }
+
+  err = 0;
+out:
+  free(records);
+  return err;
+}
+
+/*
+ * Parse an archive entry. Returns the real header offset in *hdr_off.
+ */
+static int parse_entry(FILE *fp, uint64_t *offset, uint64_t *hdr_off)
+{
+  static char *pax_path, *pax_linkpath;
+  char *full_name = NULL, *link_name = NULL, *start, *end;
+  size_t prefix_len, name_len;
+  struct tar_header hdr;
+  uint32_t parent, idx;
+  uint64_t data_len;
+  int format, err = -EINVAL;
+
+  if (read_block(fp, *offset, &hdr))
+    return -EIO;
+
+  /* check magic string (GNU, POSIX ustar or v7 : v7 headers have no magic, they are identified by their checksum) */
+  format = tar_header_format(&hdr);
+  if (format < 0 || (format == TAR_FORMAT_V7 && tar_check_header(&hdr)))
+    return -EINVAL;
+
+  /* sparse members maps are not stored in index files */
+  if (hdr.typeflag == TAR_GNUTYPE_SPARSE)
+    return -ENOTSUP;
+
+  /* pax headers : keep path and link path for the next header (same as the kernel, global headers are ignored) */
+  if (hdr.typeflag == TAR_XHDTYPE || hdr.typeflag == TAR_XGLTYPE) {
+    if (tar_octal(hdr.size, sizeof(hdr.size), &data_len))
+      return -EINVAL;
+    if (hdr.typeflag == TAR_XHDTYPE && data_len) {
+      err = read_pax_records(fp, *offset + TAR_BLOCK_SIZE, data_len, &pax_path, &pax_linkpath);
+      if (err)
+        return err;
+    }
+    *offset = TAR_ALIGN_UP(*offset + TAR_BLOCK_SIZE + data_len);
+    return 0;
+  }
+
+  /* build link name */
+  if (hdr.typeflag == TAR_LNKTYPE || hdr.typeflag == TAR_SYMTYPE || hdr.typeflag == TAR_LONGLINK) {
+    if (hdr.typeflag == TAR_LONGLINK) {
+      link_name = build_long_name(fp, &hdr, offset);
+    } else if (pax_linkpath) {
+      link_name = pax_linkpath;
+      pax_linkpath = NULL;
+    } else if (hdr.linkname[0]) {
+      link_name = strndup(hdr.linkname, sizeof(hdr.linkname));
+    }
+    if (!link_name)
+      return -EINVAL;
+  }
+
+  /* build full name */
+  if (hdr.typeflag == TAR_LONGNAME) {
+    full_name = build_long_name(fp, &hdr, offset);
+  } else if (pax_path) {
+    full_name = pax_path;
+    pax_path = NULL;
+  } else {
+    prefix_len = 0;
+    if (format == TAR_FORMAT_USTAR)
+      prefix_len = strnlen(hdr.ustar_prefix, sizeof(hdr.ustar_prefix));
+    else if (format == TAR_FORMAT_GNU)
+      prefix_len = strnlen(hdr.prefix, sizeof(hdr.prefix));
+    name_len = strnlen(hdr.name, sizeof(hdr.name));
+    full_name = prefix_len + name_len ? malloc(prefix_len + name_len + 2) : NULL;
+    if (full_name) {
+      memcpy(full_name, hdr.ustar_prefix, prefix_len);
+      full_name[prefix_len] = '/';
+      memcpy(full_name + prefix_len + 1, hdr.name, name_len);
+      full_name[prefix_len + 1 + name_len] = 0;
+    }
+
+    /* v7 directories are regular members with a trailing slash */
+    if (format == TAR_FORMAT_V7 && (hdr.typeflag == TAR_REGTYPE || hdr.typeflag == TAR_AREGTYPE)
+        && name_len && hdr.name[name_len - 1] == '/')
+      hdr.typeflag = TAR_DIRTYPE;
+  }
+  if (!full_name)
+    goto out;
+
+  /* parse full name (an empty path is the root itself) */
+  tar_normalize_path(full_name);
+  for (start = full_name, parent = 0, err = 0; *start;) {
+    end = strchr(start, '/');
+    if (end)
+      *end = 0;
+
+    err = get_or_create_entry(parent, start, end ? NULL : link_name, end ? NULL : &hdr, *offset, &idx);
+    if (err || !end)
+      break;
+
+    start = end + 1;
+    parent = idx;
+  }
+  if (err)
+    goto out;
+
+  /* go to next header */
+  *hdr_off = *offset;
+  if (tar_octal(hdr.size, sizeof(hdr.size), &data_len)) {
+    err = -EINVAL;
+    goto out;
+  }
+  *offset = TAR_ALIGN_UP(*offset + TAR_BLOCK_SIZE + data_len);
+out:
+  free(full_name);
+  free(link_name);
+  free(pax_path);
+  free(pax_linkpath);
+  pax_path = pax_linkpath = NULL;
+  return err;
+}
+
+/*
+ * Write index file.
+ */
+static int write_index(FILE *fp, FILE *out, uint64_t archive_size, uint64_t last_hdr_off)
+{
+  struct tarfs_index_super isb;
+  struct tarfs_index_entry ie;
+  char block[TAR_BLOCK_SIZE];
+  uint32_t i, strtab_size;
+  struct entry *entry;
+
+  /* compute string table size (starts with an empty string) */
+  for (i = 0, strtab_size = 1; i < nr_entries; i++)
+    strtab_size += strlen(entries[i].name) + 1 + (entries[i].linkname[0] ? strlen(entries[i].linkname) + 1 : 0);
+
+  /* write super block */
+  memset(&isb, 0, sizeof(isb));
+  isb.magic = htole32(TARFS_INDEX_MAGIC);
+  isb.version = htole32(TARFS_INDEX_VERSION);
+  isb.archive_size = htole64(archive_size);
+  if (fseeko(fp, 0, SEEK_END) != 0)
+    return -EIO;
+  isb.file_size = htole64(ftello(fp));
+  isb.last_hdr_off = htole64(last_hdr_off);
+  isb.nr_entries = htole32(nr_entries);
+  isb.strtab_size = htole32(strtab_size);
+
+  if (read_block(fp, 0, block))
+    return -EIO;
+  isb.first_hdr_hash = htole64(tarfs_index_hash(block, TAR_BLOCK_SIZE));
+  if (read_block(fp, last_hdr_off, block))
+    return -EIO;
+  isb.last_hdr_hash = htole64(tarfs_index_hash(block, TAR_BLOCK_SIZE));
+
+  if (fwrite(&isb, sizeof(isb), 1, out) != 1)
+    return -EIO;
+
+  /* write entries */
+  for (i = 0, strtab_size = 1; i < nr_entries; i++) {
+    entry = &entries[i];
+
+    memset(&ie, 0, sizeof(ie));
+    ie.data_off = htole64(entry->data_off);
+    ie.data_len = htole64(entry->data_len);
+    ie.mtime = htole64(entry->mtime);
+    ie.atime = htole64(entry->atime);
+    ie.ctime = htole64(entry->ctime);
+    ie.parent = htole32(entry->parent);
+    ie.mode = htole32(entry->mode);
+    ie.uid = htole32(entry->uid);
+    ie.gid = htole32(entry->gid);
+    ie.typeflag = entry->typeflag;
+
+    ie.name_off = htole32(strtab_size);
+    strtab_size += strlen(entry->name) + 1;
+    if (entry->linkname[0]) {
+      ie.link_off = htole32(strtab_size);
+      strtab_size += strlen(entry->linkname) + 1;
+    }
+
+    if (fwrite(&ie, sizeof(ie), 1, out) != 1)
+      return -EIO;
+  }
+
+  /* write string table */
+  if (fputc(0, out) == EOF)
+    return -EIO;
+  for (i = 0; i < nr_entries; i++) {
+    if (fwrite(entries[i].name, strlen(entries[i].name) + 1, 1, out) != 1)
+      return -EIO;
+    if (entries[i].linkname[0] && fwrite(entries[i].linkname, strlen(entries[i].linkname) + 1, 1, out) != 1)
+      return -EIO;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t offset, last_hdr_off = 0;
+  FILE *fp, *out;
+  uint32_t root;
+  int err;
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage : %s <archive.tar> <index file>\n", argv[0]);
+    return 1;
+  }
+
+  /* open archive */
+  fp = fopen(argv[1], "rb");
+  if (!fp) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  /* create root entry */
+  if (get_or_create_entry(0, "/", NULL, NULL, 0, &root)) {
+    fprintf(stderr, "%s : out of memory\n", argv[0]);
+    return 1;
+  }
+
+  /* parse archive (stop on first bad header, like the kernel does) */
+  for (offset = 0; (err = parse_entry(fp, &offset, &last_hdr_off)) == 0;);
+  if (err == -ENOTSUP) {
+    fprintf(stderr, "%s : %s has sparse members, mount it without index\n", argv[0], argv[1]);
+    return 1;
+  }
+
+  /* write index */
+  out = fopen(argv[2], "wb");
+  if (!out) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  err = write_index(fp, out, offset, last_hdr_off);
+  if (fclose(out) || err) {
+    fprintf(stderr, "%s : can't write index %s\n", argv[0], argv[2]);
+    return 1;
+  }
+
+  printf("%s : %u entries, archive size %llu\n", argv[2], nr_entries, (unsigned long long) offset);
+  fclose(fp);
+  return 0;
+}
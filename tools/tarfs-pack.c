@@ -0,0 +1,509 @@
+/*
+ * tarfs-pack : build a standard tar archive optimized for TarFS.
+ *
+ * Usage : tarfs-pack [-a alignment] [-t trace] <archive.tar> <directory>
+ *
+ * Data of each regular file starts on an alignment boundary (4096 bytes by default), so TarFS can share the
+ * page cache of the archive. Padding is made of pax extended headers holding a comment record, which tar
+ * readers ignore. A pax global header at the start of the archive marks it as aligned.
+ *
+ * Files listed in the trace file (one path relative to the directory per line, in access order) are stored
+ * first, so files used together are adjacent in the archive.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "tar.h"
+
+#define DEFAULT_ALIGN                       4096
+#define LONG_NAME                           "././@LongLink"
+
+/*
+ * Archive member.
+ */
+struct member {
+  char                  *path;                /* path relative to the directory */
+  struct stat           st;                   /* file status */
+  int                   order;                /* trace order (-1 = not traced) */
+  int                   walk;                 /* walk order */
+};
+
+static struct member *members;
+static size_t nr_members, max_members;
+static size_t root_len;
+
+static FILE *out;
+static uint64_t out_off;
+
+/*
+ * Add a member (nftw callback).
+ */
+static int add_member(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  struct member *member;
+
+  (void) type;
+
+  /* skip root directory and sockets */
+  if (ftw->level == 0 || S_ISSOCK(st->st_mode))
+    return 0;
+
+  /* grow members */
+  if (nr_members == max_members) {
+    max_members = max_members ? max_members * 2 : 1024;
+    members = realloc(members, sizeof(struct member) * max_members);
+    if (!members)
+      return -1;
+  }
+
+  member = &members[nr_members];
+  member->path = strdup(path + root_len + 1);
+  if (!member->path)
+    return -1;
+  member->st = *st;
+  member->order = -1;
+  member->walk = nr_members++;
+
+  return 0;
+}
+
+/*
+ * Compare members path (used to find traced files).
+ */
+static int cmp_path(const void *a, const void *b)
+{
+  return strcmp(((const struct member *) a)->path, ((const struct member *) b)->path);
+}
+
+/*
+ * Compare members archive order : directories, then traced files in trace order, then other files in walk order.
+ */
+static int cmp_order(const void *a, const void *b)
+{
+  const struct member *ma = a, *mb = b;
+  int da = S_ISDIR(ma->st.st_mode), db = S_ISDIR(mb->st.st_mode);
+
+  if (da != db)
+    return db - da;
+
+  if (!da && (ma->order >= 0 || mb->order >= 0)) {
+    if (ma->order < 0)
+      return 1;
+    if (mb->order < 0)
+      return -1;
+    if (ma->order != mb->order)
+      return ma->order - mb->order;
+  }
+
+  return ma->walk - mb->walk;
+}
+
+/*
+ * Load an access trace.
+ */
+static int load_trace(const char *path)
+{
+  struct member key, *member;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int order;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return -errno;
+
+  qsort(members, nr_members, sizeof(struct member), cmp_path);
+
+  for (order = 0; (len = getline(&line, &size, fp)) >= 0;) {
+    /* strip end of line and "./" */
+    if (len && line[len - 1] == '\n')
+      line[--len] = 0;
+    key.path = line;
+    while (!strncmp(key.path, "./", 2))
+      key.path += 2;
+
+    /* keep first access only */
+    member = bsearch(&key, members, nr_members, sizeof(struct member), cmp_path);
+    if (member && member->order < 0)
+      member->order = order++;
+  }
+
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Write data to the archive.
+ */
+static int write_data(const void *buf, size_t len)
+{
+  if (len && fwrite(buf, len, 1, out) != 1)
+    return -EIO;
+
+  out_off += len;
+  return 0;
+}
+
+/*
+ * Pad archive to a block boundary.
+ */
+static int write_padding(void)
+{
+  static const char zero[TAR_BLOCK_SIZE];
+
+  return write_data(zero, TAR_ALIGN_UP(out_off) - out_off);
+}
+
+/*
+ * Write a string header field (long strings are truncated, they are stored in long name members).
+ */
+static void set_string(char *field, size_t len, const char *str)
+{
+  size_t n = strlen(str);
+
+  memcpy(field, str, n < len ? n : len - 1);
+}
+
+/*
+ * Write an octal header field (null terminated).
+ */
+static int set_octal(char *field, size_t len, uint64_t val)
+{
+  char tmp[32];
+
+  if ((size_t) snprintf(tmp, sizeof(tmp), "%0*llo", (int) len - 1, (unsigned long long) val) >= len)
+    return -ERANGE;
+
+  memcpy(field, tmp, len);
+  return 0;
+}
+
+/*
+ * Write a header (checksum is computed here).
+ */
+static int write_header(struct tar_header *hdr)
+{
+  char block[TAR_BLOCK_SIZE];
+  unsigned int sum, i;
+
+  memset(block, 0, sizeof(block));
+  memcpy(hdr->magic, TAR_MAGIC_STR, sizeof(hdr->magic));
+  memcpy(hdr->version, " ", sizeof(hdr->version));
+  memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+  memcpy(block, hdr, sizeof(struct tar_header));
+
+  for (i = 0, sum = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += (unsigned char) block[i];
+  snprintf(block + offsetof(struct tar_header, chksum), sizeof(hdr->chksum), "%06o", sum);
+
+  return write_data(block, TAR_BLOCK_SIZE);
+}
+
+/*
+ * Write a special member (long name, pax header) : header and data.
+ */
+static int write_special(char typeflag, const char *name, const char *data, size_t len)
+{
+  struct tar_header hdr;
+  int err;
+
+  memset(&hdr, 0, sizeof(hdr));
+  set_string(hdr.name, sizeof(hdr.name), name);
+  set_octal(hdr.mode, sizeof(hdr.mode), 0644);
+  set_octal(hdr.uid, sizeof(hdr.uid), 0);
+  set_octal(hdr.gid, sizeof(hdr.gid), 0);
+  set_octal(hdr.mtime, sizeof(hdr.mtime), 0);
+  hdr.typeflag = typeflag;
+
+  err = set_octal(hdr.size, sizeof(hdr.size), len);
+  if (!err)
+    err = write_header(&hdr);
+  if (!err)
+    err = write_data(data, len);
+  if (!err)
+    err = write_padding();
+
+  return err;
+}
+
+/*
+ * Build a pax record of exactly len bytes : "<len> <keyword><value padded with '0'>\n".
+ */
+static char *pax_record(const char *keyword, const char *value, size_t len)
+{
+  size_t digits, fixed;
+  char *rec;
+
+  fixed = 1 + strlen(keyword) + strlen(value) + 1;
+  for (digits = 1; snprintf(NULL, 0, "%zu", len) != (int) digits; digits++);
+  if (len < digits + fixed)
+    return NULL;
+
+  rec = malloc(len + 1);
+  if (!rec)
+    return NULL;
+
+  sprintf(rec, "%zu %s%s", len, keyword, value);
+  memset(rec + digits + fixed - 1, '0', len - digits - fixed);
+  rec[len - 1] = '\n';
+  rec[len] = 0;
+
+  return rec;
+}
+
+/*
+ * Size of a pax record without padding.
+ */
+static size_t pax_record_size(const char *keyword, const char *value)
+{
+  size_t fixed = 1 + strlen(keyword) + strlen(value) + 1, len;
+
+  for (len = fixed + 1; snprintf(NULL, 0, "%zu", len) + fixed != len; len++);
+  return len;
+}
+
+/*
+ * Write a filler member of exactly len bytes (len must be a multiple of the block size, at least 2 blocks).
+ */
+static int write_filler(size_t len)
+{
+  char *rec;
+  int err;
+
+  rec = pax_record("comment=", "", len - TAR_BLOCK_SIZE);
+  if (!rec)
+    return -EINVAL;
+
+  err = write_special(TAR_XHDTYPE, "PaxHeaders/filler", rec, len - TAR_BLOCK_SIZE);
+  free(rec);
+  return err;
+}
+
+/*
+ * Size of a long name member.
+ */
+static size_t long_name_size(const char *name)
+{
+  return strlen(name) < 100 ? 0 : TAR_BLOCK_SIZE + TAR_ALIGN_UP(strlen(name) + 1);
+}
+
+/*
+ * Copy a file data to the archive.
+ */
+static int write_file_data(const char *root, struct member *member)
+{
+  char path[PATH_MAX], buf[65536];
+  uint64_t left = member->st.st_size;
+  size_t len;
+  FILE *fp;
+  int err = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", root, member->path);
+  fp = fopen(path, "rb");
+  if (!fp)
+    return -errno;
+
+  while (left && !err) {
+    len = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), fp);
+    if (!len) {
+      err = -EIO;
+      break;
+    }
+
+    err = write_data(buf, len);
+    left -= len;
+  }
+
+  fclose(fp);
+  return err ? err : write_padding();
+}
+
+/*
+ * Write a member.
+ */
+static int write_member(const char *root, struct member *member, size_t align, const char *hardlink)
+{
+  char name[PATH_MAX + 1], linkname[PATH_MAX], path[PATH_MAX];
+  struct stat *st = &member->st;
+  struct tar_header hdr;
+  size_t prefix, gap;
+  uint64_t size = 0;
+  ssize_t len;
+  int err;
+
+  /* build name (directories end with '/') */
+  snprintf(name, sizeof(name), S_ISDIR(st->st_mode) ? "%s/" : "%s", member->path);
+
+  /* build link name */
+  linkname[0] = 0;
+  if (hardlink) {
+    snprintf(linkname, sizeof(linkname), "%s", hardlink);
+  } else if (S_ISLNK(st->st_mode)) {
+    snprintf(path, sizeof(path), "%s/%s", root, member->path);
+    len = readlink(path, linkname, sizeof(linkname) - 1);
+    if (len < 0)
+      return -errno;
+    linkname[len] = 0;
+  }
+
+  /* set header */
+  memset(&hdr, 0, sizeof(hdr));
+  set_string(hdr.name, sizeof(hdr.name), name);
+  set_string(hdr.linkname, sizeof(hdr.linkname), linkname);
+  err = set_octal(hdr.mode, sizeof(hdr.mode), st->st_mode & 07777);
+  err = err ? err : set_octal(hdr.uid, sizeof(hdr.uid), st->st_uid);
+  err = err ? err : set_octal(hdr.gid, sizeof(hdr.gid), st->st_gid);
+  err = err ? err : set_octal(hdr.mtime, sizeof(hdr.mtime), st->st_mtime);
+  if (err)
+    return err;
+
+  if (hardlink) {
+    hdr.typeflag = TAR_LNKTYPE;
+  } else if (S_ISREG(st->st_mode)) {
+    hdr.typeflag = TAR_REGTYPE;
+    size = st->st_size;
+  } else if (S_ISDIR(st->st_mode)) {
+    hdr.typeflag = TAR_DIRTYPE;
+  } else if (S_ISLNK(st->st_mode)) {
+    hdr.typeflag = TAR_SYMTYPE;
+  } else if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+    hdr.typeflag = S_ISCHR(st->st_mode) ? TAR_CHRTYPE : TAR_BLKTYPE;
+    if (set_octal(hdr.devmajor, sizeof(hdr.devmajor), major(st->st_rdev))
+        || set_octal(hdr.devminor, sizeof(hdr.devminor), minor(st->st_rdev)))
+      return -ERANGE;
+  } else {
+    hdr.typeflag = TAR_FIFOTYPE;
+  }
+  if (set_octal(hdr.size, sizeof(hdr.size), size))
+    return -EFBIG;
+
+  /* align data : add a filler before long names and header */
+  if (size) {
+    prefix = long_name_size(name) + long_name_size(linkname);
+    gap = (align - (out_off + prefix + TAR_BLOCK_SIZE) % align) % align;
+    if (gap && gap < 2 * TAR_BLOCK_SIZE)
+      gap += align;
+    if (gap && (err = write_filler(gap)))
+      return err;
+  }
+
+  /* write long names */
+  if (strlen(linkname) >= 100 && (err = write_special(TAR_LONGLINK, LONG_NAME, linkname, strlen(linkname) + 1)))
+    return err;
+  if (strlen(name) >= 100 && (err = write_special(TAR_LONGNAME, LONG_NAME, name, strlen(name) + 1)))
+    return err;
+
+  /* write header and data */
+  err = write_header(&hdr);
+  if (!err && size)
+    err = write_file_data(root, member);
+
+  return err;
+}
+
+/*
+ * Find the first member sharing a file (hard links).
+ */
+static const char *find_hardlink(size_t i)
+{
+  size_t j;
+
+  if (!S_ISREG(members[i].st.st_mode) || members[i].st.st_nlink < 2)
+    return NULL;
+
+  for (j = 0; j < i; j++)
+    if (members[j].st.st_ino == members[i].st.st_ino && members[j].st.st_dev == members[i].st.st_dev)
+      return members[j].path;
+
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  const char *trace = NULL, *root;
+  char marker[64], *rec;
+  size_t align = DEFAULT_ALIGN, i;
+  char zero[2 * TAR_BLOCK_SIZE];
+  int opt, err = 0;
+
+  while ((opt = getopt(argc, argv, "a:t:")) != -1) {
+    switch (opt) {
+      case 'a':
+        align = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        trace = optarg;
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (argc - optind != 2 || !align || align % TAR_BLOCK_SIZE)
+    goto usage;
+
+  /* list directory */
+  root = argv[optind + 1];
+  root_len = strlen(root);
+  while (root_len > 1 && root[root_len - 1] == '/')
+    root_len--;
+  if (nftw(root, add_member, 64, FTW_PHYS) != 0) {
+    perror(root);
+    return 1;
+  }
+
+  /* order members */
+  if (trace && load_trace(trace)) {
+    perror(trace);
+    return 1;
+  }
+  qsort(members, nr_members, sizeof(struct member), cmp_order);
+
+  /* create archive */
+  out = fopen(argv[optind], "wb");
+  if (!out) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  /* write aligned archive marker */
+  snprintf(marker, sizeof(marker), "%zu", align);
+  rec = pax_record(TAR_ALIGNED_MARKER, marker, pax_record_size(TAR_ALIGNED_MARKER, marker));
+  err = rec ? write_special(TAR_XGLTYPE, "pax_global_header", rec, strlen(rec)) : -ENOMEM;
+  free(rec);
+
+  /* write members */
+  for (i = 0; i < nr_members && !err; i++) {
+    err = write_member(root, &members[i], align, find_hardlink(i));
+    if (err)
+      fprintf(stderr, "%s : can't add %s (%s)\n", argv[0], members[i].path, strerror(-err));
+  }
+
+  /* write end of archive */
+  memset(zero, 0, sizeof(zero));
+  if (!err)
+    err = write_data(zero, sizeof(zero));
+
+  if (fclose(out) || err) {
+    fprintf(stderr, "%s : can't write archive %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+
+  printf("%s : %zu members, archive size %llu\n", argv[optind], nr_members, (unsigned long long) out_off);
+  return 0;
+usage:
+  fprintf(stderr, "Usage : %s [-a alignment] [-t trace] <archive.tar> <directory>\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,136 @@
+/*
+ * tarfs-walk : dump metadata of a mounted TarFS subtree with the TARFS_IOC_WALK ioctl.
+ *
+ * Usage : tarfs-walk [-q] <directory>
+ *
+ * One line is printed per entry (inode number, mode, uid, gid, size, mtime, data offset, path). With -q, nothing is
+ * printed : only the number of entries and the walk time are shown.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "tarfs_ioctl.h"
+
+#define WALK_BUF_SIZE                       (1 << 20)
+
+/*
+ * Paths of walked directories (indexed by inode number).
+ */
+static char **paths;
+static uint32_t nr_paths;
+
+/*
+ * Get path of a directory (NULL = walked directory).
+ */
+static const char *get_path(uint32_t ino)
+{
+  return ino < nr_paths ? paths[ino] : NULL;
+}
+
+/*
+ * Save path of a directory.
+ */
+static int set_path(uint32_t ino, const char *parent, const char *name)
+{
+  uint32_t nr = nr_paths;
+  char **tmp;
+
+  if (ino >= nr_paths) {
+    nr = nr_paths ? nr_paths : 1024;
+    while (nr <= ino)
+      nr *= 2;
+    tmp = realloc(paths, sizeof(char *) * nr);
+    if (!tmp)
+      return -ENOMEM;
+    memset(tmp + nr_paths, 0, sizeof(char *) * (nr - nr_paths));
+    paths = tmp;
+    nr_paths = nr;
+  }
+
+  free(paths[ino]);
+  if (asprintf(&paths[ino], "%s/%s", parent ? parent : ".", name) < 0)
+    return -ENOMEM;
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct tarfs_walk_record *rec;
+  struct timespec start, end;
+  struct tarfs_walk walk;
+  uint64_t nr_entries = 0;
+  int fd, quiet = 0, c;
+  const char *parent;
+  char *buf, *p;
+  uint32_t i;
+
+  while ((c = getopt(argc, argv, "q")) != -1) {
+    if (c != 'q')
+      goto usage;
+    quiet = 1;
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  /* open directory */
+  fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  buf = malloc(WALK_BUF_SIZE);
+  if (!buf) {
+    fprintf(stderr, "%s : out of memory\n", argv[0]);
+    return 1;
+  }
+
+  /* walk subtree */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(&walk, 0, sizeof(struct tarfs_walk));
+  walk.buf = (uintptr_t) buf;
+  walk.buf_size = WALK_BUF_SIZE;
+  do {
+    if (ioctl(fd, TARFS_IOC_WALK, &walk) < 0) {
+      perror("TARFS_IOC_WALK");
+      return 1;
+    }
+
+    nr_entries += walk.nr_records;
+    if (quiet)
+      continue;
+
+    /* print records (parents come first) */
+    for (i = 0, p = buf; i < walk.nr_records; i++, p += rec->rec_len) {
+      rec = (struct tarfs_walk_record *) p;
+      parent = get_path(rec->parent);
+      printf("%u %06o %u %u %llu %lld %llu %s/%s\n", rec->ino, rec->mode, rec->uid, rec->gid,
+             (unsigned long long) rec->size, (long long) rec->mtime, (unsigned long long) rec->data_off,
+             parent ? parent : ".", rec->name);
+
+      if ((rec->mode & 0170000) == 0040000 && set_path(rec->ino, parent, rec->name)) {
+        fprintf(stderr, "%s : out of memory\n", argv[0]);
+        return 1;
+      }
+    }
+  } while (!(walk.flags & TARFS_WALK_DONE));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fprintf(stderr, "%llu entries walked in %.3f ms\n", (unsigned long long) nr_entries,
+          (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  close(fd);
+  return 0;
+usage:
+  fprintf(stderr, "Usage : %s [-q] <directory>\n", argv[0]);
+  return 1;
+}